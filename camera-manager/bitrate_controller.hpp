@@ -0,0 +1,312 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "logger.hpp"
+
+// Adaptive stream bitrate.
+//
+// The RTSP re-broadcaster reports loss and jitter from the RTCP receiver
+// reports of its clients (and the send queue for clients using TCP). When the
+// worst client is losing packets, the camera's stream bitrate is stepped down,
+// once the link is clean again it is stepped back up, up to the bitrate that
+// was set by the user.
+//
+// Stepping down and up use separate thresholds and each change is followed by
+// a minimum dwell time, so the encoder is not reconfigured all the time.
+//
+// The bitrate set by the user is the ceiling. It is kept apart from the
+// camera's current bitrate, which may be stepped down, and saved on its own,
+// so neither a reconnect nor a restart turns a lowered bitrate into the new
+// ceiling.
+
+struct LinkStats {
+    unsigned clients{0};
+    // Worst of all clients
+    double fraction_lost{0.0};
+    double jitter_ms{0.0};
+    std::uint64_t send_queue_bytes{0};
+};
+
+// Parse the report of rtsp_rebroadcast's stats endpoint.
+[[nodiscard]] inline std::optional<LinkStats> parse_link_stats(const std::string& report)
+{
+    std::istringstream lines(report);
+    std::string line;
+
+    bool found_clients = false;
+    LinkStats stats{};
+
+    while (std::getline(lines, line)) {
+        std::istringstream fields(line);
+        std::string field;
+        bool is_client = false;
+
+        while (fields >> field) {
+            const auto pos = field.find('=');
+            if (pos == std::string::npos) {
+                continue;
+            }
+            const auto key = field.substr(0, pos);
+            const auto value = field.substr(pos + 1);
+
+            if (key == "clients") {
+                found_clients = true;
+            } else if (key == "client") {
+                is_client = true;
+                ++stats.clients;
+            } else if (!is_client) {
+                continue;
+            } else if (key == "fraction_lost") {
+                stats.fraction_lost = std::max(stats.fraction_lost, std::strtod(value.c_str(), nullptr));
+            } else if (key == "jitter_ms") {
+                stats.jitter_ms = std::max(stats.jitter_ms, std::strtod(value.c_str(), nullptr));
+            } else if (key == "send_queue") {
+                stats.send_queue_bytes = std::max<std::uint64_t>(
+                    stats.send_queue_bytes, std::strtoull(value.c_str(), nullptr, 10));
+            }
+        }
+    }
+
+    if (!found_clients) {
+        return std::nullopt;
+    }
+    return stats;
+}
+
+// Fetch the report from the stats endpoint on localhost.
+[[nodiscard]] inline std::optional<LinkStats> fetch_link_stats(unsigned port)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LogLine(LogLevel::Err) << "Error creating socket: " << strerror(errno);
+        return std::nullopt;
+    }
+
+    struct timeval tv{};
+    tv.tv_sec = 0;
+    tv.tv_usec = 500000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        // Not running (yet), nothing to complain about.
+        close(fd);
+        return std::nullopt;
+    }
+
+    const std::string request = "GET / HTTP/1.0\r\n\r\n";
+    if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return std::nullopt;
+    }
+
+    std::string response;
+    char buffer[4096];
+    while (true) {
+        const auto received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            break;
+        }
+        response.append(buffer, static_cast<std::size_t>(received));
+    }
+    close(fd);
+
+    const auto body = response.find("\r\n\r\n");
+    if (body == std::string::npos) {
+        return std::nullopt;
+    }
+    return parse_link_stats(response.substr(body + 4));
+}
+
+// The ceiling saved last time, if any.
+[[nodiscard]] inline std::optional<unsigned> read_bitrate_ceiling(const std::string& path)
+{
+    std::ifstream file(path);
+    std::string line;
+    const std::string key = "stream_bitrate_ceiling_kbps=";
+    while (std::getline(file, line)) {
+        if (line.compare(0, key.size(), key) != 0) {
+            continue;
+        }
+        char* end = nullptr;
+        const auto kbps = std::strtoul(line.c_str() + key.size(), &end, 10);
+        if (end == line.c_str() + key.size() || *end != '\0' || kbps == 0) {
+            return std::nullopt;
+        }
+        return static_cast<unsigned>(kbps);
+    }
+    return std::nullopt;
+}
+
+[[nodiscard]] inline bool write_bitrate_ceiling(const std::string& path, unsigned kbps)
+{
+    std::error_code ec;
+    const std::filesystem::path fs_path{path};
+    if (fs_path.has_parent_path()) {
+        std::filesystem::create_directories(fs_path.parent_path(), ec);
+    }
+
+    // Write and rename, so a power loss does not leave half a file.
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << "stream_bitrate_ceiling_kbps=" << kbps << '\n';
+        if (!file) {
+            LogLine(LogLevel::Err) << "Could not write bitrate ceiling " << tmp_path;
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp_path, fs_path, ec);
+    if (ec) {
+        LogLine(LogLevel::Err) << "Could not write bitrate ceiling " << path << ": " << ec.message();
+        return false;
+    }
+    return true;
+}
+
+class BitrateController {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Step down when any of these are exceeded.
+    static constexpr double congested_fraction_lost = 0.05;
+    static constexpr double congested_jitter_ms = 50.0;
+    static constexpr std::uint64_t congested_send_queue_bytes = 256 * 1024;
+
+    // Only step up when all are below these.
+    static constexpr double clean_fraction_lost = 0.01;
+    static constexpr double clean_jitter_ms = 20.0;
+    static constexpr std::uint64_t clean_send_queue_bytes = 32 * 1024;
+
+    // How many samples in a row it takes to change.
+    static constexpr unsigned congested_samples = 2;
+    static constexpr unsigned clean_samples = 10;
+
+    // Minimum time between two changes, longer for going up because probing a
+    // higher bitrate on a bad link costs more than staying low for a while.
+    static constexpr std::chrono::seconds dwell_down{5};
+    static constexpr std::chrono::seconds dwell_up{30};
+
+    // The bitrates the camera supports, in kbps, ascending.
+    void set_allowed(std::vector<unsigned> allowed_kbps)
+    {
+        _allowed = std::move(allowed_kbps);
+        std::sort(_allowed.begin(), _allowed.end());
+    }
+
+    // The bitrate the user chose, we don't go above that.
+    void set_ceiling(unsigned kbps, Clock::time_point now)
+    {
+        _ceiling = kbps;
+        _current = kbps;
+        _last_change = now;
+        _congested_count = 0;
+        _clean_count = 0;
+    }
+
+    [[nodiscard]] unsigned current() const { return _current; }
+    [[nodiscard]] unsigned ceiling() const { return _ceiling; }
+
+    // The change could not be applied, go on from what the camera actually uses.
+    void revert(unsigned kbps) { _current = kbps; }
+
+    // Feed one sample, returns the new bitrate if it should be changed.
+    [[nodiscard]] std::optional<unsigned> update(const LinkStats& stats, Clock::time_point now)
+    {
+        if (_allowed.empty() || stats.clients == 0) {
+            // Nobody watching, nothing to learn.
+            _congested_count = 0;
+            _clean_count = 0;
+            return std::nullopt;
+        }
+
+        const bool congested =
+            stats.fraction_lost > congested_fraction_lost ||
+            stats.jitter_ms > congested_jitter_ms ||
+            stats.send_queue_bytes > congested_send_queue_bytes;
+
+        const bool clean =
+            stats.fraction_lost < clean_fraction_lost &&
+            stats.jitter_ms < clean_jitter_ms &&
+            stats.send_queue_bytes < clean_send_queue_bytes;
+
+        _congested_count = congested ? _congested_count + 1 : 0;
+        _clean_count = clean ? _clean_count + 1 : 0;
+
+        if (_congested_count >= congested_samples && now - _last_change >= dwell_down) {
+            const auto lower = step_down();
+            if (lower) {
+                return change(lower.value(), now);
+            }
+        } else if (_clean_count >= clean_samples && now - _last_change >= dwell_up) {
+            const auto higher = step_up();
+            if (higher) {
+                return change(higher.value(), now);
+            }
+        }
+
+        return std::nullopt;
+    }
+
+private:
+    [[nodiscard]] std::optional<unsigned> step_down() const
+    {
+        std::optional<unsigned> result;
+        for (const auto kbps : _allowed) {
+            if (kbps < _current) {
+                result = kbps;
+            }
+        }
+        return result;
+    }
+
+    [[nodiscard]] std::optional<unsigned> step_up() const
+    {
+        for (const auto kbps : _allowed) {
+            if (kbps > _current && kbps <= _ceiling) {
+                return kbps;
+            }
+        }
+        return std::nullopt;
+    }
+
+    unsigned change(unsigned kbps, Clock::time_point now)
+    {
+        _current = kbps;
+        _last_change = now;
+        _congested_count = 0;
+        _clean_count = 0;
+        return kbps;
+    }
+
+    std::vector<unsigned> _allowed;
+    unsigned _ceiling{0};
+    unsigned _current{0};
+    Clock::time_point _last_change{};
+    unsigned _congested_count{0};
+    unsigned _clean_count{0};
+};
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <lzma.h>
+
+#include "logger.hpp"
+
+// MAVLink camera definition file.
+//
+// The stream parameters depend on what the camera's firmware supports, so
+// they are generated from a capability table plus what the camera reported,
+// into the installed definition which is used as a template for everything
+// else (e.g. the translations). The result is cached per firmware version,
+// next to a hash of its parameters, so it is generated again once the camera
+// reports more (e.g. a bitrate which wasn't in the table).
+// The definition version is only increased when the generated parameters
+// differ from any earlier one, so ground stations can keep their copy.
+//
+// Over a telemetry radio, downloading the definition using MAVLink FTP takes
+// a while at every connect. The ground station also accepts it xz compressed
+// (with a ".xml.xz" URI), which is a fraction of the size, so we compress it
+// at startup and serve that from a tmpfs directory instead of from disk.
+
+struct StreamCapabilities {
+    struct Resolution {
+        unsigned width{0};
+        unsigned height{0};
+        // Descending
+        std::vector<unsigned> bitrates_kbps;
+    };
+
+    // The index is the value of STREAM_RES.
+    std::vector<Resolution> resolutions;
+    // Values of STREAM_CODEC, 1: H264, 2: H265
+    std::vector<int> codecs;
+
+    // Add what the camera is using, if we didn't know about it.
+    void add_bitrate(unsigned width, unsigned height, unsigned kbps)
+    {
+        for (auto& resolution : resolutions) {
+            if (resolution.width == width && resolution.height == height &&
+                std::find(resolution.bitrates_kbps.begin(), resolution.bitrates_kbps.end(), kbps) ==
+                    resolution.bitrates_kbps.end()) {
+                resolution.bitrates_kbps.push_back(kbps);
+                std::sort(resolution.bitrates_kbps.rbegin(), resolution.bitrates_kbps.rend());
+            }
+        }
+    }
+
+    void add_codec(int codec)
+    {
+        if (std::find(codecs.begin(), codecs.end(), codec) == codecs.end()) {
+            codecs.push_back(codec);
+            std::sort(codecs.begin(), codecs.end());
+        }
+    }
+
+    // All bitrates of all resolutions, descending.
+    [[nodiscard]] std::vector<unsigned> all_bitrates_kbps() const
+    {
+        std::vector<unsigned> result;
+        for (const auto& resolution : resolutions) {
+            for (const auto kbps : resolution.bitrates_kbps) {
+                if (std::find(result.begin(), result.end(), kbps) == result.end()) {
+                    result.push_back(kbps);
+                }
+            }
+        }
+        std::sort(result.rbegin(), result.rend());
+        return result;
+    }
+};
+
+// Compare "major.minor.patch" versions.
+[[nodiscard]] inline bool firmware_at_least(const std::string& version, const std::string& minimum)
+{
+    unsigned lhs[3]{};
+    unsigned rhs[3]{};
+    std::sscanf(version.c_str(), "%u.%u.%u", &lhs[0], &lhs[1], &lhs[2]);
+    std::sscanf(minimum.c_str(), "%u.%u.%u", &rhs[0], &rhs[1], &rhs[2]);
+    return std::lexicographical_compare(rhs, rhs + 3, lhs, lhs + 3) ||
+        std::equal(lhs, lhs + 3, rhs);
+}
+
+// What the stream supports, by the camera firmware version it was introduced with.
+[[nodiscard]] inline StreamCapabilities capabilities_for_firmware(const std::string& firmware_version)
+{
+    struct Entry {
+        const char* min_firmware_version;
+        StreamCapabilities capabilities;
+    };
+
+    // Newest first.
+    static const std::vector<Entry> table{
+        {"0.0.0", StreamCapabilities{
+            {
+                {1280, 720, {4000, 3000, 2000, 1600}},
+                {1920, 1080, {4000, 3000, 2000}},
+            },
+            {1, 2},
+        }},
+    };
+
+    for (const auto& entry : table) {
+        if (firmware_at_least(firmware_version, entry.min_firmware_version)) {
+            return entry.capabilities;
+        }
+    }
+    return table.back().capabilities;
+}
+
+[[nodiscard]] inline std::string bitrate_name(unsigned kbps)
+{
+    std::string result = std::to_string(kbps / 1000);
+    if (kbps % 1000 >= 100) {
+        result += "." + std::to_string((kbps % 1000) / 100);
+    }
+    return result + " Mbps";
+}
+
+// The <parameters> element for the capabilities.
+[[nodiscard]] inline std::string generate_parameters(const StreamCapabilities& capabilities)
+{
+    const auto all_bitrates = capabilities.all_bitrates_kbps();
+
+    std::ostringstream str;
+    str << "<parameters>\n"
+        << "        <!-- control = 0 tells us this should not create an automatic UI control -->\n"
+        << "        <parameter name=\"CAM_MODE\" type=\"int32\" default=\"1\" control=\"0\">\n"
+        << "            <description>Camera Mode</description>\n"
+        << "            <option name=\"Photo\" value=\"0\" />\n"
+        << "            <option name=\"Video\" value=\"1\" />\n"
+        << "        </parameter>\n";
+
+    str << "        <parameter name=\"STREAM_RES\" type=\"int32\" default=\"0\">\n"
+        << "            <description>Video stream resolution</description>\n"
+        << "            <options>\n";
+    for (std::size_t i = 0; i < capabilities.resolutions.size(); ++i) {
+        const auto& resolution = capabilities.resolutions[i];
+        str << "                <option name=\"" << resolution.width << 'x' << resolution.height
+            << "\" value=\"" << i << '"';
+        if (resolution.bitrates_kbps == all_bitrates) {
+            str << " />\n";
+            continue;
+        }
+        // Only some bitrates are possible with this resolution.
+        str << " >\n"
+            << "                    <parameterranges>\n"
+            << "                        <parameterrange parameter=\"STREAM_BITRATE\">\n";
+        for (const auto kbps : resolution.bitrates_kbps) {
+            str << "                            <roption name=\"" << bitrate_name(kbps)
+                << "\" value=\"" << kbps << "\" />\n";
+        }
+        str << "                        </parameterrange>\n"
+            << "                    </parameterranges>\n"
+            << "                </option>\n";
+    }
+    str << "            </options>\n"
+        << "        </parameter>\n";
+
+    const bool has_2000 = std::find(all_bitrates.begin(), all_bitrates.end(), 2000) != all_bitrates.end();
+    str << "        <parameter name=\"STREAM_BITRATE\" type=\"int32\" default=\""
+        << (has_2000 || all_bitrates.empty() ? 2000 : all_bitrates.back()) << "\">\n"
+        << "            <description>Video stream bitrate</description>\n"
+        << "            <options>\n";
+    for (const auto kbps : all_bitrates) {
+        str << "                <option name=\"" << bitrate_name(kbps) << "\" value=\"" << kbps << "\" />\n";
+    }
+    str << "            </options>\n"
+        << "        </parameter>\n";
+
+    const bool has_h265 = std::find(capabilities.codecs.begin(), capabilities.codecs.end(), 2) != capabilities.codecs.end();
+    str << "        <parameter name=\"STREAM_CODEC\" type=\"int32\" default=\"" << (has_h265 ? 2 : 1) << "\">\n"
+        << "            <description>Video stream codec</description>\n"
+        << "            <options>\n";
+    for (const auto codec : capabilities.codecs) {
+        str << "                <option name=\"" << (codec == 1 ? "H264" : "H265") << "\" value=\"" << codec << "\" />\n";
+    }
+    str << "            </options>\n"
+        << "        </parameter>\n"
+        << "    </parameters>";
+
+    return str.str();
+}
+
+[[nodiscard]] inline std::optional<std::string> read_file(const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        LogLine(LogLevel::Err) << "Could not open " << path;
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+[[nodiscard]] inline bool write_file(const std::filesystem::path& path, const std::vector<std::uint8_t>& content)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        LogLine(LogLevel::Err) << "Could not write " << path;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(content.data()), static_cast<std::streamsize>(content.size()));
+    return static_cast<bool>(file);
+}
+
+// The version in <definition version="..."> which the ground station uses
+// to decide whether its cached copy is still good.
+[[nodiscard]] inline std::optional<unsigned> definition_version(const std::string& xml)
+{
+    const auto definition = xml.find("<definition");
+    if (definition == std::string::npos) {
+        return std::nullopt;
+    }
+    const std::string attribute = "version=\"";
+    const auto version = xml.find(attribute, definition);
+    if (version == std::string::npos || version > xml.find('>', definition)) {
+        return std::nullopt;
+    }
+
+    const char* begin = xml.c_str() + version + attribute.size();
+    char* end = nullptr;
+    const auto result = std::strtoul(begin, &end, 10);
+    if (end == begin || *end != '"') {
+        return std::nullopt;
+    }
+    return static_cast<unsigned>(result);
+}
+
+// The <parameters> element as it is in the XML.
+[[nodiscard]] inline std::optional<std::string> parameters_of(const std::string& xml)
+{
+    const std::string end_tag = "</parameters>";
+    const auto begin = xml.find("<parameters>");
+    const auto end = xml.find(end_tag);
+    if (begin == std::string::npos || end == std::string::npos || end < begin) {
+        return std::nullopt;
+    }
+    return xml.substr(begin, end + end_tag.size() - begin);
+}
+
+// The template with the parameters and version replaced.
+[[nodiscard]] inline std::optional<std::string> generate_definition(
+    const std::string& template_xml, const std::string& parameters, unsigned version)
+{
+    const auto maybe_template_parameters = parameters_of(template_xml);
+    const auto maybe_template_version = definition_version(template_xml);
+    if (!maybe_template_parameters || !maybe_template_version) {
+        return std::nullopt;
+    }
+
+    std::string result = template_xml;
+    result.replace(result.find(maybe_template_parameters.value()), maybe_template_parameters.value().size(), parameters);
+
+    const std::string old_version = "version=\"" + std::to_string(maybe_template_version.value()) + "\"";
+    result.replace(
+        result.find(old_version, result.find("<definition")), old_version.size(),
+        "version=\"" + std::to_string(version) + "\"");
+    return result;
+}
+
+// FNV-1a, to tell whether the parameters of a cached definition are still the
+// ones we would generate.
+[[nodiscard]] inline std::string parameters_hash(const std::string& parameters)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const auto c : parameters) {
+        hash ^= static_cast<std::uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+    return hex;
+}
+
+// Get the definition for the firmware from the cache directory, or generate and
+// cache it. Returns the path of the definition.
+[[nodiscard]] inline std::optional<std::filesystem::path> cached_definition(
+    const std::filesystem::path& template_path,
+    const std::filesystem::path& cache_dir,
+    const std::string& firmware_version,
+    const StreamCapabilities& capabilities)
+{
+    namespace fs = std::filesystem;
+
+    const auto maybe_template = read_file(template_path);
+    if (!maybe_template) {
+        return std::nullopt;
+    }
+    const auto maybe_template_version = definition_version(maybe_template.value());
+    if (!maybe_template_version) {
+        LogLine(LogLevel::Err) << "No definition version found in " << template_path;
+        return std::nullopt;
+    }
+
+    const fs::path path = cache_dir / firmware_version / template_path.filename();
+    const fs::path hash_path = fs::path(path).concat(".hash");
+
+    const auto parameters = generate_parameters(capabilities);
+    const auto hash = parameters_hash(parameters);
+
+    // An older template means an older camera manager generated it, and
+    // another hash that the capabilities changed since.
+    std::error_code ec;
+    if (fs::exists(path, ec) && fs::exists(hash_path, ec)) {
+        const auto maybe_cached = read_file(path);
+        const auto maybe_cached_hash = read_file(hash_path);
+        if (maybe_cached && maybe_cached_hash && maybe_cached_hash.value() == hash) {
+            const auto maybe_cached_version = definition_version(maybe_cached.value());
+            if (maybe_cached_version && maybe_cached_version.value() >= maybe_template_version.value()) {
+                LogLine(LogLevel::Info) << "Using cached camera definition " << path;
+                return path;
+            }
+        }
+    }
+
+    // Keep the version of a definition with the same parameters, otherwise use a new one.
+    std::optional<unsigned> version;
+    unsigned max_version = maybe_template_version.value();
+    if (parameters_of(maybe_template.value()) == parameters) {
+        version = maybe_template_version.value();
+    }
+    for (const auto& entry : fs::directory_iterator(cache_dir, ec)) {
+        const auto maybe_other = read_file(entry.path() / template_path.filename());
+        if (!maybe_other) {
+            continue;
+        }
+        const auto maybe_other_version = definition_version(maybe_other.value());
+        if (!maybe_other_version) {
+            continue;
+        }
+        max_version = std::max(max_version, maybe_other_version.value());
+        if (!version && parameters_of(maybe_other.value()) == parameters &&
+            maybe_other_version.value() >= maybe_template_version.value()) {
+            version = maybe_other_version.value();
+        }
+    }
+    if (!version) {
+        version = max_version + 1;
+    }
+
+    const auto maybe_definition = generate_definition(maybe_template.value(), parameters, version.value());
+    if (!maybe_definition) {
+        LogLine(LogLevel::Err) << "Could not generate camera definition from " << template_path;
+        return std::nullopt;
+    }
+
+    fs::create_directories(path.parent_path(), ec);
+    if (ec) {
+        LogLine(LogLevel::Err) << "Could not create " << path.parent_path() << ": " << ec.message();
+        return std::nullopt;
+    }
+    if (!write_file(path, std::vector<std::uint8_t>(maybe_definition.value().begin(), maybe_definition.value().end())) ||
+        !write_file(hash_path, std::vector<std::uint8_t>(hash.begin(), hash.end()))) {
+        return std::nullopt;
+    }
+
+    LogLine(LogLevel::Info) << "Generated camera definition " << path << " (version " << version.value() << ")";
+    return path;
+}
+
+[[nodiscard]] inline std::optional<std::vector<std::uint8_t>> xz_compress(const std::string& data)
+{
+    std::vector<std::uint8_t> result(lzma_stream_buffer_bound(data.size()));
+    std::size_t result_size = 0;
+
+    // The decoder built into ground stations (xz-embedded) only does CRC32 for sure.
+    const auto ret = lzma_easy_buffer_encode(
+        9 | LZMA_PRESET_EXTREME, LZMA_CHECK_CRC32, nullptr,
+        reinterpret_cast<const std::uint8_t*>(data.data()), data.size(),
+        result.data(), &result_size, result.size());
+
+    if (ret != LZMA_OK) {
+        LogLine(LogLevel::Err) << "xz compression failed: " << ret;
+        return std::nullopt;
+    }
+
+    result.resize(result_size);
+    return result;
+}
+
+struct ServedDefinition {
+    std::string root_dir;
+    std::string uri;
+    unsigned version{0};
+};
+
+// Compress the definition into the directory (which should be on a tmpfs) to be
+// used as the FTP root.
+[[nodiscard]] inline std::optional<ServedDefinition> prepare_compressed_definition(
+    const std::filesystem::path& xml_path, const std::filesystem::path& root_dir)
+{
+    const auto maybe_xml = read_file(xml_path);
+    if (!maybe_xml) {
+        return std::nullopt;
+    }
+
+    const auto maybe_version = definition_version(maybe_xml.value());
+    if (!maybe_version) {
+        LogLine(LogLevel::Err) << "No definition version found in " << xml_path;
+        return std::nullopt;
+    }
+
+    const auto maybe_compressed = xz_compress(maybe_xml.value());
+    if (!maybe_compressed) {
+        return std::nullopt;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(root_dir, ec);
+    if (ec) {
+        LogLine(LogLevel::Err) << "Could not create " << root_dir << ": " << ec.message();
+        return std::nullopt;
+    }
+
+    const auto filename = xml_path.filename().string() + ".xz";
+    if (!write_file(root_dir / filename, maybe_compressed.value())) {
+        return std::nullopt;
+    }
+
+    LogLine(LogLevel::Info) << "Camera definition compressed from " << maybe_xml.value().size()
+                            << " to " << maybe_compressed.value().size() << " bytes";
+
+    return ServedDefinition{root_dir.string(), "mftp://" + filename, maybe_version.value()};
+}
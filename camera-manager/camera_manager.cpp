@@ -1,9 +1,13 @@
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <utility>
 #include <vector>
 #include <chrono>
 #include <thread>
 #include <filesystem>
+#include <mutex>
+#include <optional>
 #include <mavsdk/mavsdk.h>
 #include <mavsdk/log_callback.h>
 #include <mavsdk/plugins/camera_server/camera_server.h>
@@ -11,6 +15,10 @@
 #include <mavsdk/plugins/param_server/param_server.h>
 #include "siyi_protocol.hpp"
 #include "siyi_camera.hpp"
+#include "bitrate_controller.hpp"
+#include "shutter_timing.hpp"
+#include "camera_definition.hpp"
+#include "logger.hpp"
 
 class CommandLineParser {
 public:
@@ -20,6 +28,15 @@ public:
                   << "  --connection <connection string>   Specify a connection string (can be used multiple times)\n"
                   << "  --forwarding <on|off>              Enable or disable forwarding (default off)\n"
                   << "  --stream-url <stream string>       Specify the stream URL\n"
+                  << "  --adaptive-bitrate <on|off>        Lower the bitrate when clients lose packets (default off)\n"
+                  << "  --stats-port <port>                Port of the rtsp_rebroadcast client stats (default 8555)\n"
+                  << "  --cache-dir <path>                 Where generated camera definitions are kept\n"
+                  << "                                     (default /var/cache/siyi-camera-manager)\n"
+                  << "  --mux <socket>                     Share the camera through siyi_mux\n"
+                  << "  --capture <path>                   Record the traffic with the camera, for siyi_replay\n"
+                  << "  --shutter-offset-ms <ms>           When pictures are exposed, relative to the camera's feedback\n"
+                  << "                                     (negative if before, see siyi_cli calibrate_shutter, default 0)\n"
+                  << "  --log-level <debug|info|warn|error> Least important messages logged (default info)\n"
                   << "  --help                             Show this help message\n";
     }
 
@@ -65,6 +82,87 @@ public:
                     std::cerr << "Error: --stream-url requires a value" << std::endl;
                     return Result::Invalid;
                 }
+            } else if (current_arg == "--adaptive-bitrate") {
+                if (i + 1 < argc) {
+                    auto option = std::string(argv[++i]);
+                    if (option == "on") {
+                        adaptive_bitrate = true;
+                    } else if (option == "off") {
+                        adaptive_bitrate = false;
+                    } else {
+                        std::cerr << "Error: --adaptive-bitrate requires 'on' or 'off'" << std::endl;
+                        return Result::Invalid;
+                    }
+                } else {
+                    std::cerr << "Error: --adaptive-bitrate requires a value" << std::endl;
+                    return Result::Invalid;
+                }
+            } else if (current_arg == "--stats-port") {
+                if (i + 1 < argc) {
+                    char* end = nullptr;
+                    const auto port = std::strtoul(argv[++i], &end, 10);
+                    if (*end != '\0' || port == 0 || port > 65535) {
+                        std::cerr << "Error: --stats-port requires a valid port" << std::endl;
+                        return Result::Invalid;
+                    }
+                    stats_port = static_cast<unsigned>(port);
+                } else {
+                    std::cerr << "Error: --stats-port requires a value" << std::endl;
+                    return Result::Invalid;
+                }
+            } else if (current_arg == "--shutter-offset-ms") {
+                if (i + 1 < argc) {
+                    char* end = nullptr;
+                    const auto offset = std::strtol(argv[++i], &end, 10);
+                    if (*end != '\0' || offset < -10000 || offset > 10000) {
+                        std::cerr << "Error: --shutter-offset-ms requires milliseconds between -10000 and 10000" << std::endl;
+                        return Result::Invalid;
+                    }
+                    shutter_offset = std::chrono::milliseconds(offset);
+                } else {
+                    std::cerr << "Error: --shutter-offset-ms requires a value" << std::endl;
+                    return Result::Invalid;
+                }
+            } else if (current_arg == "--mux") {
+                if (i + 1 < argc) {
+                    mux_socket = argv[++i];
+                } else {
+                    std::cerr << "Error: --mux requires a value" << std::endl;
+                    return Result::Invalid;
+                }
+            } else if (current_arg == "--capture") {
+                if (i + 1 < argc) {
+                    capture_path = argv[++i];
+                } else {
+                    std::cerr << "Error: --capture requires a value" << std::endl;
+                    return Result::Invalid;
+                }
+            } else if (current_arg == "--log-level") {
+                if (i + 1 < argc) {
+                    auto option = std::string(argv[++i]);
+                    if (option == "debug") {
+                        log_level = LogLevel::Debug;
+                    } else if (option == "info") {
+                        log_level = LogLevel::Info;
+                    } else if (option == "warn") {
+                        log_level = LogLevel::Warn;
+                    } else if (option == "error") {
+                        log_level = LogLevel::Err;
+                    } else {
+                        std::cerr << "Error: --log-level requires 'debug', 'info', 'warn' or 'error'" << std::endl;
+                        return Result::Invalid;
+                    }
+                } else {
+                    std::cerr << "Error: --log-level requires a value" << std::endl;
+                    return Result::Invalid;
+                }
+            } else if (current_arg == "--cache-dir") {
+                if (i + 1 < argc) {
+                    cache_dir = argv[++i];
+                } else {
+                    std::cerr << "Error: --cache-dir requires a value" << std::endl;
+                    return Result::Invalid;
+                }
             } else {
                 std::cerr << "Unknown argument: " << current_arg << std::endl;
                 return Result::Invalid;
@@ -87,8 +185,43 @@ public:
     std::vector<std::string> connections;
     std::string stream_url;
     bool forwarding {false};
+    bool adaptive_bitrate {false};
+    unsigned stats_port {8555};
+    std::string cache_dir {"/var/cache/siyi-camera-manager"};
+    std::string mux_socket;
+    std::string capture_path;
+    std::chrono::milliseconds shutter_offset {0};
+    LogLevel log_level {LogLevel::Info};
 };
 
+static std::pair<unsigned, unsigned> stream_size(siyi::Camera::Resolution resolution)
+{
+    switch (resolution) {
+        case siyi::Camera::Resolution::Res1280x720:
+            return {1280, 720};
+        case siyi::Camera::Resolution::Res1920x1080:
+            return {1920, 1080};
+        case siyi::Camera::Resolution::Res2560x1440:
+            return {2560, 1440};
+        case siyi::Camera::Resolution::Res3840x2160:
+            return {3840, 2160};
+    }
+    return {0, 0};
+}
+
+// The bitrates offered in the camera definition, depending on the resolution.
+static std::vector<unsigned> allowed_bitrates(
+    const StreamCapabilities& capabilities, siyi::Camera::Resolution resolution)
+{
+    const auto [width, height] = stream_size(resolution);
+    for (const auto& entry : capabilities.resolutions) {
+        if (entry.width == width && entry.height == height) {
+            return entry.bitrates_kbps;
+        }
+    }
+    return {};
+}
+
 int main(int argc, char* argv[])
 {
     CommandLineParser parser;
@@ -105,46 +238,66 @@ int main(int argc, char* argv[])
             break;
     }
 
+    Logger::instance().set_level(parser.log_level);
+    Logger::instance().start();
+
     // SIYI setup first
+    siyi::CaptureWriter capture;
+    if (!parser.capture_path.empty() && !capture.open(parser.capture_path)) {
+        return 1;
+    }
+
     siyi::Messager siyi_messager;
-    siyi_messager.setup("192.168.144.25", 37260);
+    if (parser.mux_socket.empty()) {
+        siyi_messager.setup("192.168.144.25", 37260);
+    } else if (!siyi_messager.setup_mux(parser.mux_socket)) {
+        return 1;
+    }
 
     siyi::Serializer siyi_serializer;
     siyi::Deserializer siyi_deserializer;
     siyi::Camera siyi_camera{siyi_serializer, siyi_deserializer, siyi_messager};
-    if (!siyi_camera.init()) {
-        std::cerr << "Could not initialize camera" << std::endl;
-        return 3;
+    if (!parser.capture_path.empty()) {
+        siyi_messager.set_capture(&capture);
+    }
+    siyi_camera.set_settings_file(parser.cache_dir + "/camera_settings");
+
+    // With the settings from last time, we can show up on MAVLink right away, and
+    // check them once the camera has booted as well. Without, we give the camera
+    // one chance, and otherwise start with the defaults until it shows up.
+    if (siyi_camera.load_settings()) {
+        LogLine(LogLevel::Info) << "Starting with camera settings from last time";
+    } else if (!siyi_camera.init()) {
+        LogLine(LogLevel::Warn) << "Camera not answering, starting with default settings";
     }
 
     // MAVSDK setup second
     mavsdk::Mavsdk mavsdk{mavsdk::Mavsdk::Configuration{mavsdk::ComponentType::Camera}};
 
-    // We overwrite the mavsdk logs to prepend "Mavsdk:" and to make sure we flush it after every
-    // line using std::endl. Otherwise, it gets buffered by systemctl and logs appear delayed.
+    // We overwrite the mavsdk logs to prepend "Mavsdk:" and to have them go through our
+    // logger, which writes them out in time without blocking MAVSDK's threads.
 
     mavsdk::log::subscribe([](mavsdk::log::Level level,   // message severity level
                               const std::string& message, // message text
                               const std::string& file,    // source file from which the message was sent
                               int line) {                 // line number in the source file
 
-        std::cout << "Mavsdk ";
-        // process the log message in a way you like
+        auto log_level = LogLevel::Info;
         switch (level) {
             case mavsdk::log::Level::Debug:
-                std::cout << "debug: ";
+                log_level = LogLevel::Debug;
                 break;
             case mavsdk::log::Level::Info:
-                std::cout << "info: ";
+                log_level = LogLevel::Info;
                 break;
             case mavsdk::log::Level::Warn:
-                std::cout << "warning: ";
+                log_level = LogLevel::Warn;
                 break;
             case mavsdk::log::Level::Err:
-                std::cout << "error: ";
+                log_level = LogLevel::Err;
+                break;
         }
-        std::cout << message;
-        std::cout << " (" << file << ":" << line << ")" << std::endl;
+        LogLine(log_level) << "Mavsdk: " << message << " (" << file << ":" << line << ")";
 
         // returning true from the callback disables default printing
         return true;
@@ -156,11 +309,11 @@ int main(int argc, char* argv[])
             parser.forwarding ? mavsdk::ForwardingOption::ForwardingOn : mavsdk::ForwardingOption::ForwardingOff);
 
         if (result != mavsdk::ConnectionResult::Success) {
-            std::cerr << "Could not establish connection '" << connection << """': " << result << std::endl;
+            LogLine(LogLevel::Err) << "Could not establish connection '" << connection << """': " << result;
             return 1;
         }
-        std::cout << "Created connection '" << connection << "' forwarding '"
-                  << (parser.forwarding ? "on" : "off") << "'"<<std::endl;
+        LogLine(LogLevel::Info) << "Created connection '" << connection << "' forwarding '"
+                                << (parser.forwarding ? "on" : "off") << "'";
     }
 
     auto ftp_server = mavsdk::FtpServer{
@@ -172,71 +325,143 @@ int main(int argc, char* argv[])
         path = "/usr/share/mavlink_ftp_root";
     }
 
-    std::cout << "Using FTP root: " << path << " to serve camera xml file." << std::endl;
+    // The stream parameters of the definition depend on what the firmware supports.
+    // The installed definition is the template, and used as is if generating fails.
+    const std::filesystem::path template_path = path + "/siyi_a8_mini.xml";
+    StreamCapabilities capabilities;
+    ServedDefinition definition{};
+
+    auto prepare_definition = [&]() {
+        capabilities = capabilities_for_firmware(siyi_camera.firmware_version());
+        const auto [stream_width, stream_height] = stream_size(siyi_camera.resolution());
+        capabilities.add_bitrate(stream_width, stream_height, siyi_camera.bitrate());
+        capabilities.add_codec(siyi_camera.codec(siyi::Camera::Type::Stream) == siyi::Camera::Codec::H264 ? 1 : 2);
+
+        const auto xml_path = cached_definition(
+            template_path, parser.cache_dir, siyi_camera.firmware_version(), capabilities).value_or(template_path);
+
+        // The compressed definition is served from tmpfs, the plain one from disk if
+        // that doesn't work out.
+        const auto maybe_definition = prepare_compressed_definition(xml_path, "/dev/shm/siyi-camera-manager");
+        if (maybe_definition) {
+            definition = maybe_definition.value();
+        } else {
+            LogLine(LogLevel::Warn) << "Serving uncompressed camera definition";
+            const auto maybe_xml = read_file(xml_path);
+            definition.root_dir = xml_path.parent_path().string();
+            definition.uri = "mftp://siyi_a8_mini.xml";
+            definition.version = maybe_xml ? definition_version(maybe_xml.value()).value_or(0) : 0;
+        }
+
+        LogLine(LogLevel::Info) << "Using FTP root: " << definition.root_dir << " to serve camera definition "
+                                << definition.uri << " (version " << definition.version << ")";
+
+        return ftp_server.set_root_dir(definition.root_dir);
+    };
 
-    auto ftp_result = ftp_server.set_root_dir(path);
+    auto ftp_result = prepare_definition();
     if (ftp_result != mavsdk::FtpServer::Result::Success) {
-        std::cerr << "Could not set FTP server root dir: " << ftp_result << std::endl;
+        LogLine(LogLevel::Err) << "Could not set FTP server root dir: " << ftp_result;
         return 2;
     }
 
     auto param_server = mavsdk::ParamServer{
         mavsdk.server_component_by_type(mavsdk::ComponentType::Camera)};
 
-    int32_t stream_res = 0;
-    switch (siyi_camera.resolution()) {
-        case siyi::Camera::Resolution::Res1280x720:
-            stream_res = 0;
-            break;
-        case siyi::Camera::Resolution::Res1920x1080:
-            stream_res = 1;
-            break;
-        default:
-            std::cerr << "Unexpected stream resolution" << std::endl;
-            break;
-    }
+    // Needs to be called whenever the camera's settings could have changed.
+    auto publish_stream_settings = [&]() {
+        int32_t stream_res = 0;
+        switch (siyi_camera.resolution()) {
+            case siyi::Camera::Resolution::Res1280x720:
+                stream_res = 0;
+                break;
+            case siyi::Camera::Resolution::Res1920x1080:
+                stream_res = 1;
+                break;
+            default:
+                LogLine(LogLevel::Warn) << "Unexpected stream resolution";
+                break;
+        }
 
-    int32_t stream_codec = 0;
-    switch (siyi_camera.codec(siyi::Camera::Type::Stream)) {
-        case siyi::Camera::Codec::H264:
-            stream_codec = 1;
-            break;
-        case siyi::Camera::Codec::H265:
-            stream_codec = 2;
-            break;
-    }
+        int32_t stream_codec = 0;
+        switch (siyi_camera.codec(siyi::Camera::Type::Stream)) {
+            case siyi::Camera::Codec::H264:
+                stream_codec = 1;
+                break;
+            case siyi::Camera::Codec::H265:
+                stream_codec = 2;
+                break;
+        }
+
+        param_server.provide_param_int("STREAM_RES", stream_res);
+        param_server.provide_param_int("STREAM_BITRATE", static_cast<int32_t>(siyi_camera.bitrate()));
+        param_server.provide_param_int("STREAM_CODEC", stream_codec);
+    };
 
     param_server.provide_param_int("CAM_MODE", 0);
-    param_server.provide_param_int("STREAM_RES", stream_res);
-    param_server.provide_param_int("STREAM_BITRATE", static_cast<int32_t>(siyi_camera.bitrate()));
-    param_server.provide_param_int("STREAM_CODEC", stream_codec);
+    param_server.provide_param_float("CAM_ZOOM", siyi_camera.zoom_level());
+    publish_stream_settings();
+
+    // The camera is used from MAVSDK's callbacks as well as the bitrate controller.
+    std::mutex camera_mutex;
+
+    // The ceiling is what the user chose, saved apart from the camera's
+    // bitrate, which may still be stepped down from before a restart.
+    const std::string bitrate_ceiling_file = parser.cache_dir + "/stream_bitrate_ceiling";
+    BitrateController bitrate_controller;
+    bitrate_controller.set_allowed(allowed_bitrates(capabilities, siyi_camera.resolution()));
+    if (const auto maybe_ceiling = read_bitrate_ceiling(bitrate_ceiling_file)) {
+        bitrate_controller.set_ceiling(maybe_ceiling.value(), BitrateController::Clock::now());
+        bitrate_controller.revert(siyi_camera.bitrate());
+    }
 
     param_server.subscribe_changed_param_int([&](auto param_int) {
+        std::lock_guard<std::mutex> lock(camera_mutex);
+
+        if (siyi_camera.state() == siyi::Camera::State::Disconnected) {
+            // The camera's settings are published again once it's back.
+            LogLine(LogLevel::Info) << "Camera not connected, ignoring " << param_int.name;
+            return;
+        }
+
+        // Reconfiguring the encoder takes several round trips, and leaves the
+        // camera in an unknown state if they get lost half way.
+        if (siyi_camera.state() == siyi::Camera::State::Degraded) {
+            LogLine(LogLevel::Info) << "Camera link degraded, ignoring " << param_int.name;
+            publish_stream_settings();
+            return;
+        }
+
         if (param_int.name == "STREAM_RES") {
             if (param_int.value == 0) {
-                std::cout << "Set stream resolution to 1280x720" << std::endl;
+                LogLine(LogLevel::Info) << "Set stream resolution to 1280x720";
                 (void)siyi_camera.set_resolution(siyi::Camera::Type::Stream, siyi::Camera::Resolution::Res1280x720);
                 // TODO: should we ack/nack?
             } else if (param_int.value == 1) {
-                std::cout << "Set stream resolution to 1920x1080" << std::endl;
+                LogLine(LogLevel::Info) << "Set stream resolution to 1920x1080";
                 (void)siyi_camera.set_resolution(siyi::Camera::Type::Stream, siyi::Camera::Resolution::Res1920x1080);
                 // TODO: should we ack/nack?
             } else {
-                std::cout << "Unknown stream resolution" << std::endl;
+                LogLine(LogLevel::Info) << "Unknown stream resolution";
             }
+            bitrate_controller.set_allowed(allowed_bitrates(capabilities, siyi_camera.resolution()));
         } else if (param_int.name == "STREAM_BITRATE") {
-            std::cout << "Set bitrate to " << param_int.value << std::endl;
-            (void)siyi_camera.set_bitrate(siyi::Camera::Type::Stream, param_int.value);
+            LogLine(LogLevel::Info) << "Set bitrate to " << param_int.value;
+            if (siyi_camera.set_bitrate(siyi::Camera::Type::Stream, param_int.value)) {
+                // What the user picks is the most we go back up to.
+                bitrate_controller.set_ceiling(siyi_camera.bitrate(), BitrateController::Clock::now());
+                (void)write_bitrate_ceiling(bitrate_ceiling_file, bitrate_controller.ceiling());
+            }
 
         } else if (param_int.name == "STREAM_CODEC") {
             if (param_int.value == 1) {
-                std::cout << "Set codec to H264" << std::endl;
+                LogLine(LogLevel::Info) << "Set codec to H264";
                 (void)siyi_camera.set_codec(siyi::Camera::Type::Stream, siyi::Camera::Codec::H264);
             } else if (param_int.value == 2) {
-                std::cout << "Set codec to H265" << std::endl;
+                LogLine(LogLevel::Info) << "Set codec to H265";
                 (void)siyi_camera.set_codec(siyi::Camera::Type::Stream, siyi::Camera::Codec::H265);
             } else {
-                std::cout << "Unknown codec" << std::endl;
+                LogLine(LogLevel::Info) << "Unknown codec";
             }
         }
     });
@@ -244,22 +469,26 @@ int main(int argc, char* argv[])
     auto camera_server = mavsdk::CameraServer{
         mavsdk.server_component_by_type(mavsdk::ComponentType::Camera)};
 
-    auto ret = camera_server.set_information({
-        .vendor_name = "SIYI",
-        .model_name = "A8 mini",
-        .firmware_version = "0.0.0",
-        .focal_length_mm = 21,
-        .horizontal_sensor_size_mm = 9.5,
-        .vertical_sensor_size_mm = 7.6,
-        .horizontal_resolution_px = 4000,
-        .vertical_resolution_px = 3000,
-        .lens_id = 0,
-        .definition_file_version = 30,
-        .definition_file_uri = "mftp://siyi_a8_mini.xml",
-    });
+    auto advertise_information = [&]() {
+        return camera_server.set_information({
+            .vendor_name = "SIYI",
+            .model_name = "A8 mini",
+            .firmware_version = siyi_camera.firmware_version(),
+            .focal_length_mm = 21,
+            .horizontal_sensor_size_mm = 9.5,
+            .vertical_sensor_size_mm = 7.6,
+            .horizontal_resolution_px = 4000,
+            .vertical_resolution_px = 3000,
+            .lens_id = 0,
+            .definition_file_version = definition.version,
+            .definition_file_uri = definition.uri,
+        });
+    };
+
+    auto ret = advertise_information();
 
     if (ret != mavsdk::CameraServer::Result::Success) {
-        std::cerr << "Failed to set camera info, exiting" << std::endl;
+        LogLine(LogLevel::Err) << "Failed to set camera info, exiting";
         return 2;
     }
 
@@ -269,29 +498,71 @@ int main(int argc, char* argv[])
     });
 
     if (ret != mavsdk::CameraServer::Result::Success) {
-        std::cerr << "Failed to set video stream info, exiting" << std::endl;
+        LogLine(LogLevel::Err) << "Failed to set video stream info, exiting";
         return 2;
     }
 
+    // Requests to the camera can't be served while it's not there.
+    auto camera_unavailable = [&]() -> std::optional<mavsdk::CameraServer::CameraFeedback> {
+        switch (siyi_camera.state()) {
+            case siyi::Camera::State::Disconnected:
+                return mavsdk::CameraServer::CameraFeedback::Failed;
+            case siyi::Camera::State::Probing:
+                return mavsdk::CameraServer::CameraFeedback::Busy;
+            case siyi::Camera::State::Ready:
+            case siyi::Camera::State::Degraded:
+                break;
+        }
+        return std::nullopt;
+    };
+
     int32_t images_captured = 0;
+    siyi::ShutterTiming shutter_timing{parser.shutter_offset};
 
     camera_server.subscribe_take_photo([&](int32_t index) {
 
+        if (const auto feedback = camera_unavailable()) {
+            LogLine(LogLevel::Info) << "Camera not connected, can't take picture";
+            camera_server.respond_take_photo(feedback.value(), mavsdk::CameraServer::CaptureInfo{
+                .is_success = false,
+                .index = index,
+            });
+            return;
+        }
+
         // TODO: not sure what to do about this index.
         (void)index;
         camera_server.set_in_progress(true);
 
-        std::cout << "Taking a picture (" << +index << ")..." << std::endl;
-        siyi_messager.send(siyi_serializer.assemble_message(siyi::TakePicture{}));
+        LogLine(LogLevel::Info) << "Taking a picture (" << +index << ")...";
+        const auto shot = siyi_camera.take_picture();
 
         // TODO: populate with telemetry data
         auto position = mavsdk::CameraServer::Position{};
         auto attitude = mavsdk::CameraServer::Quaternion{};
 
-        auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
-                             std::chrono::system_clock::now().time_since_epoch())
-                             .count();
-        auto success = true;
+        const auto sent = shot ? shot.value().sent : std::chrono::system_clock::now();
+        const auto feedback = shot ? shot.value().feedback : std::nullopt;
+        if (feedback) {
+            shutter_timing.add(std::chrono::duration_cast<std::chrono::microseconds>(feedback.value() - sent));
+        }
+        const auto estimate = shutter_timing.estimate(sent, feedback);
+        const auto timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+            estimate.exposure.time_since_epoch()).count();
+        const auto success = shot && shot.value().success;
+
+        if (!shot) {
+            LogLine(LogLevel::Warn) << "Picture " << images_captured << " could not be sent";
+        } else if (!feedback) {
+            LogLine(LogLevel::Info) << "Picture " << images_captured << " at " << timestamp << " us, without feedback, ± "
+                                    << (estimate.uncertainty ? std::to_string(estimate.uncertainty.value().count()) : "unknown")
+                                    << " us";
+        } else {
+            LogLine(success ? LogLevel::Info : LogLevel::Warn)
+                << "Picture " << images_captured << (success ? "" : " failed") << " at " << timestamp << " us ± "
+                << estimate.uncertainty.value().count() << " us, feedback after "
+                << std::chrono::duration_cast<std::chrono::microseconds>(feedback.value() - sent).count() << " us";
+        }
 
         camera_server.set_in_progress(false);
 
@@ -312,14 +583,18 @@ int main(int argc, char* argv[])
 
     camera_server.subscribe_start_video([&](int32_t) {
 
-        if (recording) {
-            std::cout << "Video already started" << std::endl;
+        if (const auto feedback = camera_unavailable()) {
+            LogLine(LogLevel::Info) << "Camera not connected, can't start video";
+            camera_server.respond_start_video(feedback.value());
+
+        } else if (recording) {
+            LogLine(LogLevel::Info) << "Video already started";
             camera_server.respond_start_video(
                 mavsdk::CameraServer::CameraFeedback::Failed);
 
         } else {
-            std::cout << "Start video" << std::endl;
-            siyi_messager.send(siyi_serializer.assemble_message(siyi::ToggleRecording{}));
+            LogLine(LogLevel::Info) << "Start video";
+            siyi_camera.toggle_recording();
             recording = true;
             recording_start_time = std::chrono::steady_clock::now();
             camera_server.respond_start_video(
@@ -329,14 +604,18 @@ int main(int argc, char* argv[])
 
     camera_server.subscribe_stop_video([&](int32_t) {
 
-        if (!recording) {
-            std::cout << "Video not started" << std::endl;
+        if (const auto feedback = camera_unavailable()) {
+            LogLine(LogLevel::Info) << "Camera not connected, can't stop video";
+            camera_server.respond_stop_video(feedback.value());
+
+        } else if (!recording) {
+            LogLine(LogLevel::Info) << "Video not started";
             camera_server.respond_stop_video(
                 mavsdk::CameraServer::CameraFeedback::Failed);
 
         } else {
-            std::cout << "Stop video" << std::endl;
-            siyi_messager.send(siyi_serializer.assemble_message(siyi::ToggleRecording{}));
+            LogLine(LogLevel::Info) << "Stop video";
+            siyi_camera.toggle_recording();
             recording = false;
             camera_server.respond_stop_video(
                 mavsdk::CameraServer::CameraFeedback::Ok);
@@ -397,13 +676,17 @@ int main(int argc, char* argv[])
     });
 
     camera_server.subscribe_zoom_range([&](float zoom_factor) {
+        if (const auto feedback = camera_unavailable()) {
+            camera_server.respond_zoom_range(feedback.value());
+            return;
+        }
         if (zoom_factor < 0.f) {
-            std::cout << "Zoom below 0% not possible" << std::endl;
+            LogLine(LogLevel::Info) << "Zoom below 0% not possible";
             camera_server.respond_zoom_range(mavsdk::CameraServer::CameraFeedback::Failed);
             return;
         }
         if (zoom_factor > 100.f) {
-            std::cout << "Zoom above 100% not possible" << std::endl;
+            LogLine(LogLevel::Info) << "Zoom above 100% not possible";
             camera_server.respond_zoom_range(mavsdk::CameraServer::CameraFeedback::Failed);
             return;
         }
@@ -415,24 +698,105 @@ int main(int argc, char* argv[])
     });
 
     camera_server.subscribe_zoom_in_start([&](int) {
+        if (const auto feedback = camera_unavailable()) {
+            camera_server.respond_zoom_in_start(feedback.value());
+            return;
+        }
         siyi_camera.zoom(siyi::Camera::Zoom::In);
         camera_server.respond_zoom_in_start(mavsdk::CameraServer::CameraFeedback::Ok);
     });
 
     camera_server.subscribe_zoom_out_start([&](int) {
+        if (const auto feedback = camera_unavailable()) {
+            camera_server.respond_zoom_out_start(feedback.value());
+            return;
+        }
         siyi_camera.zoom(siyi::Camera::Zoom::Out);
         camera_server.respond_zoom_in_start(mavsdk::CameraServer::CameraFeedback::Ok);
     });
 
     camera_server.subscribe_zoom_stop([&](int) {
+        if (const auto feedback = camera_unavailable()) {
+            camera_server.respond_zoom_stop(feedback.value());
+            return;
+        }
         siyi_camera.zoom(siyi::Camera::Zoom::Stop);
         camera_server.respond_zoom_stop(mavsdk::CameraServer::CameraFeedback::Ok);
     });
 
+    if (parser.adaptive_bitrate) {
+        LogLine(LogLevel::Info) << "Adaptive bitrate using client stats on port " << parser.stats_port;
+    }
+
+    // Whenever the camera (re)connects, its settings have been read and we follow them.
+    std::string definition_firmware_version = siyi_camera.firmware_version();
+    siyi_camera.start([&]() {
+        std::lock_guard<std::mutex> lock(camera_mutex);
+        LogLine(LogLevel::Info) << "Camera settings confirmed";
+
+        if (siyi_camera.firmware_version() != definition_firmware_version) {
+            definition_firmware_version = siyi_camera.firmware_version();
+            LogLine(LogLevel::Info) << "Camera firmware changed to " << definition_firmware_version;
+            (void)prepare_definition();
+            (void)advertise_information();
+        }
+        publish_stream_settings();
+        bitrate_controller.set_allowed(allowed_bitrates(capabilities, siyi_camera.resolution()));
+
+        // Until the user sets one, the bitrate the camera had when we first
+        // saw it is the ceiling.
+        if (bitrate_controller.ceiling() == 0) {
+            bitrate_controller.set_ceiling(siyi_camera.bitrate(), BitrateController::Clock::now());
+            (void)write_bitrate_ceiling(bitrate_ceiling_file, bitrate_controller.ceiling());
+        }
+    }, [&](float zoom) {
+        // Reported as the zoom factor, for the GCS to show.
+        param_server.provide_param_float("CAM_ZOOM", zoom);
+    });
+
     // Run as a server and never quit
+    auto last_health_report = std::chrono::steady_clock::now();
     while (true) {
         std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        if (std::chrono::steady_clock::now() - last_health_report >= std::chrono::minutes(1)) {
+            last_health_report = std::chrono::steady_clock::now();
+            const auto health = siyi_camera.link_health();
+            if (health.samples > 0) {
+                LogLine(LogLevel::Info) << "Camera link: rtt p50 " << health.rtt_p50.count() / 1000.0
+                                        << " ms, p95 " << health.rtt_p95.count() / 1000.0
+                                        << " ms, max " << health.rtt_max.count() / 1000.0
+                                        << " ms, jitter " << health.jitter.count() / 1000.0
+                                        << " ms, loss " << health.loss_rate * 100.0 << "%";
+            }
+        }
+
+        if (!parser.adaptive_bitrate || siyi_camera.state() != siyi::Camera::State::Ready) {
+            continue;
+        }
+
+        const auto maybe_stats = fetch_link_stats(parser.stats_port);
+        if (!maybe_stats) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(camera_mutex);
+        const auto maybe_bitrate = bitrate_controller.update(maybe_stats.value(), BitrateController::Clock::now());
+        if (!maybe_bitrate) {
+            continue;
+        }
+
+        LogLine(LogLevel::Info) << "Adapting bitrate to " << maybe_bitrate.value()
+                                << " (loss " << maybe_stats.value().fraction_lost * 100.0 << "%, jitter "
+                                << maybe_stats.value().jitter_ms << " ms)";
+        if (siyi_camera.set_bitrate(siyi::Camera::Type::Stream, maybe_bitrate.value())) {
+            // Keep the GCS in sync.
+            param_server.provide_param_int("STREAM_BITRATE", static_cast<int32_t>(siyi_camera.bitrate()));
+        } else {
+            bitrate_controller.revert(siyi_camera.bitrate());
+        }
     }
 
+    siyi_camera.stop();
     return 0;
 }
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <optional>
+#include <vector>
+
+namespace siyi {
+
+// Nearest rank of sorted samples, in thousandths, or 0 without samples.
+[[nodiscard]] inline std::chrono::microseconds percentile(
+    const std::vector<std::chrono::microseconds>& sorted, unsigned permille)
+{
+    if (sorted.empty()) {
+        return std::chrono::microseconds(0);
+    }
+    const auto rank = (sorted.size() * permille + 999) / 1000;
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+// Health of the link to the camera.
+//
+// The camera is sent a heartbeat every now and then, and every heartbeat is
+// either answered, with its round trip time, or lost. Over the last samples we
+// keep the RTT percentiles and the loss rate, and the jitter the way RTP does
+// (RFC 3550), as a running average of the difference between consecutive RTTs.
+
+class LinkHealth {
+public:
+    // How many heartbeats the statistics are over.
+    static constexpr std::size_t window = 32;
+
+    // When any of these is exceeded, the link is considered degraded.
+    static constexpr double degraded_loss_rate = 0.2;
+    static constexpr std::chrono::microseconds degraded_rtt_p95{300000};
+    static constexpr std::chrono::microseconds degraded_jitter{50000};
+
+    struct Stats {
+        unsigned samples{0};
+        double loss_rate{0.0};
+        std::chrono::microseconds rtt_p50{0};
+        std::chrono::microseconds rtt_p95{0};
+        std::chrono::microseconds rtt_max{0};
+        std::chrono::microseconds jitter{0};
+    };
+
+    void add_reply(std::chrono::microseconds rtt)
+    {
+        if (_last_rtt) {
+            const auto difference = std::abs((rtt - _last_rtt.value()).count());
+            _jitter_us += (static_cast<double>(difference) - _jitter_us) / 16.0;
+        }
+        _last_rtt = rtt;
+        add({true, rtt});
+    }
+
+    void add_loss()
+    {
+        add({false, {}});
+    }
+
+    [[nodiscard]] Stats stats() const
+    {
+        Stats result{};
+        result.samples = static_cast<unsigned>(_samples.size());
+        if (_samples.empty()) {
+            return result;
+        }
+
+        std::vector<std::chrono::microseconds> rtts;
+        for (const auto& sample : _samples) {
+            if (sample.answered) {
+                rtts.push_back(sample.rtt);
+            }
+        }
+
+        result.loss_rate = 1.0 - static_cast<double>(rtts.size()) / static_cast<double>(_samples.size());
+        result.jitter = std::chrono::microseconds(static_cast<long long>(_jitter_us));
+
+        if (!rtts.empty()) {
+            std::sort(rtts.begin(), rtts.end());
+            result.rtt_p50 = percentile(rtts, 500);
+            result.rtt_p95 = percentile(rtts, 950);
+            result.rtt_max = rtts.back();
+        }
+        return result;
+    }
+
+    [[nodiscard]] bool degraded() const
+    {
+        const auto current = stats();
+        return current.loss_rate > degraded_loss_rate ||
+            current.rtt_p95 > degraded_rtt_p95 ||
+            current.jitter > degraded_jitter;
+    }
+
+    void reset()
+    {
+        _samples.clear();
+        _last_rtt.reset();
+        _jitter_us = 0.0;
+    }
+
+private:
+    struct Sample {
+        bool answered;
+        std::chrono::microseconds rtt;
+    };
+
+    void add(Sample sample)
+    {
+        _samples.push_back(sample);
+        if (_samples.size() > window) {
+            _samples.pop_front();
+        }
+    }
+
+    std::deque<Sample> _samples;
+    std::optional<std::chrono::microseconds> _last_rtt;
+    double _jitter_us{0.0};
+};
+
+} // namespace siyi
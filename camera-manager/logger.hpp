@@ -0,0 +1,316 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <unistd.h>
+
+// Asynchronous logging.
+//
+// Log lines are put in a lock-free queue by whichever thread logs, and written
+// to stdout in batches by a background thread, at the latest after
+// Logger::max_delay. That way, threads serving MAVLink or the camera don't wait
+// for systemd to take the logs. When running under systemd, the log level is
+// passed on to journald as a "<N>" prefix.
+//
+// Until the logger is started (and in tools which don't), lines are written
+// right away instead.
+//
+// Usage:
+//     LogLine(LogLevel::Info) << "Set bitrate to " << bitrate;
+//
+// Lines which could come in bursts can be rate limited per call site:
+//     static LogRateLimit zoom_log_limit;
+//     LogLine(LogLevel::Info, zoom_log_limit) << "Zooming";
+
+enum class LogLevel {
+    Debug,
+    Info,
+    Warn,
+    Err,
+};
+
+// Bounded multi-producer single-consumer queue (after Dmitry Vyukov's bounded
+// MPMC queue): every slot has a sequence number which tells producers and the
+// consumer whose turn it is, so neither needs a lock.
+class LogQueue {
+public:
+    static constexpr std::size_t capacity = 1024;
+    static_assert((capacity & (capacity - 1)) == 0, "capacity needs to be a power of 2");
+
+    struct Entry {
+        LogLevel level{LogLevel::Info};
+        std::string text;
+    };
+
+    LogQueue()
+    {
+        for (std::size_t i = 0; i < capacity; ++i) {
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the queue is full.
+    [[nodiscard]] bool push(Entry&& entry)
+    {
+        auto pos = _enqueue_pos.load(std::memory_order_relaxed);
+        Slot* slot = nullptr;
+
+        while (true) {
+            slot = &_slots[pos & (capacity - 1)];
+            const auto sequence = slot->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->entry = std::move(entry);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only to be called from one thread.
+    [[nodiscard]] bool pop(Entry& entry)
+    {
+        Slot& slot = _slots[_dequeue_pos & (capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != _dequeue_pos + 1) {
+            return false;
+        }
+
+        entry = std::move(slot.entry);
+        slot.sequence.store(_dequeue_pos + capacity, std::memory_order_release);
+        ++_dequeue_pos;
+        return true;
+    }
+
+private:
+    struct Slot {
+        std::atomic<std::size_t> sequence{0};
+        Entry entry;
+    };
+
+    std::array<Slot, capacity> _slots;
+    alignas(64) std::atomic<std::size_t> _enqueue_pos{0};
+    alignas(64) std::size_t _dequeue_pos{0};
+};
+
+// Allows a burst of lines per interval, and counts the rest.
+class LogRateLimit {
+public:
+    explicit LogRateLimit(
+        std::chrono::milliseconds interval = std::chrono::seconds(1), unsigned burst = 5) :
+        _interval(interval),
+        _burst(burst) {}
+
+    [[nodiscard]] bool allow()
+    {
+        const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        auto window_start = _window_start.load(std::memory_order_relaxed);
+        if (now - window_start >= std::chrono::duration_cast<std::chrono::steady_clock::duration>(_interval).count() &&
+            _window_start.compare_exchange_strong(window_start, now, std::memory_order_relaxed)) {
+            _count.store(0, std::memory_order_relaxed);
+        }
+
+        if (_count.fetch_add(1, std::memory_order_relaxed) < _burst) {
+            return true;
+        }
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // How many were suppressed since last time.
+    [[nodiscard]] unsigned take_suppressed()
+    {
+        return _suppressed.exchange(0, std::memory_order_relaxed);
+    }
+
+private:
+    const std::chrono::milliseconds _interval;
+    const unsigned _burst;
+    std::atomic<std::chrono::steady_clock::rep> _window_start{0};
+    std::atomic<unsigned> _count{0};
+    std::atomic<unsigned> _suppressed{0};
+};
+
+class Logger {
+public:
+    static constexpr std::chrono::milliseconds max_delay{100};
+
+    static Logger& instance()
+    {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        // journald tells us about itself, and understands log levels as prefix.
+        _journald = std::getenv("JOURNAL_STREAM") != nullptr;
+        _running = true;
+        _thread = std::thread([this]() { run(); });
+    }
+
+    // Writes what's still queued.
+    void stop()
+    {
+        _running = false;
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
+
+    void set_level(LogLevel level)
+    {
+        _level = level;
+    }
+
+    [[nodiscard]] bool enabled(LogLevel level) const
+    {
+        return level >= _level.load(std::memory_order_relaxed);
+    }
+
+    void log(LogLevel level, std::string text)
+    {
+        if (!_running) {
+            auto& stream = (level >= LogLevel::Warn) ? std::cerr : std::cout;
+            stream << text << std::endl;
+            return;
+        }
+
+        if (!_queue.push(LogQueue::Entry{level, std::move(text)})) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    Logger() = default;
+
+    void run()
+    {
+        std::string batch;
+        while (true) {
+            // Checked first, so nothing logged before stopping is lost.
+            const bool running = _running;
+
+            LogQueue::Entry entry;
+            while (_queue.pop(entry)) {
+                append(batch, entry.level, entry.text);
+            }
+
+            const auto dropped = _dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                append(batch, LogLevel::Warn, std::to_string(dropped) + " log lines dropped");
+            }
+
+            std::size_t written = 0;
+            while (written < batch.size()) {
+                const auto ret = ::write(STDOUT_FILENO, batch.data() + written, batch.size() - written);
+                if (ret <= 0) {
+                    break;
+                }
+                written += static_cast<std::size_t>(ret);
+            }
+            batch.clear();
+
+            if (!running) {
+                break;
+            }
+            std::this_thread::sleep_for(max_delay);
+        }
+    }
+
+    void append(std::string& batch, LogLevel level, const std::string& text) const
+    {
+        if (_journald) {
+            // syslog priorities
+            switch (level) {
+                case LogLevel::Debug:
+                    batch += "<7>";
+                    break;
+                case LogLevel::Info:
+                    batch += "<6>";
+                    break;
+                case LogLevel::Warn:
+                    batch += "<4>";
+                    break;
+                case LogLevel::Err:
+                    batch += "<3>";
+                    break;
+            }
+        }
+        batch += text;
+        batch += '\n';
+    }
+
+    LogQueue _queue;
+    std::atomic<bool> _running{false};
+    std::atomic<LogLevel> _level{LogLevel::Info};
+    std::atomic<std::uint64_t> _dropped{0};
+    bool _journald{false};
+    std::thread _thread;
+};
+
+// Collects one line and logs it when going out of scope.
+class LogLine {
+public:
+    explicit LogLine(LogLevel level) :
+        _level(level),
+        _enabled(Logger::instance().enabled(level)) {}
+
+    LogLine(LogLevel level, LogRateLimit& limit) :
+        _level(level),
+        _enabled(Logger::instance().enabled(level) && limit.allow())
+    {
+        if (_enabled) {
+            const auto suppressed = limit.take_suppressed();
+            if (suppressed > 0) {
+                _stream << "(" << suppressed << " similar lines suppressed) ";
+            }
+        }
+    }
+
+    ~LogLine()
+    {
+        if (_enabled) {
+            Logger::instance().log(_level, _stream.str());
+        }
+    }
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    template<typename T>
+    LogLine& operator<<(const T& value)
+    {
+        if (_enabled) {
+            _stream << value;
+        }
+        return *this;
+    }
+
+private:
+    LogLevel _level;
+    bool _enabled;
+    std::ostringstream _stream;
+};
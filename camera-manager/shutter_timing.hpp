@@ -0,0 +1,128 @@
+#pragma once
+
+#include "link_health.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <vector>
+
+namespace siyi {
+
+// When a picture was actually taken.
+//
+// After taking a picture, the camera sends function feedback, and the time that
+// arrives (the kernel's receive timestamp) is the anchor. The exposure is some
+// fixed offset from it, usually before, which can't be seen from here: it is
+// measured once against a reference, e.g. by photographing a clock, and
+// configured. The offset is then only off by how much the camera's timing
+// varies, which is what the spread of the send to feedback latency shows.
+//
+// Without feedback, the exposure is estimated from the send time and the
+// latency usually seen, with accordingly more uncertainty.
+
+class ShutterTiming {
+public:
+    // How many pictures the statistics are over.
+    static constexpr std::size_t window = 64;
+
+    struct Stats {
+        unsigned samples{0};
+        std::chrono::microseconds p50{0};
+        std::chrono::microseconds p95{0};
+        std::chrono::microseconds max{0};
+        std::chrono::microseconds stddev{0};
+    };
+
+    struct Estimate {
+        std::chrono::system_clock::time_point exposure{};
+        // Unknown until the latency was seen at least once.
+        std::optional<std::chrono::microseconds> uncertainty;
+        bool confirmed{false};
+    };
+
+    // Feedback to exposure, negative if the exposure is before the feedback.
+    explicit ShutterTiming(std::chrono::microseconds offset = std::chrono::microseconds(0)) :
+        _offset(offset) {}
+
+    [[nodiscard]] std::chrono::microseconds offset() const { return _offset; }
+
+    void add(std::chrono::microseconds send_to_feedback)
+    {
+        _samples.push_back(send_to_feedback);
+        if (_samples.size() > window) {
+            _samples.pop_front();
+        }
+    }
+
+    [[nodiscard]] Stats send_to_feedback() const
+    {
+        return stats(std::chrono::microseconds(0));
+    }
+
+    [[nodiscard]] Stats send_to_exposure() const
+    {
+        return stats(_offset);
+    }
+
+    // The exposure can't be before sending, nor after the feedback.
+    [[nodiscard]] Estimate estimate(
+        std::chrono::system_clock::time_point sent,
+        std::optional<std::chrono::system_clock::time_point> feedback) const
+    {
+        Estimate result{};
+        const auto current = send_to_feedback();
+
+        if (feedback) {
+            result.confirmed = true;
+            result.exposure = std::clamp(feedback.value() + _offset, sent, std::max(sent, feedback.value()));
+            result.uncertainty = current.stddev;
+        } else if (current.samples > 0) {
+            result.exposure = std::max(sent, sent + current.p50 + _offset);
+            result.uncertainty = current.p95 - current.p50 + current.stddev;
+        } else {
+            result.exposure = sent;
+        }
+        return result;
+    }
+
+private:
+    [[nodiscard]] Stats stats(std::chrono::microseconds shift) const
+    {
+        Stats result{};
+        result.samples = static_cast<unsigned>(_samples.size());
+        if (_samples.empty()) {
+            return result;
+        }
+
+        std::vector<std::chrono::microseconds> sorted;
+        double sum = 0.0;
+        for (const auto& sample : _samples) {
+            sorted.push_back(std::max(std::chrono::microseconds(0), sample + shift));
+            sum += static_cast<double>(sorted.back().count());
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        const double mean = sum / static_cast<double>(sorted.size());
+        double squares = 0.0;
+        for (const auto& sample : sorted) {
+            const double difference = static_cast<double>(sample.count()) - mean;
+            squares += difference * difference;
+        }
+
+        result.p50 = percentile(sorted, 500);
+        result.p95 = percentile(sorted, 950);
+        result.max = sorted.back();
+        result.stddev = std::chrono::microseconds(
+            static_cast<long long>(std::sqrt(squares / static_cast<double>(sorted.size()))));
+        return result;
+    }
+
+    std::chrono::microseconds _offset;
+    std::deque<std::chrono::microseconds> _samples;
+};
+
+} // namespace siyi
@@ -0,0 +1,480 @@
+#pragma once
+
+#include "link_health.hpp"
+#include "siyi_buffer_pool.hpp"
+#include "siyi_capture.hpp"
+#include "siyi_crc.hpp"
+#include "siyi_protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace siyi {
+
+// Analysis of a capture (see siyi_capture.hpp), e.g. after a flight, for
+// siyi_analyze.
+//
+// The capture is split into one chunk per thread. Records have no marker, so a
+// chunk starts at the first position from its share of the file on where a few
+// records in a row look right (direction 0 or 1, reserved bytes 0, and fitting
+// into the file). The chunks are checked in parallel: the framing and CRC of
+// every datagram, which is most of the work, and what's needed to match
+// requests and replies is kept in order. The matching then goes over that in
+// order. As the camera doesn't echo sequence numbers, a reply is matched the
+// way siyi_mux does it: the oldest request with the same cmd_id, preferably
+// with the same first payload byte. Requests are lost after the request
+// timeout, which is no longer than camera_manager waits for a reply, or a
+// request which got none would take the reply to the next one.
+//
+// Timestamps are monotonic, so when they go back, the capture was appended to
+// after a restart. Such a session starts over, its requests without reply are
+// lost.
+
+class CaptureAnalyzer {
+public:
+    struct Options {
+        unsigned threads{1};
+        // When a request counts as lost.
+        std::chrono::milliseconds request_timeout{1000};
+        // When nothing received for this long counts as a gap.
+        std::chrono::milliseconds gap{2000};
+        // Of the timeline.
+        std::chrono::milliseconds interval{10000};
+    };
+
+    // Sorted.
+    struct Latencies {
+        std::vector<std::chrono::microseconds> sorted;
+
+        [[nodiscard]] std::chrono::microseconds percentile(unsigned permille) const
+        {
+            return siyi::percentile(sorted, permille);
+        }
+    };
+
+    struct Command {
+        std::uint64_t sent{0};
+        std::uint64_t received{0};
+        std::uint64_t bytes{0};
+        std::uint64_t answered{0};
+        std::uint64_t lost{0};
+        Latencies latencies;
+    };
+
+    struct Errors {
+        std::uint64_t too_short{0};
+        std::uint64_t bad_magic{0};
+        std::uint64_t bad_length{0};
+        std::uint64_t bad_crc{0};
+        std::uint64_t bad_direction{0};
+        // Unexpected replies.
+        std::uint64_t unmatched{0};
+        // The end of the file is cut off, e.g. by a power loss.
+        bool truncated{false};
+        // Chunks which didn't end where the next one started, so a record
+        // boundary was guessed wrong. Should never happen.
+        unsigned misaligned_chunks{0};
+
+        [[nodiscard]] std::uint64_t invalid_frames() const
+        {
+            return too_short + bad_magic + bad_length + bad_crc + bad_direction;
+        }
+    };
+
+    struct Gap {
+        unsigned session{0};
+        // Since the session started.
+        std::chrono::nanoseconds at{0};
+        std::chrono::nanoseconds length{0};
+    };
+
+    struct Interval {
+        unsigned session{0};
+        // Since the session started.
+        std::chrono::nanoseconds start{0};
+        std::uint64_t sent{0};
+        std::uint64_t received{0};
+        std::uint64_t lost{0};
+        std::uint64_t invalid{0};
+        Latencies latencies;
+    };
+
+    struct Analysis {
+        std::uint64_t records{0};
+        std::uint64_t bytes{0};
+        unsigned sessions{0};
+        // All sessions together.
+        std::chrono::nanoseconds duration{0};
+        std::map<std::uint8_t, Command> commands;
+        Errors errors;
+        std::vector<Gap> gaps;
+        std::vector<Interval> timeline;
+    };
+
+    explicit CaptureAnalyzer(Options options) :
+        _options(options) {}
+
+    // Nothing if it's not a capture.
+    [[nodiscard]] std::optional<Analysis> analyze(ByteView capture) const
+    {
+        if (capture.size() < sizeof(capture_magic) ||
+            std::memcmp(capture.data(), capture_magic, sizeof(capture_magic)) != 0) {
+            return std::nullopt;
+        }
+
+        const unsigned threads = std::max(1u, _options.threads);
+        std::vector<Chunk> chunks(threads);
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this, &capture, &chunks, i, threads]() {
+                check_chunk(capture, i, threads, chunks[i]);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        Analysis result{};
+        for (const auto& chunk : chunks) {
+            add_counts(chunk, result);
+        }
+        match(chunks, result);
+        return result;
+    }
+
+private:
+    static constexpr std::uint8_t magic1 = 0x55;
+    static constexpr std::uint8_t magic2 = 0x66;
+    static constexpr std::size_t frame_header_len = 8;
+    static constexpr std::size_t crc_len = 2;
+
+    // How many records in a row need to look right to start a chunk there.
+    static constexpr unsigned sync_records = 4;
+
+    // What matching needs of a record.
+    struct Event {
+        enum Flags : std::uint8_t {
+            Sent = 1,
+            NeedAck = 2,
+            HasFirstPayloadByte = 4,
+            Invalid = 8,
+        };
+
+        std::uint64_t timestamp_ns;
+        std::uint8_t cmd_id;
+        std::uint8_t first_payload_byte;
+        std::uint8_t flags;
+    };
+
+    struct Counts {
+        std::uint64_t sent{0};
+        std::uint64_t received{0};
+        std::uint64_t bytes{0};
+    };
+
+    struct Chunk {
+        std::size_t start{0};
+        std::size_t end{0};
+        std::size_t stopped{0};
+        std::uint64_t records{0};
+        std::uint64_t bytes{0};
+        std::array<Counts, 256> counts{};
+        Errors errors;
+        std::vector<Event> events;
+    };
+
+    struct Pending {
+        std::uint64_t timestamp_ns;
+        std::uint8_t cmd_id;
+        std::optional<std::uint8_t> first_payload_byte;
+    };
+
+    // Whether a record starts at pos, judging by it and the few after it.
+    [[nodiscard]] static bool record_starts_at(ByteView capture, std::size_t pos)
+    {
+        for (unsigned i = 0; i < sync_records && pos < capture.size(); ++i) {
+            if (pos + capture_record_header_len > capture.size()) {
+                return false;
+            }
+            const auto* header = capture.data() + pos;
+            if (header[10] > 1 || header[11] != 0 || header[12] != 0 ||
+                header[13] != 0 || header[14] != 0 || header[15] != 0) {
+                return false;
+            }
+            pos += capture_record_header_len + (header[8] | (header[9] << 8));
+            if (pos > capture.size()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Where the records of the given share of the file start.
+    [[nodiscard]] static std::size_t chunk_start(ByteView capture, unsigned index, unsigned count)
+    {
+        const std::size_t records_len = capture.size() - sizeof(capture_magic);
+        if (index == 0) {
+            return sizeof(capture_magic);
+        }
+        if (index >= count) {
+            return capture.size();
+        }
+        std::size_t pos = sizeof(capture_magic) + records_len / count * index;
+        while (pos < capture.size() && !record_starts_at(capture, pos)) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    void check_chunk(ByteView capture, unsigned index, unsigned count, Chunk& chunk) const
+    {
+        chunk.start = chunk_start(capture, index, count);
+        chunk.end = chunk_start(capture, index + 1, count);
+        // Roughly one per record.
+        chunk.events.reserve((chunk.end - chunk.start) / (capture_record_header_len + 16));
+
+        std::size_t pos = chunk.start;
+        while (pos < chunk.end) {
+            if (pos + capture_record_header_len > capture.size()) {
+                chunk.errors.truncated = true;
+                break;
+            }
+            const auto* header = capture.data() + pos;
+            const std::size_t len = header[8] | (header[9] << 8);
+            if (pos + capture_record_header_len + len > capture.size()) {
+                chunk.errors.truncated = true;
+                break;
+            }
+
+            std::uint64_t timestamp_ns = 0;
+            for (unsigned i = 0; i < 8; ++i) {
+                timestamp_ns |= static_cast<std::uint64_t>(header[i]) << (8 * i);
+            }
+            check_record(timestamp_ns, header[10],
+                ByteView{header + capture_record_header_len, len}, chunk);
+
+            pos += capture_record_header_len + len;
+        }
+        chunk.stopped = pos;
+    }
+
+    // The same checks as Deserializer::header, but telling apart what's wrong.
+    static void check_record(std::uint64_t timestamp_ns, std::uint8_t direction, ByteView frame, Chunk& chunk)
+    {
+        ++chunk.records;
+        chunk.bytes += frame.size();
+
+        auto& errors = chunk.errors;
+        bool valid = false;
+        if (direction > 1) {
+            ++errors.bad_direction;
+        } else if (frame.size() < frame_header_len + crc_len) {
+            ++errors.too_short;
+        } else if (frame[0] != magic1 || frame[1] != magic2) {
+            ++errors.bad_magic;
+        } else if (frame.size() != (frame[3] | (frame[4] << 8)) + frame_header_len + crc_len) {
+            ++errors.bad_length;
+        } else {
+            const auto crc16 = crc16_cal(frame.data(), static_cast<std::uint32_t>(frame.size() - crc_len));
+            if ((crc16 & 0xff) != frame[frame.size() - 2] || (crc16 >> 8) != frame[frame.size() - 1]) {
+                ++errors.bad_crc;
+            } else {
+                valid = true;
+            }
+        }
+
+        if (!valid) {
+            chunk.events.push_back(Event{timestamp_ns, 0, 0, Event::Invalid});
+            return;
+        }
+
+        const bool sent = direction == static_cast<std::uint8_t>(CaptureDirection::Sent);
+        const std::uint8_t cmd_id = frame[7];
+        auto& counts = chunk.counts[cmd_id];
+        ++(sent ? counts.sent : counts.received);
+        counts.bytes += frame.size();
+
+        // Sent without asking for an ack, there is nothing to match.
+        const bool need_ack = (frame[2] & 0x01) != 0;
+        if (sent && !need_ack) {
+            return;
+        }
+        const bool has_first_payload_byte = frame.size() > frame_header_len + crc_len;
+        chunk.events.push_back(Event{
+            timestamp_ns,
+            cmd_id,
+            has_first_payload_byte ? frame[frame_header_len] : std::uint8_t{0},
+            static_cast<std::uint8_t>((sent ? Event::Sent : 0) | (need_ack ? Event::NeedAck : 0) |
+                (has_first_payload_byte ? Event::HasFirstPayloadByte : 0)),
+        });
+    }
+
+    static void add_counts(const Chunk& chunk, Analysis& result)
+    {
+        result.records += chunk.records;
+        result.bytes += chunk.bytes;
+
+        for (unsigned cmd_id = 0; cmd_id < chunk.counts.size(); ++cmd_id) {
+            const auto& counts = chunk.counts[cmd_id];
+            if (counts.sent == 0 && counts.received == 0) {
+                continue;
+            }
+            auto& command = result.commands[static_cast<std::uint8_t>(cmd_id)];
+            command.sent += counts.sent;
+            command.received += counts.received;
+            command.bytes += counts.bytes;
+        }
+
+        auto& errors = result.errors;
+        errors.too_short += chunk.errors.too_short;
+        errors.bad_magic += chunk.errors.bad_magic;
+        errors.bad_length += chunk.errors.bad_length;
+        errors.bad_crc += chunk.errors.bad_crc;
+        errors.bad_direction += chunk.errors.bad_direction;
+        errors.truncated = errors.truncated || chunk.errors.truncated;
+        if (!chunk.errors.truncated && chunk.stopped != chunk.end) {
+            ++errors.misaligned_chunks;
+        }
+    }
+
+    void match(const std::vector<Chunk>& chunks, Analysis& result) const
+    {
+        const auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(_options.request_timeout).count();
+        const auto gap = std::chrono::duration_cast<std::chrono::nanoseconds>(_options.gap).count();
+
+        std::deque<Pending> pending;
+        std::map<std::pair<unsigned, std::uint64_t>, Interval> timeline;
+        std::optional<std::uint64_t> last_ns;
+        // Since the session started, if nothing was received yet.
+        std::uint64_t last_received_ns = 0;
+        std::uint64_t session_start_ns = 0;
+
+        const auto interval_at = [&](std::uint64_t timestamp_ns) -> Interval& {
+            const auto interval_ns = static_cast<std::uint64_t>(std::max<std::int64_t>(1,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(_options.interval).count()));
+            const auto index = (timestamp_ns - session_start_ns) / interval_ns;
+            auto& interval = timeline[{result.sessions, index}];
+            interval.session = result.sessions;
+            interval.start = std::chrono::nanoseconds(index * interval_ns);
+            return interval;
+        };
+
+        const auto lose = [&](const Pending& request) {
+            ++result.commands[request.cmd_id].lost;
+            ++interval_at(request.timestamp_ns).lost;
+        };
+
+        for (const auto& chunk : chunks) {
+            for (const auto& event : chunk.events) {
+                if (!last_ns || event.timestamp_ns < last_ns.value()) {
+                    for (const auto& request : pending) {
+                        lose(request);
+                    }
+                    pending.clear();
+                    if (last_ns) {
+                        result.duration += std::chrono::nanoseconds(last_ns.value() - session_start_ns);
+                    }
+                    ++result.sessions;
+                    session_start_ns = event.timestamp_ns;
+                    last_received_ns = event.timestamp_ns;
+                }
+                last_ns = event.timestamp_ns;
+
+                while (!pending.empty() &&
+                    event.timestamp_ns - pending.front().timestamp_ns > static_cast<std::uint64_t>(timeout)) {
+                    lose(pending.front());
+                    pending.pop_front();
+                }
+
+                auto& interval = interval_at(event.timestamp_ns);
+                if ((event.flags & Event::Invalid) != 0) {
+                    ++interval.invalid;
+                    continue;
+                }
+
+                const std::optional<std::uint8_t> first_payload_byte =
+                    (event.flags & Event::HasFirstPayloadByte) != 0
+                        ? std::optional<std::uint8_t>(event.first_payload_byte)
+                        : std::nullopt;
+
+                if ((event.flags & Event::Sent) != 0) {
+                    ++interval.sent;
+                    pending.push_back(Pending{event.timestamp_ns, event.cmd_id, first_payload_byte});
+                    continue;
+                }
+
+                ++interval.received;
+                if (event.timestamp_ns - last_received_ns > static_cast<std::uint64_t>(gap)) {
+                    result.gaps.push_back(Gap{
+                        result.sessions,
+                        std::chrono::nanoseconds(last_received_ns - session_start_ns),
+                        std::chrono::nanoseconds(event.timestamp_ns - last_received_ns),
+                    });
+                }
+                last_received_ns = event.timestamp_ns;
+
+                auto found = pending.end();
+                for (auto it = pending.begin(); it != pending.end(); ++it) {
+                    if (it->cmd_id != event.cmd_id) {
+                        continue;
+                    }
+                    if (it->first_payload_byte == first_payload_byte) {
+                        found = it;
+                        break;
+                    }
+                    if (found == pending.end()) {
+                        found = it;
+                    }
+                }
+                if (found == pending.end()) {
+                    // The feedback after taking a picture comes without being asked.
+                    if (event.cmd_id != AckFunctionFeedback::cmd_id_impl()) {
+                        ++result.errors.unmatched;
+                    }
+                    continue;
+                }
+
+                const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::nanoseconds(event.timestamp_ns - found->timestamp_ns));
+                auto& command = result.commands[found->cmd_id];
+                ++command.answered;
+                command.latencies.sorted.push_back(latency);
+                interval.latencies.sorted.push_back(latency);
+                pending.erase(found);
+            }
+        }
+
+        // Requests at the very end might just not have had their reply yet.
+        if (last_ns) {
+            for (const auto& request : pending) {
+                if (last_ns.value() - request.timestamp_ns > static_cast<std::uint64_t>(timeout)) {
+                    lose(request);
+                }
+            }
+            result.duration += std::chrono::nanoseconds(last_ns.value() - session_start_ns);
+        }
+
+        for (auto& [cmd_id, command] : result.commands) {
+            (void)cmd_id;
+            std::sort(command.latencies.sorted.begin(), command.latencies.sorted.end());
+        }
+        for (auto& [key, interval] : timeline) {
+            (void)key;
+            std::sort(interval.latencies.sorted.begin(), interval.latencies.sorted.end());
+            result.timeline.push_back(std::move(interval));
+        }
+    }
+
+    Options _options;
+};
+
+} // namespace siyi
@@ -0,0 +1,220 @@
+#include "siyi_analysis.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void print_usage(const std::string& bin_name)
+{
+    std::cout << "Usage: " << bin_name << " <capture> [options]\n"
+              << "Options:\n"
+              << "  --threads <count>     How many threads to check the capture with (default: all cores)\n"
+              << "  --timeout-ms <ms>     When a request without reply counts as lost (default 1000)\n"
+              << "  --gap-ms <ms>         Show when nothing was received for longer (default 2000)\n"
+              << "  --interval-s <s>      Interval of the timeline (default 10)\n"
+              << "  --help                Show this help message\n";
+}
+
+// The capture, mapped into memory rather than read, so it is only read from
+// disk once, as the threads get to it.
+class MappedFile {
+public:
+    ~MappedFile()
+    {
+        if (_data != nullptr) {
+            munmap(_data, _size);
+        }
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    [[nodiscard]] bool open(const std::string& path)
+    {
+        _fd = ::open(path.c_str(), O_RDONLY);
+        if (_fd < 0) {
+            std::cerr << "Could not open capture " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        struct stat st{};
+        if (fstat(_fd, &st) != 0) {
+            std::cerr << "Could not stat capture " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        _size = static_cast<std::size_t>(st.st_size);
+        if (_size == 0) {
+            return true;
+        }
+
+        void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "Could not map capture " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        _data = data;
+        (void)madvise(_data, _size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    [[nodiscard]] siyi::ByteView view() const
+    {
+        return siyi::ByteView{static_cast<const std::uint8_t*>(_data), _size};
+    }
+
+private:
+    int _fd{-1};
+    void* _data{nullptr};
+    std::size_t _size{0};
+};
+
+static double ms(std::chrono::microseconds duration)
+{
+    return static_cast<double>(duration.count()) / 1000.0;
+}
+
+static double s(std::chrono::nanoseconds duration)
+{
+    return std::chrono::duration<double>(duration).count();
+}
+
+static void print_analysis(const siyi::CaptureAnalyzer::Analysis& analysis, const siyi::CaptureAnalyzer::Options& options)
+{
+    std::cout << std::fixed << std::setprecision(1)
+              << "Duration " << s(analysis.duration) << " s in " << analysis.sessions << " session(s)\n\n";
+
+    std::cout << "cmd       sent  received  answered      lost   p50 ms   p99 ms   max ms\n";
+    for (const auto& [cmd_id, command] : analysis.commands) {
+        std::cout << "0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(cmd_id)
+                  << std::dec << std::setfill(' ')
+                  << std::setw(10) << command.sent
+                  << std::setw(10) << command.received
+                  << std::setw(10) << command.answered
+                  << std::setw(10) << command.lost
+                  << std::setprecision(3);
+        if (command.answered > 0) {
+            std::cout << std::setw(9) << ms(command.latencies.percentile(500))
+                      << std::setw(9) << ms(command.latencies.percentile(990))
+                      << std::setw(9) << ms(command.latencies.sorted.back());
+        }
+        std::cout << std::setprecision(1) << '\n';
+    }
+
+    const auto& errors = analysis.errors;
+    std::cout << "\nErrors: "
+              << errors.bad_crc << " bad CRC, "
+              << errors.bad_length << " bad length, "
+              << errors.bad_magic << " bad magic, "
+              << errors.too_short << " too short, "
+              << errors.bad_direction << " bad direction, "
+              << errors.unmatched << " unexpected replies"
+              << (errors.truncated ? ", cut off at the end" : "") << '\n';
+    if (errors.misaligned_chunks > 0) {
+        std::cout << errors.misaligned_chunks << " chunks misaligned, run with --threads 1" << '\n';
+    }
+
+    std::cout << "\nGaps (nothing received for more than " << options.gap.count() << " ms):\n";
+    for (const auto& gap : analysis.gaps) {
+        std::cout << "  session " << gap.session << " at " << s(gap.at) << " s for " << s(gap.length) << " s\n";
+    }
+
+    std::cout << "\nTimeline (every " << s(options.interval) << " s):\n"
+              << "  session    start      sent  received      lost   invalid   p50 ms   p99 ms\n";
+    for (const auto& interval : analysis.timeline) {
+        std::cout << std::setw(9) << interval.session
+                  << std::setw(9) << s(interval.start)
+                  << std::setw(10) << interval.sent
+                  << std::setw(10) << interval.received
+                  << std::setw(10) << interval.lost
+                  << std::setw(10) << interval.invalid
+                  << std::setprecision(3);
+        if (!interval.latencies.sorted.empty()) {
+            std::cout << std::setw(9) << ms(interval.latencies.percentile(500))
+                      << std::setw(9) << ms(interval.latencies.percentile(990));
+        }
+        std::cout << std::setprecision(1) << '\n';
+    }
+    std::cout << std::flush;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string path;
+    siyi::CaptureAnalyzer::Options options{};
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string current_arg = argv[i];
+        if (current_arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (current_arg == "--threads" || current_arg == "--timeout-ms" ||
+            current_arg == "--gap-ms" || current_arg == "--interval-s") {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: " << current_arg << " requires a value" << std::endl;
+                return 1;
+            }
+            char* end = nullptr;
+            const auto value = std::strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || value == 0) {
+                std::cerr << "Error: " << current_arg << " requires a positive number" << std::endl;
+                return 1;
+            }
+            if (current_arg == "--threads") {
+                options.threads = static_cast<unsigned>(value);
+            } else if (current_arg == "--timeout-ms") {
+                options.request_timeout = std::chrono::milliseconds(value);
+            } else if (current_arg == "--gap-ms") {
+                options.gap = std::chrono::milliseconds(value);
+            } else {
+                options.interval = std::chrono::seconds(value);
+            }
+        } else if (path.empty()) {
+            path = current_arg;
+        } else {
+            std::cerr << "Invalid argument: " << current_arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    MappedFile file;
+    if (!file.open(path)) {
+        return 2;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto analysis = siyi::CaptureAnalyzer{options}.analyze(file.view());
+    const auto duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!analysis) {
+        std::cerr << "Not a capture: " << path << std::endl;
+        return 2;
+    }
+
+    std::cout << path << ": " << analysis.value().records << " records, " << analysis.value().bytes << " bytes";
+    if (duration > 0.0) {
+        std::cout << ", analyzed in " << std::fixed << std::setprecision(3) << duration << " s ("
+                  << std::setprecision(1) << static_cast<double>(file.view().size()) / duration / 1e6 << " MB/s, "
+                  << options.threads << " threads)";
+    }
+    std::cout << '\n';
+    print_analysis(analysis.value(), options);
+
+    return 0;
+}
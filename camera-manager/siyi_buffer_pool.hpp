@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace siyi {
+
+// Bytes owned by someone else, e.g. a received datagram or part of it.
+class ByteView {
+public:
+    ByteView() = default;
+    ByteView(const std::uint8_t* data, std::size_t size) :
+        _data(data),
+        _size(size) {}
+    ByteView(const std::vector<std::uint8_t>& bytes) :
+        _data(bytes.data()),
+        _size(bytes.size()) {}
+
+    [[nodiscard]] const std::uint8_t* data() const { return _data; }
+    [[nodiscard]] std::size_t size() const { return _size; }
+    [[nodiscard]] bool empty() const { return _size == 0; }
+    [[nodiscard]] const std::uint8_t* begin() const { return _data; }
+    [[nodiscard]] const std::uint8_t* end() const { return _data + _size; }
+    [[nodiscard]] std::uint8_t operator[](std::size_t i) const { return _data[i]; }
+
+private:
+    const std::uint8_t* _data{nullptr};
+    std::size_t _size{0};
+};
+
+class BufferPool;
+
+// Handle to a buffer of the pool, which goes back to the pool when the handle
+// is destroyed. It can be moved around, e.g. to the decoder, without copying
+// the bytes.
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    ~PooledBuffer() { release(); }
+
+    PooledBuffer(PooledBuffer&& other) noexcept :
+        _pool(std::exchange(other._pool, nullptr)),
+        _index(other._index),
+        _data(std::exchange(other._data, nullptr)),
+        _size(std::exchange(other._size, 0)) {}
+
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            _pool = std::exchange(other._pool, nullptr);
+            _index = other._index;
+            _data = std::exchange(other._data, nullptr);
+            _size = std::exchange(other._size, 0);
+        }
+        return *this;
+    }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    // Whether a buffer could be taken from the pool at all.
+    [[nodiscard]] bool valid() const { return _data != nullptr; }
+
+    [[nodiscard]] std::uint8_t* data() { return _data; }
+    [[nodiscard]] const std::uint8_t* data() const { return _data; }
+    [[nodiscard]] std::size_t size() const { return _size; }
+    [[nodiscard]] bool empty() const { return _size == 0; }
+    [[nodiscard]] std::size_t capacity() const;
+
+    // How much of the buffer is used, up to its capacity.
+    void resize(std::size_t size) { _size = size; }
+
+    [[nodiscard]] ByteView view() const { return ByteView{_data, _size}; }
+    operator ByteView() const { return view(); }
+
+    [[nodiscard]] std::vector<std::uint8_t> to_vector() const
+    {
+        return std::vector<std::uint8_t>(_data, _data + _size);
+    }
+
+private:
+    friend class BufferPool;
+
+    PooledBuffer(BufferPool* pool, unsigned index, std::uint8_t* data) :
+        _pool(pool),
+        _index(index),
+        _data(data) {}
+
+    void release();
+
+    BufferPool* _pool{nullptr};
+    unsigned _index{0};
+    std::uint8_t* _data{nullptr};
+    std::size_t _size{0};
+};
+
+// A fixed number of buffers, all allocated up front. Buffers can be taken and
+// given back from any thread without a lock, the free ones are a bitmask.
+class BufferPool {
+public:
+    static constexpr unsigned max_count = 32;
+
+    // At most max_count buffers.
+    BufferPool(unsigned count, std::size_t buffer_size) :
+        _buffer_size(buffer_size),
+        _storage(std::min(count, max_count) * buffer_size),
+        _free(count >= max_count ? ~std::uint32_t{0} : (std::uint32_t{1} << count) - 1) {}
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Returns an invalid handle if all buffers are in use.
+    [[nodiscard]] PooledBuffer take()
+    {
+        auto free = _free.load(std::memory_order_relaxed);
+        while (free != 0) {
+            const auto index = static_cast<unsigned>(__builtin_ctz(free));
+            if (_free.compare_exchange_weak(free, free & ~(std::uint32_t{1} << index),
+                    std::memory_order_acquire, std::memory_order_relaxed)) {
+                return PooledBuffer{this, index, _storage.data() + index * _buffer_size};
+            }
+        }
+        return PooledBuffer{};
+    }
+
+    [[nodiscard]] std::size_t buffer_size() const { return _buffer_size; }
+
+    [[nodiscard]] unsigned available() const
+    {
+        return static_cast<unsigned>(__builtin_popcount(_free.load(std::memory_order_relaxed)));
+    }
+
+private:
+    friend class PooledBuffer;
+
+    void give_back(unsigned index)
+    {
+        _free.fetch_or(std::uint32_t{1} << index, std::memory_order_release);
+    }
+
+    const std::size_t _buffer_size;
+    std::vector<std::uint8_t> _storage;
+    std::atomic<std::uint32_t> _free;
+};
+
+inline std::size_t PooledBuffer::capacity() const
+{
+    return _pool != nullptr ? _pool->buffer_size() : 0;
+}
+
+inline void PooledBuffer::release()
+{
+    if (_pool != nullptr) {
+        _pool->give_back(_index);
+        _pool = nullptr;
+        _data = nullptr;
+        _size = 0;
+    }
+}
+
+} // namespace siyi
@@ -1,62 +1,281 @@
 #pragma once
 
 #include "siyi_protocol.hpp"
+#include "link_health.hpp"
+#include "logger.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
 
 namespace siyi {
 
+// The camera can be used from several threads. Requests which wait for an
+// answer are one transaction at a time, fire and forget commands are sent right
+// away. The settings are only ever read as a whole, so they are consistent.
+//
+// Once started, a background thread keeps track of the connection: while the
+// camera is not answering, it is probed with increasing intervals, and once it
+// answers, its settings are read again. While connected, it sends a heartbeat
+// to keep track of the link health. When requests go unanswered, or the link
+// is bad, the camera is considered degraded, and eventually disconnected.
+//
+// The same thread polls the zoom, often while it's moving and rarely
+// otherwise, and sends absolute zoom targets which came in too quickly one
+// after the other. Only the newest of those is sent, so the lens doesn't lag
+// behind a zoom slider.
+
 class Camera {
 public:
+    enum class State {
+        Disconnected,
+        Probing,
+        Ready,
+        Degraded,
+    };
+
+    struct Settings {
+        AckFirmwareVersion version{};
+        AckGetStreamResolution stream{};
+        AckGetStreamResolution recording{};
+        // Polled, and not persisted.
+        float zoom{1.f};
+    };
+
+    struct Shot {
+        std::chrono::system_clock::time_point sent{};
+        // When the camera said it took the picture, if it did.
+        std::optional<std::chrono::system_clock::time_point> feedback;
+        bool success{true};
+    };
+
     Camera(Serializer& serializer, Deserializer& deserializer, Messager& messager) :
         _serializer(serializer),
         _deserializer(deserializer),
-        _messager(messager) {}
+        _messager(messager)
+    {
+        // Until we know better, assume the defaults.
+        _settings.stream.video_enc_type = 2;
+        _settings.stream.resolution_l = 1280;
+        _settings.stream.resolution_h = 720;
+        _settings.stream.video_bitrate_kbps = 2000;
+        _settings.recording.video_enc_type = 2;
+        _settings.recording.resolution_l = 1920;
+        _settings.recording.resolution_h = 1080;
+        _settings.recording.video_bitrate_kbps = 4000;
+    }
+
+    ~Camera()
+    {
+        stop();
+    }
+
+    Camera(const Camera&) = delete;
+    Camera& operator=(const Camera&) = delete;
+
+    [[nodiscard]] State state() const { return _state; }
+
+    [[nodiscard]] Settings settings() const
+    {
+        std::lock_guard<std::mutex> lock(_state_mutex);
+        return _settings;
+    }
+
+    [[nodiscard]] LinkHealth::Stats link_health() const
+    {
+        std::lock_guard<std::mutex> lock(_state_mutex);
+        return _link_health.stats();
+    }
+
+    // Start the connection thread. on_connected is called from it whenever the
+    // camera answered (again) and its settings have been read, on_zoom whenever
+    // the zoom reported by the camera changed.
+    void start(std::function<void()> on_connected, std::function<void(float)> on_zoom = {})
+    {
+        _on_connected = std::move(on_connected);
+        _on_zoom = std::move(on_zoom);
+        _stop = false;
+        _thread = std::thread([this]() { run(); });
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wake_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
 
     [[nodiscard]] bool init()
     {
-        _messager.send(_serializer.assemble_message(siyi::FirmwareVersion{}));
+        std::lock_guard<std::mutex> lock(_transaction_mutex);
 
-        const auto maybe_version = _deserializer.disassemble_message<siyi::AckFirmwareVersion>(_messager.receive());
-        if (maybe_version) {
-            _version = maybe_version.value();
-        } else {
+        Settings settings{};
+
+        // The queries don't depend on each other, so they are sent all at once and
+        // the acks are matched up as they come in. What's missing is asked again.
+        bool have_version = false;
+        bool have_stream_settings = false;
+        bool have_recording_settings = false;
+
+        for (unsigned round = 0; round < init_rounds; ++round) {
+            if (!have_version) {
+                _messager.send(_serializer.assemble_message(siyi::FirmwareVersion{}));
+            }
+            if (!have_stream_settings) {
+                auto get_stream_settings = siyi::GetStreamSettings{};
+                get_stream_settings.stream_type = 1;
+                _messager.send(_serializer.assemble_message(get_stream_settings));
+            }
+            if (!have_recording_settings) {
+                auto get_recording_settings = siyi::GetStreamSettings{};
+                get_recording_settings.stream_type = 0;
+                _messager.send(_serializer.assemble_message(get_recording_settings));
+            }
+
+            const auto round_end = std::chrono::steady_clock::now() + init_round_timeout;
+            while (!(have_version && have_stream_settings && have_recording_settings)) {
+                const auto now = std::chrono::steady_clock::now();
+                if (now >= round_end) {
+                    break;
+                }
+
+                const auto message = _messager.receive_buffer(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(round_end - now));
+                if (message.empty()) {
+                    break;
+                }
+
+                const auto maybe_header = Deserializer::header(message);
+                if (!maybe_header) {
+                    continue;
+                }
+
+                if (maybe_header.value().cmd_id == AckFirmwareVersion::cmd_id_impl()) {
+                    const auto maybe_version = _deserializer.disassemble_message<siyi::AckFirmwareVersion>(message);
+                    if (maybe_version) {
+                        settings.version = maybe_version.value();
+                        have_version = true;
+                    }
+                } else if (maybe_header.value().cmd_id == AckGetStreamResolution::cmd_id_impl()) {
+                    const auto maybe_settings = _deserializer.disassemble_message<siyi::AckGetStreamResolution>(message);
+                    if (maybe_settings && maybe_settings.value().stream_type() == 1) {
+                        settings.stream = maybe_settings.value();
+                        have_stream_settings = true;
+                    } else if (maybe_settings && maybe_settings.value().stream_type() == 0) {
+                        settings.recording = maybe_settings.value();
+                        have_recording_settings = true;
+                    }
+                }
+            }
+
+            if (have_version && have_stream_settings && have_recording_settings) {
+                {
+                    std::lock_guard<std::mutex> state_lock(_state_mutex);
+                    _settings = settings;
+                }
+                persist_settings();
+                _unanswered = 0;
+                _state = State::Ready;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // The settings are saved to this file whenever they change, so that they can
+    // be used on the next start before the camera has answered.
+    void set_settings_file(std::string path)
+    {
+        _settings_file = std::move(path);
+    }
+
+    [[nodiscard]] bool load_settings()
+    {
+        std::ifstream file(_settings_file);
+        if (!file) {
             return false;
         }
 
-        {
-            auto get_stream_settings = siyi::GetStreamSettings{};
-            get_stream_settings.stream_type = 1;
-            _messager.send(_serializer.assemble_message(get_stream_settings));
-            const auto maybe_stream_settings = _deserializer.disassemble_message<siyi::AckGetStreamResolution>(
-                    _messager.receive());
-            if (maybe_stream_settings) {
-                _stream_settings = maybe_stream_settings.value();
-            } else {
-                return false;
+        std::map<std::string, unsigned long> values;
+        std::string line;
+        while (std::getline(file, line)) {
+            const auto pos = line.find('=');
+            if (pos != std::string::npos) {
+                values[line.substr(0, pos)] = std::strtoul(line.c_str() + pos + 1, nullptr, 10);
             }
         }
 
-        {
-            auto get_recording_settings = siyi::GetStreamSettings{};
-            get_recording_settings.stream_type = 0;
-            _messager.send(_serializer.assemble_message(get_recording_settings));
-            const auto maybe_recording_settings = _deserializer.disassemble_message<siyi::AckGetStreamResolution>(
-                    _messager.receive());
-            if (maybe_recording_settings) {
-                _recording_settings = maybe_recording_settings.value();
-            } else {
+        for (const auto* key : settings_keys) {
+            if (values.count(key) == 0) {
+                LogLine(LogLevel::Warn) << "Settings file " << _settings_file << " incomplete";
                 return false;
             }
         }
 
+        AckFirmwareVersion version{};
+        version.code_board_ver_major = static_cast<std::uint8_t>(values["camera_ver_major"]);
+        version.code_board_ver_minor = static_cast<std::uint8_t>(values["camera_ver_minor"]);
+        version.code_board_ver_patch = static_cast<std::uint8_t>(values["camera_ver_patch"]);
+        version.gimbal_firmware_ver_major = static_cast<std::uint8_t>(values["gimbal_ver_major"]);
+        version.gimbal_firmware_ver_minor = static_cast<std::uint8_t>(values["gimbal_ver_minor"]);
+        version.gimbal_firmware_ver_patch = static_cast<std::uint8_t>(values["gimbal_ver_patch"]);
+
+        AckGetStreamResolution stream_settings{};
+        stream_settings.video_enc_type = static_cast<std::uint8_t>(values["stream_enc_type"]);
+        stream_settings.resolution_l = static_cast<std::uint16_t>(values["stream_width"]);
+        stream_settings.resolution_h = static_cast<std::uint16_t>(values["stream_height"]);
+        stream_settings.video_bitrate_kbps = static_cast<std::uint16_t>(values["stream_bitrate_kbps"]);
+
+        AckGetStreamResolution recording_settings{};
+        recording_settings.video_enc_type = static_cast<std::uint8_t>(values["recording_enc_type"]);
+        recording_settings.resolution_l = static_cast<std::uint16_t>(values["recording_width"]);
+        recording_settings.resolution_h = static_cast<std::uint16_t>(values["recording_height"]);
+        recording_settings.video_bitrate_kbps = static_cast<std::uint16_t>(values["recording_bitrate_kbps"]);
+
+        if (!valid(stream_settings) || !valid(recording_settings)) {
+            LogLine(LogLevel::Warn) << "Settings file " << _settings_file << " invalid";
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(_state_mutex);
+        _settings.version = version;
+        _settings.stream = stream_settings;
+        _settings.recording = recording_settings;
         return true;
     }
 
-    void print_version()
+    void print_version(std::ostream& str)
     {
-        std::cout << _version;
+        str << settings().version;
+    }
+
+    // Firmware of the camera (not the gimbal), e.g. "0.2.1".
+    [[nodiscard]] std::string firmware_version() const
+    {
+        const auto version = settings().version;
+        return std::to_string(version.code_board_ver_major) + '.' +
+            std::to_string(version.code_board_ver_minor) + '.' +
+            std::to_string(version.code_board_ver_patch);
     }
 
     enum class Type {
@@ -82,170 +301,442 @@ public:
         Out,
     };
 
-    void print_settings(Type type)
+    void print_settings(Type type, std::ostream& str)
     {
+        const auto current = settings();
         switch (type) {
             case Type::Recording:
-                std::cout << "Recording settings: \n"
-                          << _recording_settings;
+                str << "Recording settings: \n"
+                    << current.recording;
                 break;
             case Type::Stream:
-                std::cout << "Stream settings: \n"
-                          << _stream_settings;
+                str << "Stream settings: \n"
+                    << current.stream;
                 break;
         }
     }
 
     [[nodiscard]] Resolution resolution() const {
-        if (_stream_settings.resolution_h == 1920 && _stream_settings.resolution_l == 3840) {
+        const auto stream = settings().stream;
+        if (stream.resolution_h == 1920 && stream.resolution_l == 3840) {
             return Resolution::Res3840x2160;
-        } else if (_stream_settings.resolution_h == 1440 && _stream_settings.resolution_l == 2560) {
+        } else if (stream.resolution_h == 1440 && stream.resolution_l == 2560) {
             return Resolution::Res2560x1440;
-        } else if (_stream_settings.resolution_h == 1080 && _stream_settings.resolution_l == 1920) {
+        } else if (stream.resolution_h == 1080 && stream.resolution_l == 1920) {
             return Resolution::Res1920x1080;
-        } else if (_stream_settings.resolution_h == 720 && _stream_settings.resolution_l == 1280) {
+        } else if (stream.resolution_h == 720 && stream.resolution_l == 1280) {
             return Resolution::Res1280x720;
         } else {
-            std::cerr << "resolution invalid" << std::endl;
+            LogLine(LogLevel::Warn) << "resolution invalid";
             assert(false);
             return Resolution::Res1280x720;
         }
     }
 
     bool set_resolution(Type type, Resolution resolution) {
-
-        auto set_stream_settings = siyi::StreamSettings{};
-
-        switch (type) {
-            case Type::Recording:
-                set_stream_settings.stream_type = 0;
-                break;
-            case Type::Stream:
-                set_stream_settings.stream_type = 1;
-                break;
-        }
-
+        std::uint16_t width = 0;
+        std::uint16_t height = 0;
         if (resolution == Resolution::Res1280x720) {
-            set_stream_settings.resolution_l = 1280;
-            set_stream_settings.resolution_h = 720;
+            width = 1280;
+            height = 720;
         } else if (resolution == Resolution::Res1920x1080) {
-            set_stream_settings.resolution_l = 1920;
-            set_stream_settings.resolution_h = 1080;
+            width = 1920;
+            height = 1080;
         } else if (resolution == Resolution::Res2560x1440) {
-            set_stream_settings.resolution_l = 2560;
-            set_stream_settings.resolution_h = 1440;
+            width = 2560;
+            height = 1440;
         } else if (resolution == Resolution::Res3840x2160) {
-            set_stream_settings.resolution_l = 3840;
-            set_stream_settings.resolution_h = 2160;
+            width = 3840;
+            height = 2160;
         } else {
-            std::cerr << "resolution invalid" << std::endl;
+            LogLine(LogLevel::Warn) << "resolution invalid";
             return false;
         }
 
-        set_stream_settings.video_enc_type = _stream_settings.video_enc_type;
-        set_stream_settings.video_bitrate_kbps= _stream_settings.video_bitrate_kbps;
+        return apply_stream_settings(type, [&](siyi::StreamSettings& stream_settings) {
+            stream_settings.resolution_l = width;
+            stream_settings.resolution_h = height;
+        });
+    }
 
-        _messager.send(_serializer.assemble_message(set_stream_settings));
-        const auto maybe_ack_set_stream_settings=
-                _deserializer.disassemble_message<siyi::AckSetStreamSettings>(_messager.receive());
+    [[nodiscard]] Codec codec(Type type) const {
+        const auto current = settings();
+        const auto& type_settings = (type == Type::Recording ? current.recording : current.stream);
 
-        if (!maybe_ack_set_stream_settings || maybe_ack_set_stream_settings.value().result != 1) {
-            std::cerr << "setting stream settings failed" << std::endl;
+        if (type_settings.video_enc_type == 1) {
+            return Codec::H264;
+        } else if (type_settings.video_enc_type == 2) {
+            return Codec::H265;
+        } else {
+            LogLine(LogLevel::Warn) << "codec invalid";
+            assert(false);
+            return Codec::H264;
+        }
+    }
+
+    bool set_codec(Type type, Codec codec) {
+        std::uint8_t video_enc_type = 0;
+        if (codec == Codec::H264) {
+            video_enc_type = 1;
+        } else if (codec == Codec::H265) {
+            video_enc_type = 2;
+        } else {
+            LogLine(LogLevel::Warn) << "codec invalid";
             return false;
         }
 
-        auto get_stream_settings = siyi::GetStreamSettings{};
-        get_stream_settings.stream_type = set_stream_settings.stream_type;
+        return apply_stream_settings(type, [&](siyi::StreamSettings& stream_settings) {
+            stream_settings.video_enc_type = video_enc_type;
+        });
+    }
 
-        _messager.send(_serializer.assemble_message(get_stream_settings));
-        const auto maybe_stream_settings =
-            _deserializer.disassemble_message<siyi::AckGetStreamResolution>(_messager.receive());
+    bool set_bitrate(Type type, unsigned bitrate)
+    {
+        return apply_stream_settings(type, [&](siyi::StreamSettings& stream_settings) {
+            stream_settings.video_bitrate_kbps = static_cast<std::uint16_t>(bitrate);
+        });
+    }
 
-        if (maybe_stream_settings) {
-            switch (type) {
-                case Type::Recording:
-                    _recording_settings = maybe_stream_settings.value();
-                    break;
-                case Type::Stream:
-                    _stream_settings = maybe_stream_settings.value();
-                    break;
+    [[nodiscard]] unsigned bitrate() const {
+        return settings().stream.video_bitrate_kbps;
+    }
+
+    // Waits for the camera to say it took the picture, so it's known when that
+    // was. Not every firmware might, so it doesn't count towards the camera
+    // being gone.
+    std::optional<Shot> take_picture()
+    {
+        std::lock_guard<std::mutex> lock(_transaction_mutex);
+
+        if (!_messager.send(_serializer.assemble_message(siyi::TakePicture{}))) {
+            return std::nullopt;
+        }
+        Shot shot{};
+        shot.sent = std::chrono::system_clock::now();
+
+        // Feedback about anything else, e.g. HDR, is skipped.
+        const auto deadline = std::chrono::steady_clock::now() + shutter_feedback_timeout;
+        while (true) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                break;
+            }
+            const auto message = receive_reply(AckFunctionFeedback::cmd_id_impl(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+            if (message.empty()) {
+                break;
+            }
+            const auto maybe_feedback = _deserializer.disassemble_message<siyi::AckFunctionFeedback>(message);
+            if (!maybe_feedback) {
+                continue;
+            }
+            const auto info = maybe_feedback.value().info_type;
+            if (info == AckFunctionFeedback::Info::PictureTaken ||
+                info == AckFunctionFeedback::Info::PictureFailed) {
+                shot.feedback = _messager.last_receive_time();
+                shot.success = (info == AckFunctionFeedback::Info::PictureTaken);
+                break;
             }
-            return true;
-        } else {
-            return false;
         }
+        return shot;
     }
 
-    [[nodiscard]] Codec codec(Type type) const {
-        auto& settings = (type == Type::Recording ? _recording_settings : _stream_settings);
+    // Fire and forget, so they don't need to wait for other transactions.
 
-        if (settings.video_enc_type == 1) {
-            return Codec::H264;
-        } else if (settings.video_enc_type == 2) {
-            return Codec::H265;
-        } else {
-            std::cerr << "codec invalid" << std::endl;
-            assert(false);
-            return Codec::H264;
-        }
+    bool toggle_recording()
+    {
+        return _messager.send(_serializer.assemble_message(siyi::ToggleRecording{}));
     }
 
-    bool set_codec(Type type, Codec codec) {
-        auto set_stream_settings = siyi::StreamSettings{};
-        switch (type) {
-            case Type::Recording:
-                set_stream_settings.stream_type = 0;
+    bool zoom(Zoom option)
+    {
+        static LogRateLimit zoom_log_limit;
+        auto manual_zoom = siyi::ManualZoom{};
+
+        switch (option) {
+            case Zoom::In:
+                manual_zoom.zoom = 1;
+                LogLine(LogLevel::Info, zoom_log_limit) << "Starting to zoom in";
                 break;
-            case Type::Stream:
-                set_stream_settings.stream_type = 1;
+            case Zoom::Out:
+                manual_zoom.zoom = -1;
+                LogLine(LogLevel::Info, zoom_log_limit) << "Starting to zoom out";
+                break;
+            case Zoom::Stop:
+                LogLine(LogLevel::Info, zoom_log_limit) << "Stopping to zoom";
+                manual_zoom.zoom = 0;
                 break;
         }
 
-        if (codec == Codec::H264) {
-            set_stream_settings.video_enc_type = 1;
-        } else if (codec == Codec::H265) {
-            set_stream_settings.video_enc_type = 2;
-        } else {
-            std::cerr << "codec invalid" << std::endl;
+        // Where the zoom ends up is polled, rather than acked.
+        const bool sent = _messager.send(_serializer.assemble_message(manual_zoom));
+        {
+            std::lock_guard<std::mutex> lock(_zoom_mutex);
+            _manual_zooming = (option != Zoom::Stop);
+            _zoom_moving_until = std::chrono::steady_clock::now() + zoom_settle_time;
+        }
+        wake();
+        return sent;
+    }
+
+    // Sent right away, unless the last target was sent only just now. Then it
+    // is sent a bit later, unless there is a newer one by then.
+    bool absolute_zoom(float factor)
+    {
+        if (factor > static_cast<float>(0x1E)) {
+            LogLine(LogLevel::Warn) << "zoom factor too high";
+            return false;
+        }
+        if (factor < 1.f) {
+            LogLine(LogLevel::Warn) << "zoom factor too small";
             return false;
         }
-        set_stream_settings.video_bitrate_kbps = _stream_settings.video_bitrate_kbps;
-        set_stream_settings.resolution_l = _stream_settings.resolution_l;
-        set_stream_settings.resolution_h = _stream_settings.resolution_h;
 
-        _messager.send(_serializer.assemble_message(set_stream_settings));
-        const auto maybe_ack_set_stream_settings =
-                _deserializer.disassemble_message<siyi::AckSetStreamSettings>(_messager.receive());
+        std::lock_guard<std::mutex> lock(_zoom_mutex);
+        const auto now = std::chrono::steady_clock::now();
+        _zoom_moving_until = now + zoom_settle_time;
+        if (now - _last_zoom_sent >= absolute_zoom_interval) {
+            _zoom_target.reset();
+            return send_absolute_zoom(factor, now);
+        }
+        _zoom_target = factor;
+        wake();
+        return true;
+    }
 
-        if (!maybe_ack_set_stream_settings || maybe_ack_set_stream_settings.value().result != 1) {
-            std::cerr << "setting stream settings failed" << std::endl;
-            return false;
+    // Asks the camera for its zoom, which is kept for zoom_level().
+    std::optional<float> query_zoom()
+    {
+        std::optional<float> factor;
+        bool changed = false;
+        {
+            std::lock_guard<std::mutex> lock(_transaction_mutex);
+
+            _messager.send(_serializer.assemble_message(siyi::GetZoom{}));
+            // Not every firmware might know this one, so it doesn't count
+            // towards the camera being gone.
+            const auto message = receive_reply(AckGetZoom::cmd_id_impl(), zoom_timeout);
+            if (message.empty()) {
+                return std::nullopt;
+            }
+            const auto maybe_ack_get_zoom = _deserializer.disassemble_message<siyi::AckGetZoom>(message);
+            if (!maybe_ack_get_zoom) {
+                return std::nullopt;
+            }
+            factor = maybe_ack_get_zoom.value().factor();
+
+            std::lock_guard<std::mutex> state_lock(_state_mutex);
+            changed = (_settings.zoom != factor.value());
+            _settings.zoom = factor.value();
         }
-        auto get_stream_settings = siyi::GetStreamSettings{};
-        get_stream_settings.stream_type = set_stream_settings.stream_type;
-        _messager.send(_serializer.assemble_message(get_stream_settings));
-        const auto maybe_stream_settings =
-                _deserializer.disassemble_message<siyi::AckGetStreamResolution>(_messager.receive());
 
-        if (maybe_stream_settings) {
-            switch (type) {
-                case Type::Recording:
-                    _recording_settings = maybe_stream_settings.value();
-                    break;
-                case Type::Stream:
-                    _stream_settings = maybe_stream_settings.value();
-                    break;
+        if (changed && _on_zoom) {
+            _on_zoom(factor.value());
+        }
+        return factor;
+    }
+
+    // As last polled.
+    [[nodiscard]] float zoom_level() const
+    {
+        return settings().zoom;
+    }
+
+private:
+    static constexpr unsigned init_rounds = 3;
+    static constexpr std::chrono::milliseconds init_round_timeout{500};
+
+    // Probing interval while disconnected, doubled every time up to the max.
+    static constexpr std::chrono::milliseconds probe_interval_min{200};
+    static constexpr std::chrono::milliseconds probe_interval_max{5000};
+    // Unanswered requests in a row until we consider the camera gone.
+    static constexpr unsigned max_unanswered = 3;
+
+    // The firmware version is the cheapest query there is.
+    static constexpr std::chrono::seconds heartbeat_interval{1};
+    static constexpr std::chrono::milliseconds heartbeat_timeout{500};
+
+    static constexpr std::chrono::milliseconds zoom_poll_interval{2000};
+    static constexpr std::chrono::milliseconds zoom_poll_interval_moving{200};
+    static constexpr std::chrono::milliseconds zoom_timeout{300};
+
+    static constexpr std::chrono::milliseconds shutter_feedback_timeout{500};
+    // How long the zoom is considered moving after the last command.
+    static constexpr std::chrono::milliseconds zoom_settle_time{2000};
+    // Absolute zoom targets are sent at most this often.
+    static constexpr std::chrono::milliseconds absolute_zoom_interval{200};
+
+    void run()
+    {
+        auto probe_interval = probe_interval_min;
+        std::chrono::steady_clock::time_point next_heartbeat{};
+        std::chrono::steady_clock::time_point next_zoom_poll{};
+        std::chrono::steady_clock::time_point last_zoom_poll{};
+
+        while (!_stop) {
+            const auto state = _state.load();
+
+            if (state == State::Disconnected) {
+                _state = State::Probing;
+                if (init()) {
+                    probe_interval = probe_interval_min;
+                    LogLine(LogLevel::Info) << "Camera connected";
+                    if (_on_connected) {
+                        _on_connected();
+                    }
+                    continue;
+                }
+                _state = State::Disconnected;
+                wait(probe_interval);
+                probe_interval = std::min(probe_interval * 2, probe_interval_max);
+                next_heartbeat = {};
+                next_zoom_poll = {};
+            } else {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= next_heartbeat) {
+                    heartbeat();
+                    next_heartbeat = now + heartbeat_interval;
+                }
+
+                now = std::chrono::steady_clock::now();
+                if (zoom_moving(now)) {
+                    next_zoom_poll = std::min(next_zoom_poll, last_zoom_poll + zoom_poll_interval_moving);
+                }
+                if (now >= next_zoom_poll) {
+                    (void)query_zoom();
+                    last_zoom_poll = now;
+                    next_zoom_poll = now + (zoom_moving(now) ? zoom_poll_interval_moving : zoom_poll_interval);
+                }
+
+                auto until = std::min(next_heartbeat, next_zoom_poll);
+                const auto maybe_zoom_due = send_pending_zoom();
+                if (maybe_zoom_due) {
+                    until = std::min(until, maybe_zoom_due.value());
+                }
+                wait_until(until);
             }
-            return true;
-        } else {
-            return false;
         }
     }
 
-    bool set_bitrate(Type type, unsigned bitrate)
+    void wait(std::chrono::milliseconds duration)
     {
-        auto set_stream_settings = siyi::StreamSettings{};
+        std::unique_lock<std::mutex> lock(_wake_mutex);
+        _wake.wait_for(lock, duration, [this]() { return _stop.load(); });
+    }
+
+    // Also returns early when there is something new to do about the zoom.
+    void wait_until(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(_wake_mutex);
+        _wake.wait_until(lock, deadline, [this]() { return _stop.load() || _zoom_wake.exchange(false); });
+    }
+
+    void wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wake_mutex);
+            _zoom_wake = true;
+        }
+        _wake.notify_all();
+    }
+
+    [[nodiscard]] bool zoom_moving(std::chrono::steady_clock::time_point now)
+    {
+        std::lock_guard<std::mutex> lock(_zoom_mutex);
+        return _manual_zooming || _zoom_target || now < _zoom_moving_until;
+    }
+
+    // Sends the newest target if it's due, otherwise returns when it will be.
+    std::optional<std::chrono::steady_clock::time_point> send_pending_zoom()
+    {
+        std::lock_guard<std::mutex> lock(_zoom_mutex);
+        if (!_zoom_target) {
+            return std::nullopt;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        const auto due = _last_zoom_sent + absolute_zoom_interval;
+        if (now < due) {
+            return due;
+        }
+        (void)send_absolute_zoom(_zoom_target.value(), now);
+        _zoom_target.reset();
+        return std::nullopt;
+    }
+
+    // Needs _zoom_mutex.
+    bool send_absolute_zoom(float factor, std::chrono::steady_clock::time_point now)
+    {
+        static LogRateLimit zoom_log_limit;
+        auto message = siyi::AbsoluteZoom{};
+
+        message.absolute_movement_integer = static_cast<uint8_t>(factor);
+        message.absolute_movement_fractional = static_cast<uint8_t>(std::roundf((factor-static_cast<float>(message.absolute_movement_integer)) * 10.f));
+
+        LogLine(LogLevel::Info, zoom_log_limit) << "Sending abs zoom: " << (int)message.absolute_movement_integer << "." << (int)message.absolute_movement_fractional;
+
+        _last_zoom_sent = now;
+        return _messager.send(_serializer.assemble_message(message));
+    }
 
+    void heartbeat()
+    {
+        std::lock_guard<std::mutex> lock(_transaction_mutex);
+
+        // The answer to a heartbeat which timed out could still arrive, and
+        // other threads send too, so the time is taken here.
+        const auto discarded = _messager.discard_pending();
+        if (discarded > 0) {
+            LogLine(LogLevel::Debug) << "Discarded " << discarded << " late message(s) before heartbeat";
+        }
+        const auto message = _serializer.assemble_message(siyi::FirmwareVersion{});
+        const auto sent = std::chrono::system_clock::now();
+        _messager.send(message);
+
+        const bool answered = !receive_reply(AckFirmwareVersion::cmd_id_impl(), heartbeat_timeout).empty();
+
+        {
+            std::lock_guard<std::mutex> state_lock(_state_mutex);
+            if (answered) {
+                _link_health.add_reply(std::max(std::chrono::microseconds(0),
+                    std::chrono::duration_cast<std::chrono::microseconds>(_messager.last_receive_time() - sent)));
+            } else {
+                _link_health.add_loss();
+            }
+        }
+        note_answer(answered);
+    }
+
+    // Waits for the answer with the given cmd_id. Anything else arriving now is
+    // late, or the answer to a command sent without waiting, and is skipped.
+    [[nodiscard]] PooledBuffer receive_reply(
+        std::uint8_t cmd_id, std::chrono::milliseconds timeout = std::chrono::milliseconds(1000))
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                return {};
+            }
+            auto message = _messager.receive_buffer(
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+            if (message.empty()) {
+                return {};
+            }
+            const auto maybe_header = Deserializer::header(message);
+            if (maybe_header && maybe_header.value().cmd_id == cmd_id) {
+                return message;
+            }
+        }
+    }
+
+    // Sets the stream settings, taking the current ones changed by mutate,
+    // and reads back what the camera made of them.
+    bool apply_stream_settings(Type type, const std::function<void(siyi::StreamSettings&)>& mutate)
+    {
+        std::lock_guard<std::mutex> lock(_transaction_mutex);
+        const auto current = settings();
+
+        auto set_stream_settings = siyi::StreamSettings{};
         switch (type) {
             case Type::Recording:
                 set_stream_settings.stream_type = 0;
@@ -254,18 +745,20 @@ public:
                 set_stream_settings.stream_type = 1;
                 break;
         }
-
-        set_stream_settings.video_bitrate_kbps = static_cast<std::uint16_t>(bitrate);
-        set_stream_settings.video_enc_type = _stream_settings.video_enc_type;
-        set_stream_settings.resolution_l = _stream_settings.resolution_l;
-        set_stream_settings.resolution_h = _stream_settings.resolution_h;
+        set_stream_settings.video_enc_type = current.stream.video_enc_type;
+        set_stream_settings.resolution_l = current.stream.resolution_l;
+        set_stream_settings.resolution_h = current.stream.resolution_h;
+        set_stream_settings.video_bitrate_kbps = current.stream.video_bitrate_kbps;
+        mutate(set_stream_settings);
 
         _messager.send(_serializer.assemble_message(set_stream_settings));
-        const auto maybe_ack_set_stream_settings=
-                _deserializer.disassemble_message<siyi::AckSetStreamSettings>(_messager.receive());
+        const auto maybe_ack_set_stream_settings =
+                _deserializer.disassemble_message<siyi::AckSetStreamSettings>(
+                    receive_reply(AckSetStreamSettings::cmd_id_impl()));
+        note_answer(maybe_ack_set_stream_settings.has_value());
 
         if (!maybe_ack_set_stream_settings || maybe_ack_set_stream_settings.value().result != 1) {
-            std::cerr << "setting stream settings failed" << std::endl;
+            LogLine(LogLevel::Warn) << "setting stream settings failed";
             return false;
         }
 
@@ -273,106 +766,155 @@ public:
         get_stream_settings.stream_type = set_stream_settings.stream_type;
         _messager.send(_serializer.assemble_message(get_stream_settings));
         const auto maybe_stream_settings =
-                _deserializer.disassemble_message<siyi::AckGetStreamResolution>(_messager.receive());
+                _deserializer.disassemble_message<siyi::AckGetStreamResolution>(
+                    receive_reply(AckGetStreamResolution::cmd_id_impl()));
+        if (!maybe_stream_settings) {
+            return false;
+        }
 
-        if (maybe_stream_settings) {
+        {
+            std::lock_guard<std::mutex> state_lock(_state_mutex);
             switch (type) {
                 case Type::Recording:
-                    _recording_settings = maybe_stream_settings.value();
+                    _settings.recording = maybe_stream_settings.value();
                     break;
                 case Type::Stream:
-                    _stream_settings = maybe_stream_settings.value();
+                    _settings.stream = maybe_stream_settings.value();
                     break;
             }
-            return true;
-        } else {
-            return false;
         }
+        persist_settings();
+        return true;
     }
 
-    [[nodiscard]] unsigned bitrate() const {
-        return _stream_settings.video_bitrate_kbps;
-    }
-
-    bool zoom(Zoom option)
+    // Needs to be called for every request which expects an answer, with the
+    // transaction lock held.
+    void note_answer(bool answered)
     {
-        auto manual_zoom = siyi::ManualZoom{};
+        std::lock_guard<std::mutex> state_lock(_state_mutex);
 
-        switch (option) {
-            case Zoom::In:
-                manual_zoom.zoom = 1;
-                std::cerr << "Starting to zoom in" << std::endl;
-                break;
-            case Zoom::Out:
-                manual_zoom.zoom = -1;
-                std::cerr << "Starting to zoom out" << std::endl;
-                break;
-            case Zoom::Stop:
-                std::cerr << "Stopping to zoom" << std::endl;
-                manual_zoom.zoom = 0;
-                break;
+        if (!answered) {
+            ++_unanswered;
+        } else {
+            _unanswered = 0;
         }
 
-        _messager.send(_serializer.assemble_message(manual_zoom));
+        if (_unanswered >= max_unanswered) {
+            if (_state != State::Disconnected) {
+                LogLine(LogLevel::Warn) << "Camera not answering, disconnected";
+                _link_health.reset();
+            }
+            _state = State::Disconnected;
+            return;
+        }
 
-        // We don't seem to be getting anything back, it just times out.
-        //const auto maybe_ack_manual_zoom =
-        //        _deserializer.disassemble_message<siyi::AckManualZoom>(_messager.receive());
+        if (_state != State::Ready && _state != State::Degraded) {
+            return;
+        }
 
-        //if (maybe_ack_manual_zoom) {
-        //    std::cerr << "current zoom: " << maybe_ack_manual_zoom.value().zoom_multiple << std::endl;
-        //    _ack_manual_zoom = maybe_ack_manual_zoom.value();
-        //    return false;
-        //}
-        return true;
+        const bool degraded = _unanswered > 0 || _link_health.degraded();
+        if (degraded && _state == State::Ready) {
+            const auto stats = _link_health.stats();
+            LogLine(LogLevel::Warn) << "Camera link degraded (loss " << stats.loss_rate * 100.0
+                                    << "%, rtt p95 " << stats.rtt_p95.count() / 1000.0
+                                    << " ms, jitter " << stats.jitter.count() / 1000.0 << " ms)";
+            _state = State::Degraded;
+        } else if (!degraded && _state == State::Degraded) {
+            LogLine(LogLevel::Info) << "Camera link recovered";
+            _state = State::Ready;
+        }
     }
 
-    // Unavailable
-    //[[nodiscard]] unsigned zoom() const {
-    //    return _ack_manual_zoom.zoom_multiple;
-    //}
+    static constexpr const char* settings_keys[] = {
+        "camera_ver_major", "camera_ver_minor", "camera_ver_patch",
+        "gimbal_ver_major", "gimbal_ver_minor", "gimbal_ver_patch",
+        "stream_enc_type", "stream_width", "stream_height", "stream_bitrate_kbps",
+        "recording_enc_type", "recording_width", "recording_height", "recording_bitrate_kbps",
+    };
 
-    bool absolute_zoom(float factor)
+    [[nodiscard]] static bool valid(const AckGetStreamResolution& settings)
     {
-        auto message = siyi::AbsoluteZoom{};
-
-        if (factor > static_cast<float>(0x1E)) {
-            std::cerr << "zoom factor too high" << std::endl;
+        if (settings.video_enc_type != 1 && settings.video_enc_type != 2) {
             return false;
         }
-        if (factor < 1.f) {
-            std::cerr << "zoom factor too small" << std::endl;
-            return false;
-        }
-
-        message.absolute_movement_integer = static_cast<uint8_t>(factor);
-        message.absolute_movement_fractional = static_cast<uint8_t>(std::roundf((factor-static_cast<float>(message.absolute_movement_integer)) * 10.f));
+        return (settings.resolution_l == 1280 && settings.resolution_h == 720) ||
+            (settings.resolution_l == 1920 && settings.resolution_h == 1080) ||
+            (settings.resolution_l == 2560 && settings.resolution_h == 1440) ||
+            (settings.resolution_l == 3840 && settings.resolution_h == 2160);
+    }
 
-        std::cerr << "Sending abs zoom: " << (int)message.absolute_movement_integer << "." << (int)message.absolute_movement_fractional << std::endl;
+    void persist_settings() const
+    {
+        if (_settings_file.empty()) {
+            return;
+        }
 
-        _messager.send(_serializer.assemble_message(message));
+        const auto current = settings();
 
-        // We don't seem to be getting anything back, it just times out.
-        //const auto maybe_ack_manual_zoom =
-        //        _deserializer.disassemble_message<siyi::AckManualZoom>(_messager.receive());
+        const std::filesystem::path path{_settings_file};
+        std::error_code ec;
+        if (path.has_parent_path()) {
+            std::filesystem::create_directories(path.parent_path(), ec);
+        }
 
-        //if (maybe_ack_manual_zoom) {
-        //    std::cerr << "current zoom: " << maybe_ack_manual_zoom.value().zoom_multiple << std::endl;
-        //    _ack_manual_zoom = maybe_ack_manual_zoom.value();
-        //    return false;
-        //}
-        return true;
+        // Write and rename, so a power loss does not leave half a file.
+        const std::string tmp_path = _settings_file + ".tmp";
+        {
+            std::ofstream file(tmp_path, std::ios::trunc);
+            file << "camera_ver_major=" << int(current.version.code_board_ver_major) << '\n'
+                 << "camera_ver_minor=" << int(current.version.code_board_ver_minor) << '\n'
+                 << "camera_ver_patch=" << int(current.version.code_board_ver_patch) << '\n'
+                 << "gimbal_ver_major=" << int(current.version.gimbal_firmware_ver_major) << '\n'
+                 << "gimbal_ver_minor=" << int(current.version.gimbal_firmware_ver_minor) << '\n'
+                 << "gimbal_ver_patch=" << int(current.version.gimbal_firmware_ver_patch) << '\n'
+                 << "stream_enc_type=" << int(current.stream.video_enc_type) << '\n'
+                 << "stream_width=" << current.stream.resolution_l << '\n'
+                 << "stream_height=" << current.stream.resolution_h << '\n'
+                 << "stream_bitrate_kbps=" << current.stream.video_bitrate_kbps << '\n'
+                 << "recording_enc_type=" << int(current.recording.video_enc_type) << '\n'
+                 << "recording_width=" << current.recording.resolution_l << '\n'
+                 << "recording_height=" << current.recording.resolution_h << '\n'
+                 << "recording_bitrate_kbps=" << current.recording.video_bitrate_kbps << '\n';
+            if (!file) {
+                LogLine(LogLevel::Err) << "Could not write settings file " << tmp_path;
+                return;
+            }
+        }
+        std::filesystem::rename(tmp_path, path, ec);
+        if (ec) {
+            LogLine(LogLevel::Err) << "Could not write settings file " << _settings_file << ": " << ec.message();
+        }
     }
 
-private:
     Serializer& _serializer;
     Deserializer& _deserializer;
     Messager& _messager;
 
-    AckFirmwareVersion _version{};
-    AckGetStreamResolution _recording_settings{};
-    AckGetStreamResolution _stream_settings{};
-    // AckManualZoom _ack_manual_zoom{};
+    // Held for every request which waits for an answer, so answers can't get
+    // mixed up.
+    std::mutex _transaction_mutex;
+    // Held briefly to access the settings and link health.
+    mutable std::mutex _state_mutex;
+
+    std::atomic<State> _state{State::Disconnected};
+    std::atomic<unsigned> _unanswered{0};
+    LinkHealth _link_health;
+    std::function<void()> _on_connected;
+    std::function<void(float)> _on_zoom;
+    std::thread _thread;
+    std::atomic<bool> _stop{false};
+    std::mutex _wake_mutex;
+    std::condition_variable _wake;
+    std::atomic<bool> _zoom_wake{false};
+
+    std::mutex _zoom_mutex;
+    std::optional<float> _zoom_target;
+    std::chrono::steady_clock::time_point _last_zoom_sent{};
+    std::chrono::steady_clock::time_point _zoom_moving_until{};
+    bool _manual_zooming{false};
+
+    std::string _settings_file;
+    Settings _settings{};
 };
 
 } // siyi
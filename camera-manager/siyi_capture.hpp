@@ -0,0 +1,236 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "siyi_buffer_pool.hpp"
+#include "logger.hpp"
+
+namespace siyi {
+
+// Capture of the traffic with the camera.
+//
+// The file starts with the magic "SIYICAP1", followed by one record per
+// datagram: a 16 byte header, all little endian, and the datagram itself.
+//
+//   0  uint64  monotonic timestamp in ns
+//   8  uint16  length of the datagram
+//  10  uint8   direction, 0 sent, 1 received
+//  11  uint8[5] reserved, 0
+//
+// Records are copied into a preallocated buffer and written to the file by a
+// background thread, so capturing doesn't block on the disk. If the disk can't
+// keep up, records are dropped rather than waited for.
+
+enum class CaptureDirection : std::uint8_t {
+    Sent = 0,
+    Received = 1,
+};
+
+struct CaptureRecord {
+    std::uint64_t timestamp_ns{0};
+    CaptureDirection direction{CaptureDirection::Sent};
+    std::vector<std::uint8_t> bytes;
+};
+
+static constexpr char capture_magic[] = {'S', 'I', 'Y', 'I', 'C', 'A', 'P', '1'};
+static constexpr std::size_t capture_record_header_len = 16;
+
+class CaptureWriter {
+public:
+    static constexpr std::size_t buffer_size = 64 * 1024;
+    static constexpr std::chrono::milliseconds flush_interval{1000};
+
+    CaptureWriter()
+    {
+        _active.reserve(buffer_size);
+        _flushing.reserve(buffer_size);
+    }
+
+    ~CaptureWriter()
+    {
+        close();
+    }
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    // Appends to the file if it exists already.
+    [[nodiscard]] bool open(const std::string& path)
+    {
+        _file = std::fopen(path.c_str(), "ab");
+        if (_file == nullptr) {
+            LogLine(LogLevel::Err) << "Could not open capture " << path << ": " << std::strerror(errno);
+            return false;
+        }
+
+        if (std::ftell(_file) == 0) {
+            std::fwrite(capture_magic, 1, sizeof(capture_magic), _file);
+        }
+
+        _stop = false;
+        _thread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    void close()
+    {
+        if (_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _wake.notify_all();
+            _thread.join();
+        }
+        if (_file != nullptr) {
+            std::fclose(_file);
+            _file = nullptr;
+        }
+    }
+
+    void record(CaptureDirection direction, ByteView bytes)
+    {
+        record(direction, bytes, static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count()));
+    }
+
+    void record(CaptureDirection direction, ByteView bytes, std::uint64_t timestamp_ns)
+    {
+        std::uint8_t header[capture_record_header_len]{};
+        for (unsigned i = 0; i < 8; ++i) {
+            header[i] = static_cast<std::uint8_t>(timestamp_ns >> (8 * i));
+        }
+        header[8] = bytes.size() & 0xff;
+        header[9] = (bytes.size() >> 8) & 0xff;
+        header[10] = static_cast<std::uint8_t>(direction);
+
+        bool half_full = false;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_file == nullptr || bytes.size() > 0xffff ||
+                _active.size() + sizeof(header) + bytes.size() > buffer_size) {
+                ++_dropped;
+                return;
+            }
+            // Within what's reserved, so no allocation.
+            _active.insert(_active.end(), std::begin(header), std::end(header));
+            _active.insert(_active.end(), bytes.begin(), bytes.end());
+            half_full = _active.size() >= buffer_size / 2;
+        }
+        if (half_full) {
+            _wake.notify_all();
+        }
+    }
+
+    [[nodiscard]] std::uint64_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dropped;
+    }
+
+private:
+    void run()
+    {
+        while (true) {
+            bool stop = false;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait_for(lock, flush_interval, [this]() {
+                    return _stop || _active.size() >= buffer_size / 2;
+                });
+                std::swap(_active, _flushing);
+                stop = _stop;
+            }
+
+            if (!_flushing.empty()) {
+                std::fwrite(_flushing.data(), 1, _flushing.size(), _file);
+                std::fflush(_file);
+                _flushing.clear();
+            }
+
+            if (stop) {
+                break;
+            }
+        }
+    }
+
+    std::FILE* _file{nullptr};
+    mutable std::mutex _mutex;
+    std::condition_variable _wake;
+    std::thread _thread;
+    bool _stop{false};
+    std::vector<std::uint8_t> _active;
+    std::vector<std::uint8_t> _flushing;
+    std::uint64_t _dropped{0};
+};
+
+class CaptureReader {
+public:
+    [[nodiscard]] bool open(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            LogLine(LogLevel::Err) << "Could not open capture " << path;
+            return false;
+        }
+        _data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+        if (_data.size() < sizeof(capture_magic) ||
+            std::memcmp(_data.data(), capture_magic, sizeof(capture_magic)) != 0) {
+            LogLine(LogLevel::Err) << "Not a capture: " << path;
+            return false;
+        }
+
+        rewind();
+        return true;
+    }
+
+    void rewind()
+    {
+        _pos = sizeof(capture_magic);
+    }
+
+    // Returns nothing at the end, or if the rest is cut off.
+    [[nodiscard]] std::optional<CaptureRecord> next()
+    {
+        if (_pos + capture_record_header_len > _data.size()) {
+            return std::nullopt;
+        }
+
+        const auto* header = _data.data() + _pos;
+        CaptureRecord record;
+        for (unsigned i = 0; i < 8; ++i) {
+            record.timestamp_ns |= static_cast<std::uint64_t>(header[i]) << (8 * i);
+        }
+        const std::size_t len = header[8] | (header[9] << 8);
+        record.direction = static_cast<CaptureDirection>(header[10]);
+
+        if (_pos + capture_record_header_len + len > _data.size()) {
+            return std::nullopt;
+        }
+
+        const auto begin = _data.begin() + static_cast<std::ptrdiff_t>(_pos + capture_record_header_len);
+        record.bytes.assign(begin, begin + static_cast<std::ptrdiff_t>(len));
+        _pos += capture_record_header_len + len;
+        return record;
+    }
+
+private:
+    std::vector<std::uint8_t> _data;
+    std::size_t _pos{0};
+};
+
+} // namespace siyi
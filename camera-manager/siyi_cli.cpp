@@ -1,16 +1,30 @@
 #include "siyi_camera.hpp"
+#include "shutter_timing.hpp"
+#include <chrono>
 #include <cstdlib>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 void print_usage(const std::string_view& bin_name)
 {
-    std::cout << "Usage: " << bin_name << " action [options]\n"
+    std::cout << "Usage: " << bin_name << " [--mux <socket>] action [options]\n"
+              << "  --mux <socket>                              Go through siyi_mux instead of to the camera directly\n\n"
               << "Actions:\n\n"
               << "  help                                        Show this help\n\n"
+              << "  batch [file]                                Run the commands from file (or stdin), one per line,\n"
+              << "                                                all over one connection\n\n"
               << "  version                                     Show camera and gimbal version\n\n"
               << "  take_picture                                Take a picture to SD card\n\n"
+              << "  calibrate_shutter [count] [offset_ms]       Take pictures (default 10) and show how long until the\n"
+              << "                                                camera's feedback, and until the exposure, which is\n"
+              << "                                                offset_ms from the feedback (measured against a\n"
+              << "                                                reference, default 0)\n\n"
               << "  toggle_recording                            Toggle start/stop video recording to SD card\n\n"
               << "  gimbal mode <follow|lock|fpv>               Set gimbal mode to follow, lock, or FPV\n\n"
               << "  gimbal neutral                              Set gimbal forward\n\n"
@@ -21,6 +35,7 @@ void print_usage(const std::string_view& bin_name)
               << "      - in (to start zooming in)\n"
               << "      - out (to start zooming out)\n"
               << "      - stop (to stop zooming)\n"
+              << "      - level (to show the current zoom)\n"
               << "      - <factor> (1.0 to 6.0)\n"
               << "\n"
               << "  get <stream|recording> settings             Show all settings for stream or recording\n\n"
@@ -44,51 +59,137 @@ void print_usage(const std::string_view& bin_name)
               << std::endl;
 }
 
-int main(int argc, char* argv[])
-{
-    siyi::Messager siyi_messager;
-    siyi_messager.setup("192.168.144.25", 37260);
+// Sends commands to the camera.
+//
+// Only messages which ask for an ack get a reply. In batch mode, the replies we
+// don't look at anyway are not waited for one by one. Instead, they are
+// collected before the next command which needs an answer from the camera, and
+// at the end.
+class Session {
+public:
+    Session(siyi::Messager& messager, bool pipelined) :
+        _messager(messager),
+        _pipelined(pipelined) {}
 
-    siyi::Serializer siyi_serializer;
-    siyi::Deserializer siyi_deserializer;
+    bool send(const std::vector<std::uint8_t>& message)
+    {
+        if (!_messager.send(message)) {
+            return false;
+        }
+        const auto maybe_header = siyi::Deserializer::header(message);
+        if (!maybe_header || !maybe_header.value().need_ack()) {
+            return true;
+        }
+        if (_pipelined) {
+            ++_outstanding;
+        } else {
+            (void)_messager.receive();
+        }
+        return true;
+    }
 
-    siyi::Camera siyi_camera{siyi_serializer, siyi_deserializer, siyi_messager};
+    // Returns how many of the outstanding replies did not arrive.
+    unsigned collect_replies()
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (_outstanding > 0) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                break;
+            }
+            const auto message = _messager.receive(
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now));
+            if (message.empty()) {
+                break;
+            }
+            --_outstanding;
+        }
 
-    if (!siyi_camera.init()) {
-        std::cout << "Error: camera could not get initialized.";
-        return 1;
+        const auto missing = _outstanding;
+        _outstanding = 0;
+        return missing;
     }
 
-    if (argc == 1 ) {
-        std::cout << "No argument supplied." << std::endl;
-        print_usage(argv[0]);
-        return 0;
-    }
+private:
+    siyi::Messager& _messager;
+    bool _pipelined;
+    unsigned _outstanding{0};
+};
 
-    const std::string_view action{argv[1]};
+// args are the same as argv, starting with the binary name.
+static int run_command(
+    const std::vector<std::string>& args, Session& session,
+    siyi::Serializer& siyi_serializer, siyi::Camera& siyi_camera)
+{
+    const std::string_view action{args[1]};
 
     if (action == "help") {
-        print_usage(argv[0]);
+        print_usage(args[0]);
 
     } else if (action == "version") {
-        siyi_camera.print_version();
+        siyi_camera.print_version(std::cout);
 
     } else if (action == "take_picture") {
         std::cout << "Take picture" << std::endl;
-        siyi_messager.send(siyi_serializer.assemble_message(siyi::TakePicture{}));
-        (void)siyi_messager.receive();
+        session.send(siyi_serializer.assemble_message(siyi::TakePicture{}));
+
+    } else if (action == "calibrate_shutter") {
+        session.collect_replies();
+
+        const long count = args.size() >= 3 ? std::strtol(args[2].c_str(), nullptr, 10) : 10;
+        const long offset_ms = args.size() >= 4 ? std::strtol(args[3].c_str(), nullptr, 10) : 0;
+        if (count <= 0) {
+            std::cout << "Invalid count" << std::endl;
+            print_usage(args[0]);
+            return 1;
+        }
+
+        siyi::ShutterTiming shutter_timing{std::chrono::milliseconds(offset_ms)};
+        unsigned missing = 0;
+        for (long i = 0; i < count; ++i) {
+            if (i > 0) {
+                // Give the camera time to store the last one.
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            const auto shot = siyi_camera.take_picture();
+            if (!shot || !shot.value().feedback) {
+                std::cout << "Picture " << i << ": no feedback" << std::endl;
+                ++missing;
+                continue;
+            }
+            const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                shot.value().feedback.value() - shot.value().sent);
+            shutter_timing.add(latency);
+            std::cout << "Picture " << i << (shot.value().success ? "" : " (failed)")
+                      << ": feedback after " << latency.count() / 1000.0 << " ms" << std::endl;
+        }
+
+        const auto print_stats = [](const char* name, const siyi::ShutterTiming::Stats& stats) {
+            std::cout << std::fixed << std::setprecision(1) << name
+                      << "p50 " << stats.p50.count() / 1000.0 << " ms, "
+                      << "p95 " << stats.p95.count() / 1000.0 << " ms, "
+                      << "max " << stats.max.count() / 1000.0 << " ms, "
+                      << "stddev " << stats.stddev.count() / 1000.0 << " ms" << std::endl;
+        };
+        std::cout << "Feedback for " << shutter_timing.send_to_feedback().samples << " of " << count << " pictures" << std::endl;
+        if (shutter_timing.send_to_feedback().samples > 0) {
+            print_stats("Send to feedback: ", shutter_timing.send_to_feedback());
+            print_stats("Send to exposure: ", shutter_timing.send_to_exposure());
+        }
+        if (missing > 0) {
+            return 1;
+        }
 
     } else if (action == "toggle_recording") {
         std::cout << "Toggle recording" << std::endl;
-        siyi_messager.send(siyi_serializer.assemble_message(siyi::ToggleRecording{}));
-        (void)siyi_messager.receive();
+        session.send(siyi_serializer.assemble_message(siyi::ToggleRecording{}));
 
     } else if (action == "gimbal") {
-        if (argc >= 3) {
-            const std::string_view command {argv[2]};
+        if (args.size() >= 3) {
+            const std::string_view command {args[2]};
             if (command == "mode") {
-                if (argc == 4) {
-                    const std::string_view mode {argv[3]};
+                if (args.size() == 4) {
+                    const std::string_view mode {args[3]};
                     siyi::SetGimbalMode set_gimbal_mode{};
                     if (mode == "lock") {
                         set_gimbal_mode.mode = siyi::SetGimbalMode::Mode::Lock;
@@ -98,48 +199,45 @@ int main(int argc, char* argv[])
                         set_gimbal_mode.mode = siyi::SetGimbalMode::Mode::Fpv;
                     } else {
                         std::cout << "Unkown mode: " << mode << std::endl;
-                        print_usage(argv[0]);
+                        print_usage(args[0]);
                         return 1;
                     }
                     std::cout << "Set gimbal mode to " << mode << std::endl;
-                    siyi_messager.send(siyi_serializer.assemble_message(set_gimbal_mode));
-                    //(void)siyi_messager.receive();
+                    session.send(siyi_serializer.assemble_message(set_gimbal_mode));
                 } else {
                     std::cout << "Not enough arguments" << std::endl;
-                    print_usage(argv[0]);
+                    print_usage(args[0]);
                     return 1;
                 }
 
             } else if (command == "neutral") {
                 std::cout << "Set gimbal neutral" << std::endl;
-                siyi_messager.send(siyi_serializer.assemble_message(siyi::GimbalCenter{}));
-                (void)siyi_messager.receive();
+                session.send(siyi_serializer.assemble_message(siyi::GimbalCenter{}));
             } else if (command == "angle") {
-                if (argc >= 5) {
-                    auto pitch = std::strtol(argv[3], nullptr, 10);
-                    auto yaw = std::strtol(argv[4], nullptr, 10);
+                if (args.size() >= 5) {
+                    auto pitch = std::strtol(args[3].c_str(), nullptr, 10);
+                    auto yaw = std::strtol(args[4].c_str(), nullptr, 10);
                     std::cout << "Set gimbal to " << pitch << " deg and yaw " << yaw << std::endl;
                     siyi::SetGimbalAttitude set_gimbal_attitude{};
                     set_gimbal_attitude.pitch_t10 = static_cast<std::int16_t>(pitch*10);
                     set_gimbal_attitude.yaw_t10 = static_cast<std::int16_t>(-yaw*10);
-                    siyi_messager.send(siyi_serializer.assemble_message(set_gimbal_attitude));
-                    (void)siyi_messager.receive();
+                    session.send(siyi_serializer.assemble_message(set_gimbal_attitude));
 
                 } else {
                     std::cout << "Not enough arguments" << std::endl;
-                    print_usage(argv[0]);
+                    print_usage(args[0]);
                     return 1;
                 }
             } else {
                 std::cout << "Invalid gimbal command" << std::endl;
-                print_usage(argv[0]);
+                print_usage(args[0]);
                 return 1;
             }
         }
 
     } else if (action == "get") {
-        if (argc >= 3) {
-            const std::string_view type_str{argv[2]};
+        if (args.size() >= 3) {
+            const std::string_view type_str{args[2]};
             siyi::Camera::Type type;
             if (type_str == "stream") {
                 type = siyi::Camera::Type::Stream;
@@ -147,22 +245,25 @@ int main(int argc, char* argv[])
                 type = siyi::Camera::Type::Recording;
             } else {
                 std::cout << "Invalid type" << std::endl;
-                print_usage(argv[0]);
+                print_usage(args[0]);
                 return 1;
             }
 
-            siyi_camera.print_settings(type);
+            siyi_camera.print_settings(type, std::cout);
         } else {
             std::cout << "Not enough arguments" << std::endl;
-            print_usage(argv[0]);
+            print_usage(args[0]);
             return 1;
         }
 
     } else if (action == "set") {
-        if (argc >= 5) {
-            const std::string_view type_str{argv[2]};
-            const std::string_view setting{argv[3]};
-            const std::string_view option{argv[4]};
+        // Settings are transactions, earlier replies must not get in the way.
+        session.collect_replies();
+
+        if (args.size() >= 5) {
+            const std::string_view type_str{args[2]};
+            const std::string_view setting{args[3]};
+            const std::string_view option{args[4]};
 
             siyi::Camera::Type type;
             if (type_str == "stream") {
@@ -171,7 +272,7 @@ int main(int argc, char* argv[])
                 type = siyi::Camera::Type::Recording;
             } else {
                 std::cout << "Invalid type" << std::endl;
-                print_usage(argv[0]);
+                print_usage(args[0]);
                 return 1;
             }
 
@@ -210,7 +311,7 @@ int main(int argc, char* argv[])
                     }
                 } else {
                     std::cout << "Invalid resolution" << std::endl;
-                    print_usage(argv[0]);
+                    print_usage(args[0]);
                     return 1;
                 }
             } else if (setting == "bitrate") {
@@ -248,7 +349,7 @@ int main(int argc, char* argv[])
                     }
                 } else {
                     std::cout << "Invalid bitrate" << std::endl;
-                    print_usage(argv[0]);
+                    print_usage(args[0]);
                     return 1;
                 }
 
@@ -271,28 +372,28 @@ int main(int argc, char* argv[])
                     }
                 } else {
                     std::cout << "Invalid codec" << std::endl;
-                    print_usage(argv[0]);
+                    print_usage(args[0]);
                     return 1;
                 }
 
             } else {
                 std::cout << "Unknown setting" << std::endl;
-                print_usage(argv[0]);
+                print_usage(args[0]);
                 return 1;
             }
 
             std::cout << "New " << type_str << " settings:" << std::endl;
-            siyi_camera.print_settings(type);
+            siyi_camera.print_settings(type, std::cout);
 
         } else {
             std::cout << "Not enough arguments" << std::endl;
-            print_usage(argv[0]);
+            print_usage(args[0]);
             return 1;
         }
 
     } else if (action == "zoom") {
-        if (argc >= 3) {
-            const std::string_view option{argv[2]};
+        if (args.size() >= 3) {
+            const std::string_view option{args[2]};
             if (option == "in") {
                 std::cout << "Zooming in..." << std::flush;
                 if (siyi_camera.zoom(siyi::Camera::Zoom::In)) {
@@ -317,37 +418,138 @@ int main(int argc, char* argv[])
                     std::cout << "failed" << std::endl;
                     return 1;
                 }
+            } else if (option == "level") {
+                session.collect_replies();
+                const auto maybe_factor = siyi_camera.query_zoom();
+                if (!maybe_factor) {
+                    std::cout << "Zoom unknown" << std::endl;
+                    return 1;
+                }
+                std::cout << "Zoom: " << maybe_factor.value() << "x" << std::endl;
             } else {
                 float factor;
                 try {
                     factor = std::stof(option.data());
                 } catch (std::invalid_argument&) {
                     std::cout << "Invalid zoom command" << std::endl;
-                    print_usage(argv[0]);
+                    print_usage(args[0]);
                     return 1;
                 };
                 siyi_camera.absolute_zoom(factor);
             }
         } else {
             std::cout << "Not enough arguments" << std::endl;
-            print_usage(argv[0]);
+            print_usage(args[0]);
             return 1;
         }
 
-    } else if (action == "zoom") {
-        if (argc >= 3) {
+    } else {
+        std::cout << "Unknown command" << std::endl;
+        print_usage(args[0]);
+        return 2;
+    }
+
+    return 0;
+}
+
+// Runs the commands from input, one per line, returns how many failed.
+static unsigned run_batch(
+    std::istream& input, const std::string& bin_name, Session& session,
+    siyi::Serializer& siyi_serializer, siyi::Camera& siyi_camera)
+{
+    const auto batch_start = std::chrono::steady_clock::now();
+    unsigned failed = 0;
+    unsigned count = 0;
+
+    std::string line;
+    while (std::getline(input, line)) {
+        std::vector<std::string> args{bin_name};
+        std::istringstream words(line);
+        std::string word;
+        while (words >> word) {
+            args.push_back(word);
+        }
 
+        // Empty lines and comments
+        if (args.size() == 1 || args[1][0] == '#') {
+            continue;
+        }
+
+        ++count;
+        int result = 1;
+        const auto start = std::chrono::steady_clock::now();
+        if (args[1] == "batch") {
+            std::cout << "Batch can't be nested" << std::endl;
         } else {
-            std::cout << "Not enough arguments" << std::endl;
-            print_usage(argv[0]);
-            return 1;
+            result = run_command(args, session, siyi_serializer, siyi_camera);
+        }
+        const auto duration = std::chrono::steady_clock::now() - start;
+
+        if (result != 0) {
+            ++failed;
         }
+        std::cout << "[" << std::fixed << std::setprecision(1)
+                  << std::chrono::duration<double, std::milli>(duration).count() << " ms] "
+                  << line << ": " << (result == 0 ? "ok" : "failed") << std::endl;
+    }
+
+    const auto missing = session.collect_replies();
+    if (missing > 0) {
+        std::cout << missing << " replies missing" << std::endl;
+    }
 
+    std::cout << count << " commands, " << failed << " failed, in " << std::fixed << std::setprecision(1)
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batch_start).count()
+              << " ms" << std::endl;
+
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> args(argv, argv + argc);
+
+    siyi::Messager siyi_messager;
+    if (args.size() >= 3 && args[1] == "--mux") {
+        if (!siyi_messager.setup_mux(args[2])) {
+            return 1;
+        }
+        args.erase(args.begin() + 1, args.begin() + 3);
     } else {
-        std::cout << "Unknown command" << std::endl;
-        print_usage(argv[0]);
-        return 2;
+        siyi_messager.setup("192.168.144.25", 37260);
     }
 
-    return 0;
+    siyi::Serializer siyi_serializer;
+    siyi::Deserializer siyi_deserializer;
+
+    siyi::Camera siyi_camera{siyi_serializer, siyi_deserializer, siyi_messager};
+
+    if (!siyi_camera.init()) {
+        std::cout << "Error: camera could not get initialized.";
+        return 1;
+    }
+
+    if (args.size() == 1) {
+        std::cout << "No argument supplied." << std::endl;
+        print_usage(args[0]);
+        return 0;
+    }
+
+    if (args[1] == "batch") {
+        Session session{siyi_messager, true};
+
+        if (args.size() < 3 || args[2] == "-") {
+            return run_batch(std::cin, args[0], session, siyi_serializer, siyi_camera) == 0 ? 0 : 1;
+        }
+
+        std::ifstream file(args[2]);
+        if (!file) {
+            std::cout << "Could not open " << args[2] << std::endl;
+            return 1;
+        }
+        return run_batch(file, args[0], session, siyi_serializer, siyi_camera) == 0 ? 0 : 1;
+    }
+
+    Session session{siyi_messager, false};
+    return run_command(args, session, siyi_serializer, siyi_camera);
 }
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace siyi {
+
+// Field layouts of the payloads.
+//
+// Every payload lists its fields once, with their offset and byte order, e.g.
+//
+//     using layout = Layout<2,
+//         Field<&GimbalRotate::_turn_yaw, 0>,
+//         Field<&GimbalRotate::_turn_pitch, 1>>;
+//
+// and encoding and decoding is generated from that: a fixed sequence of byte
+// copies and shifts per field, with the size known at compile time. Bytes not
+// covered by a field (reserved) are 0 when encoding and ignored when decoding.
+
+enum class Endian {
+    Little,
+    Big,
+};
+
+namespace detail {
+
+template<typename MemberPointer>
+struct MemberTraits;
+
+template<typename Owner, typename Member>
+struct MemberTraits<Member Owner::*> {
+    using owner = Owner;
+    using type = std::remove_cv_t<Member>;
+};
+
+// Integers and enums, as the unsigned integer of the same size.
+template<typename T, bool = std::is_enum_v<T>>
+struct Raw {
+    using type = std::make_unsigned_t<T>;
+};
+
+template<typename T>
+struct Raw<T, true> {
+    using type = std::make_unsigned_t<std::underlying_type_t<T>>;
+};
+
+} // namespace detail
+
+template<auto Member, std::size_t Offset, Endian Order = Endian::Little>
+struct Field {
+    using owner = typename detail::MemberTraits<decltype(Member)>::owner;
+    using type = typename detail::MemberTraits<decltype(Member)>::type;
+    using raw = typename detail::Raw<type>::type;
+
+    static constexpr std::size_t offset = Offset;
+    static constexpr std::size_t size = sizeof(type);
+    static constexpr std::size_t end = Offset + size;
+
+    static void encode(const owner& self, std::uint8_t* out)
+    {
+        const auto value = static_cast<raw>(self.*Member);
+        for (std::size_t i = 0; i < size; ++i) {
+            const std::size_t shift = 8 * (Order == Endian::Little ? i : size - 1 - i);
+            out[Offset + i] = static_cast<std::uint8_t>(value >> shift);
+        }
+    }
+
+    static void decode(owner& self, const std::uint8_t* in)
+    {
+        raw value = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            const std::size_t shift = 8 * (Order == Endian::Little ? i : size - 1 - i);
+            value = static_cast<raw>(value | (static_cast<raw>(in[Offset + i]) << shift));
+        }
+        self.*Member = static_cast<type>(value);
+    }
+};
+
+template<std::size_t Size, typename... Fields>
+struct Layout {
+    static constexpr std::size_t size = Size;
+
+    template<typename Owner>
+    static void encode(const Owner& self, std::uint8_t* out)
+    {
+        (void)self;
+        for (std::size_t i = 0; i < Size; ++i) {
+            out[i] = 0;
+        }
+        (Fields::encode(self, out), ...);
+    }
+
+    template<typename Owner>
+    static void decode(Owner& self, const std::uint8_t* in)
+    {
+        (void)self;
+        (void)in;
+        (Fields::decode(self, in), ...);
+    }
+
+private:
+    // Fields need to be in order, and must neither overlap nor go past the end.
+    static constexpr bool in_order()
+    {
+        constexpr std::size_t offsets[] = {Fields::offset..., Size};
+        constexpr std::size_t ends[] = {0, Fields::end...};
+        for (std::size_t i = 0; i < sizeof...(Fields) + 1; ++i) {
+            if (offsets[i] < ends[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(in_order(), "fields overlap or don't fit");
+};
+
+} // namespace siyi
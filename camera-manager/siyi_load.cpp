@@ -0,0 +1,335 @@
+#include "link_health.hpp"
+#include "siyi_protocol.hpp"
+#include "siyi_stand_in.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static void print_usage(const std::string& bin_name)
+{
+    std::cout << "Usage: " << bin_name << " [options]\n"
+              << "Options:\n"
+              << "  --camera <ip>             IP of the camera (default 192.168.144.25)\n"
+              << "  --mux <socket>            Go through siyi_mux instead of to the camera directly\n"
+              << "  --stand-in                Send to a local stand-in for the camera instead\n"
+              << "  --mix <kind:weight,...>   Commands sent, out of gimbal (rotation stop), zoom (zoom query)\n"
+              << "                            and settings (stream settings query), default gimbal:1,zoom:1,settings:1\n"
+              << "  --rate <per second>       Send at this rate, no matter how the camera keeps up (open loop)\n"
+              << "  --concurrency <count>     Keep this many commands waiting for their reply (closed loop, default 1)\n"
+              << "  --duration <seconds>      How long to send for (default 10)\n"
+              << "  --timeout-ms <ms>         When a reply counts as lost (default 1000)\n"
+              << "  --max-loss <percent>      Fail if more replies are lost (default 100)\n"
+              << "  --help                    Show this help message\n";
+}
+
+namespace {
+
+enum class Kind {
+    Gimbal,
+    Zoom,
+    Settings,
+};
+
+constexpr const char* kind_names[] = {"gimbal", "zoom", "settings"};
+constexpr std::size_t kind_count = sizeof(kind_names) / sizeof(kind_names[0]);
+
+// Waiting for its reply.
+struct Outstanding {
+    Kind kind;
+    std::uint8_t cmd_id;
+    std::chrono::steady_clock::time_point due;
+    std::chrono::system_clock::time_point sent;
+    // How much later than scheduled it was sent, at a fixed rate.
+    std::chrono::microseconds late;
+};
+
+struct Results {
+    std::uint64_t sent{0};
+    std::uint64_t lost{0};
+    std::vector<std::chrono::microseconds> latencies;
+};
+
+} // namespace
+
+// The kinds in the order they are sent, e.g. gimbal:2,zoom:1 is gimbal, gimbal,
+// zoom, over and over, so runs are repeatable.
+static std::optional<std::vector<Kind>> parse_mix(const std::string& mix)
+{
+    std::vector<Kind> sequence;
+    std::istringstream stream{mix};
+    std::string entry;
+    while (std::getline(stream, entry, ',')) {
+        const auto colon = entry.find(':');
+        const auto name = entry.substr(0, colon);
+        unsigned long weight = 1;
+        if (colon != std::string::npos) {
+            char* end = nullptr;
+            weight = std::strtoul(entry.c_str() + colon + 1, &end, 10);
+            if (*end != '\0' || weight > 100) {
+                return std::nullopt;
+            }
+        }
+
+        const auto found = std::find_if(std::begin(kind_names), std::end(kind_names),
+            [&](const char* kind_name) { return name == kind_name; });
+        if (found == std::end(kind_names)) {
+            return std::nullopt;
+        }
+        sequence.insert(sequence.end(), weight, static_cast<Kind>(found - std::begin(kind_names)));
+    }
+    if (sequence.empty()) {
+        return std::nullopt;
+    }
+    return sequence;
+}
+
+// The gimbal and zoom are left where they are, so it can be run on the bench.
+static std::vector<std::uint8_t> assemble(siyi::Serializer& serializer, Kind kind, std::uint64_t count)
+{
+    switch (kind) {
+        case Kind::Gimbal:
+            return serializer.assemble_message(siyi::GimbalRotate{0, 0}, true);
+        case Kind::Zoom:
+            return serializer.assemble_message(siyi::GetZoom{});
+        case Kind::Settings: {
+            siyi::GetStreamSettings get_stream_settings{};
+            get_stream_settings.stream_type = count % 2;
+            return serializer.assemble_message(get_stream_settings);
+        }
+    }
+    return {};
+}
+
+static void print_results(const std::string& name, Results& results, double seconds)
+{
+    std::sort(results.latencies.begin(), results.latencies.end());
+    const auto answered = results.latencies.size();
+    const auto ms = [](std::chrono::microseconds latency) { return static_cast<double>(latency.count()) / 1000.0; };
+
+    std::cout << std::fixed << std::setprecision(1) << std::left << std::setw(10) << name << std::right
+              << std::setw(8) << results.sent << " sent " << std::setw(9) << static_cast<double>(answered) / seconds << "/s "
+              << std::setw(6) << results.lost << " lost ("
+              << (results.sent > 0 ? 100.0 * static_cast<double>(results.lost) / static_cast<double>(results.sent) : 0.0)
+              << "%)" << std::setprecision(3)
+              << "  p50 " << ms(siyi::percentile(results.latencies, 500)) << " ms"
+              << "  p99 " << ms(siyi::percentile(results.latencies, 990)) << " ms"
+              << "  p99.9 " << ms(siyi::percentile(results.latencies, 999)) << " ms"
+              << "  max " << ms(results.latencies.empty() ? std::chrono::microseconds(0) : results.latencies.back()) << " ms"
+              << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string camera_ip{"192.168.144.25"};
+    std::string mux_socket;
+    bool stand_in_requested = false;
+    std::string mix{"gimbal:1,zoom:1,settings:1"};
+    double rate = 0.0;
+    unsigned long concurrency = 1;
+    double duration_s = 10.0;
+    unsigned long timeout_ms = 1000;
+    double max_loss = 100.0;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string current_arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        char* end = nullptr;
+
+        if (current_arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (current_arg == "--stand-in") {
+            stand_in_requested = true;
+            continue;
+        } else if (!has_value) {
+            std::cerr << "Invalid argument: " << current_arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        const std::string value = argv[++i];
+        if (current_arg == "--camera") {
+            camera_ip = value;
+        } else if (current_arg == "--mux") {
+            mux_socket = value;
+        } else if (current_arg == "--mix") {
+            mix = value;
+        } else if (current_arg == "--rate") {
+            rate = std::strtod(value.c_str(), &end);
+        } else if (current_arg == "--concurrency") {
+            concurrency = std::strtoul(value.c_str(), &end, 10);
+        } else if (current_arg == "--duration") {
+            duration_s = std::strtod(value.c_str(), &end);
+        } else if (current_arg == "--timeout-ms") {
+            timeout_ms = std::strtoul(value.c_str(), &end, 10);
+        } else if (current_arg == "--max-loss") {
+            max_loss = std::strtod(value.c_str(), &end);
+        } else {
+            std::cerr << "Invalid argument: " << current_arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (end != nullptr && *end != '\0') {
+            std::cerr << "Invalid value for " << current_arg << ": " << value << std::endl;
+            return 1;
+        }
+    }
+
+    const auto sequence = parse_mix(mix);
+    if (!sequence) {
+        std::cerr << "Invalid mix: " << mix << std::endl;
+        return 1;
+    }
+    if (rate < 0.0 || concurrency == 0 || duration_s <= 0.0 || timeout_ms == 0) {
+        std::cerr << "Rate, concurrency, duration and timeout need to be positive" << std::endl;
+        return 1;
+    }
+
+    siyi::StandIn stand_in;
+    siyi::Messager messager;
+    if (stand_in_requested) {
+        if (!stand_in.start() || !messager.setup("127.0.0.1", stand_in.port())) {
+            return 2;
+        }
+    } else if (!mux_socket.empty()) {
+        if (!messager.setup_mux(mux_socket)) {
+            return 2;
+        }
+    } else if (!messager.setup(camera_ip, 37260)) {
+        return 2;
+    }
+
+    siyi::Serializer serializer;
+
+    const auto timeout = std::chrono::milliseconds(timeout_ms);
+    const auto interval = rate > 0.0
+        ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / rate))
+        : std::chrono::steady_clock::duration::zero();
+    const auto start = std::chrono::steady_clock::now();
+    const auto stop_sending = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(duration_s));
+
+    Results results[kind_count];
+    std::deque<Outstanding> outstanding;
+    std::uint64_t unexpected = 0;
+    std::uint64_t count = 0;
+    auto next_send = start;
+
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+
+        while (!outstanding.empty() && outstanding.front().due <= now) {
+            ++results[static_cast<std::size_t>(outstanding.front().kind)].lost;
+            outstanding.pop_front();
+        }
+
+        const bool sending = now < stop_sending;
+        if (!sending && outstanding.empty()) {
+            break;
+        }
+
+        // At a fixed rate, the latency counts from when the command should have
+        // been sent, so a camera which is slow to answer doesn't make it look
+        // like it answers quickly because fewer commands were sent.
+        const bool send_now = sending &&
+            (rate > 0.0 ? now >= next_send : outstanding.size() < concurrency);
+        if (send_now) {
+            const auto kind = (*sequence)[count % sequence->size()];
+            const auto message = assemble(serializer, kind, count);
+            ++count;
+            ++results[static_cast<std::size_t>(kind)].sent;
+
+            const auto late = rate > 0.0
+                ? std::chrono::duration_cast<std::chrono::microseconds>(now - next_send)
+                : std::chrono::microseconds(0);
+            next_send += interval;
+
+            // Before sending, on localhost the reply can be there before
+            // sending returns.
+            const auto sent = std::chrono::system_clock::now();
+            if (messager.send(message)) {
+                outstanding.push_back(Outstanding{kind, message[7], now + timeout, sent, late});
+            } else {
+                ++results[static_cast<std::size_t>(kind)].lost;
+            }
+            continue;
+        }
+
+        // Wait for replies until the next command is due, or the oldest one is lost.
+        auto wait_until = outstanding.empty() ? stop_sending : outstanding.front().due;
+        if (sending && rate > 0.0) {
+            wait_until = std::min(wait_until, next_send);
+        }
+        // Rounded up, as waiting for 0 ms would only check and spin.
+        const auto wait = std::max(std::chrono::milliseconds(1),
+            std::chrono::ceil<std::chrono::milliseconds>(wait_until - now));
+
+        const auto reply = messager.receive_buffer(wait);
+        if (reply.empty()) {
+            continue;
+        }
+        const auto maybe_header = siyi::Deserializer::header(reply);
+        if (!maybe_header) {
+            ++unexpected;
+            continue;
+        }
+
+        // Replies go to the oldest request with the same cmd_id, the way
+        // siyi_mux matches them, as the camera doesn't echo sequence numbers.
+        const auto found = std::find_if(outstanding.begin(), outstanding.end(),
+            [&](const Outstanding& request) { return request.cmd_id == maybe_header.value().cmd_id; });
+        if (found == outstanding.end()) {
+            ++unexpected;
+            continue;
+        }
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            messager.last_receive_time() - found->sent) + found->late;
+        results[static_cast<std::size_t>(found->kind)].latencies.push_back(
+            std::max(std::chrono::microseconds(0), latency));
+        outstanding.erase(found);
+    }
+
+    const double seconds = std::chrono::duration<double>(
+        std::min(std::chrono::steady_clock::now(), stop_sending) - start).count();
+
+    Results total;
+    for (const auto& results_of_kind : results) {
+        total.sent += results_of_kind.sent;
+        total.lost += results_of_kind.lost;
+        total.latencies.insert(total.latencies.end(),
+            results_of_kind.latencies.begin(), results_of_kind.latencies.end());
+    }
+
+    std::cout << "Sent for " << std::fixed << std::setprecision(1) << seconds << " s, ";
+    if (rate > 0.0) {
+        std::cout << "at " << rate << " per second" << std::endl;
+    } else {
+        std::cout << "with " << concurrency << " waiting" << std::endl;
+    }
+    for (std::size_t i = 0; i < kind_count; ++i) {
+        if (results[i].sent > 0) {
+            print_results(kind_names[i], results[i], seconds);
+        }
+    }
+    print_results("total", total, seconds);
+    if (unexpected > 0) {
+        std::cout << unexpected << " unexpected replies" << std::endl;
+    }
+
+    const double loss = total.sent > 0 ? 100.0 * static_cast<double>(total.lost) / static_cast<double>(total.sent) : 0.0;
+    if (loss > max_loss) {
+        std::cerr << "Lost " << loss << "% of the replies, more than " << max_loss << "%" << std::endl;
+        return 3;
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "siyi_mux.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void print_usage(const std::string& bin_name)
+{
+    std::cout << "Usage: " << bin_name << " [options]\n"
+              << "Options:\n"
+              << "  --socket <path>    Unix socket for the clients (default /run/siyi-mux.sock)\n"
+              << "  --camera <ip>      IP of the camera (default 192.168.144.25)\n"
+              << "  --help             Show this help message\n";
+}
+
+static volatile std::sig_atomic_t should_exit = 0;
+
+static void handle_signal(int)
+{
+    should_exit = 1;
+}
+
+static int open_camera_socket(const std::string& ip, unsigned port)
+{
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        std::cerr << "Error creating socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+        std::cerr << "Invalid camera IP " << ip << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    // Only the camera is allowed to talk to us.
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "Error connecting to camera: " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int open_client_socket(const std::string& path)
+{
+    const int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        std::cerr << "Error creating socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        close(fd);
+        return -1;
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // Left over from last time.
+    unlink(path.c_str());
+
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "Error binding " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, 8) != 0) {
+        std::cerr << "Error listening on " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string socket_path = "/run/siyi-mux.sock";
+    std::string camera_ip = "192.168.144.25";
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string current_arg = argv[i];
+        if (current_arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (current_arg == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (current_arg == "--camera" && i + 1 < argc) {
+            camera_ip = argv[++i];
+        } else {
+            std::cerr << "Invalid argument: " << current_arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const int camera_fd = open_camera_socket(camera_ip, 37260);
+    if (camera_fd < 0) {
+        return 2;
+    }
+
+    const int listen_fd = open_client_socket(socket_path);
+    if (listen_fd < 0) {
+        close(camera_fd);
+        return 2;
+    }
+
+    std::signal(SIGINT, handle_signal);
+    std::signal(SIGTERM, handle_signal);
+
+    std::cout << "Multiplexing camera " << camera_ip << " on " << socket_path << std::endl;
+
+    siyi::MuxRouter router;
+    std::vector<int> clients;
+    std::vector<std::uint8_t> buffer(2048);
+
+    while (!should_exit) {
+        std::vector<pollfd> fds;
+        fds.push_back({camera_fd, POLLIN, 0});
+        fds.push_back({listen_fd, POLLIN, 0});
+        for (const auto client : clients) {
+            fds.push_back({client, POLLIN, 0});
+        }
+
+        const int poll_ret = poll(fds.data(), fds.size(), 1000);
+        if (poll_ret < 0) {
+            if (errno != EINTR) {
+                std::cerr << "Error with poll: " << strerror(errno) << std::endl;
+            }
+            continue;
+        }
+
+        const auto now = siyi::MuxRouter::Clock::now();
+
+        if (fds[0].revents & POLLIN) {
+            const auto received = recv(camera_fd, buffer.data(), buffer.size(), 0);
+            if (received > 0) {
+                const siyi::ByteView message{buffer.data(), static_cast<std::size_t>(received)};
+                const auto maybe_client = router.reply(message, now);
+                if (maybe_client == siyi::MuxRouter::all_clients) {
+                    for (const auto client : clients) {
+                        (void)send(client, message.data(), message.size(), MSG_NOSIGNAL);
+                    }
+                } else if (maybe_client) {
+                    (void)send(maybe_client.value(), message.data(), message.size(), MSG_NOSIGNAL);
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            const int client = accept(listen_fd, nullptr, nullptr);
+            if (client >= 0) {
+                clients.push_back(client);
+                std::cout << "Client connected (" << clients.size() << " in total)" << std::endl;
+            }
+        }
+
+        for (std::size_t i = 2; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+
+            const int client = fds[i].fd;
+            const auto received = (fds[i].revents & POLLIN) ?
+                recv(client, buffer.data(), buffer.size(), 0) : 0;
+
+            if (received <= 0) {
+                close(client);
+                router.remove_client(client);
+                clients.erase(std::find(clients.begin(), clients.end(), client));
+                std::cout << "Client disconnected (" << clients.size() << " in total)" << std::endl;
+                continue;
+            }
+
+            const auto maybe_message = router.request(
+                client, std::vector<std::uint8_t>(buffer.begin(), buffer.begin() + received), now);
+            if (!maybe_message) {
+                std::cerr << "Dropping invalid message from client" << std::endl;
+                continue;
+            }
+            if (send(camera_fd, maybe_message.value().data(), maybe_message.value().size(), 0) < 0) {
+                std::cerr << "Error sending to camera: " << strerror(errno) << std::endl;
+            }
+        }
+    }
+
+    for (const auto client : clients) {
+        close(client);
+    }
+    close(listen_fd);
+    close(camera_fd);
+    unlink(socket_path.c_str());
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "siyi_crc.hpp"
+#include "siyi_protocol.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <vector>
+
+namespace siyi {
+
+// Routing of the multiplexer (siyi_mux), which owns the one session with the
+// camera and lets several clients share it.
+//
+// The clients send the same messages they would send to the camera over UDP.
+// Their sequence numbers are replaced by ours, so they are unique no matter
+// how many clients there are. Replies are passed back to the client which sent
+// the oldest request with the same cmd_id (and the same first payload byte if
+// there is one, e.g. the stream type), requests which never got a reply are
+// forgotten after a while. Requests which don't ask for an ack aren't waited
+// for at all. What the camera sends without being asked, the feedback after
+// taking a picture, goes to all clients.
+
+class MuxRouter {
+public:
+    using Client = int;
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::chrono::seconds request_timeout{2};
+    static constexpr Client all_clients{-1};
+
+    // Returns the message to send to the camera, or nothing if it's invalid.
+    [[nodiscard]] std::optional<std::vector<std::uint8_t>> request(
+        Client client, std::vector<std::uint8_t> message, Clock::time_point now)
+    {
+        const auto maybe_header = Deserializer::header(message);
+        if (!maybe_header) {
+            return std::nullopt;
+        }
+
+        expire(now);
+
+        message[5] = _next_seq & 0xff;
+        message[6] = (_next_seq >> 8) & 0xff;
+        ++_next_seq;
+
+        const auto crc16 = crc16_cal(message.data(), static_cast<std::uint32_t>(message.size() - 2));
+        message[message.size() - 2] = crc16 & 0xff;
+        message[message.size() - 1] = (crc16 >> 8) & 0xff;
+
+        // Nothing is coming back for requests without ack.
+        if (maybe_header.value().need_ack()) {
+            _pending.push_back(Pending{
+                client, maybe_header.value().cmd_id, maybe_header.value().first_payload_byte, now});
+        }
+
+        return message;
+    }
+
+    // Returns the client a message from the camera is for, all_clients, or
+    // nothing if nobody is waiting for it.
+    [[nodiscard]] std::optional<Client> reply(ByteView message, Clock::time_point now)
+    {
+        const auto maybe_header = Deserializer::header(message);
+        if (!maybe_header) {
+            return std::nullopt;
+        }
+
+        expire(now);
+
+        auto match = _pending.end();
+        for (auto it = _pending.begin(); it != _pending.end(); ++it) {
+            if (it->cmd_id != maybe_header.value().cmd_id) {
+                continue;
+            }
+            if (it->first_payload_byte == maybe_header.value().first_payload_byte) {
+                match = it;
+                break;
+            }
+            if (match == _pending.end()) {
+                match = it;
+            }
+        }
+
+        if (match == _pending.end()) {
+            if (maybe_header.value().cmd_id == AckFunctionFeedback::cmd_id_impl()) {
+                return all_clients;
+            }
+            return std::nullopt;
+        }
+
+        const auto client = match->client;
+        _pending.erase(match);
+        return client;
+    }
+
+    void remove_client(Client client)
+    {
+        for (auto it = _pending.begin(); it != _pending.end();) {
+            if (it->client == client) {
+                it = _pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    [[nodiscard]] std::size_t pending() const { return _pending.size(); }
+
+private:
+    struct Pending {
+        Client client;
+        std::uint8_t cmd_id;
+        std::optional<std::uint8_t> first_payload_byte;
+        Clock::time_point sent;
+    };
+
+    void expire(Clock::time_point now)
+    {
+        while (!_pending.empty() && now - _pending.front().sent > request_timeout) {
+            _pending.pop_front();
+        }
+    }
+
+    std::deque<Pending> _pending;
+    std::uint16_t _next_seq{0};
+};
+
+} // namespace siyi
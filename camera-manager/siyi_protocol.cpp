@@ -1,4 +1,5 @@
 #include "siyi_protocol.hpp"
+#include "logger.hpp"
 
 namespace siyi {
 
@@ -18,23 +19,37 @@ std::ostream& operator<<(std::ostream& str, const std::vector<std::uint8_t>& byt
 
 bool Messager::send(const std::vector<std::uint8_t>& message)
 {
+    _last_send_time = std::chrono::system_clock::now();
+
+    if (_capture != nullptr) {
+        _capture->record(CaptureDirection::Sent, message);
+    }
+
+    if (_replay) {
+        return true;
+    }
+
     // Send the UDP packet
-    const ssize_t sent = sendto(_sockfd, message.data(), message.size(), 0, (struct sockaddr *)&_addr, sizeof(_addr));
+    const ssize_t sent = _connected ?
+        ::send(_sockfd, message.data(), message.size(), MSG_NOSIGNAL) :
+        sendto(_sockfd, message.data(), message.size(), 0, (struct sockaddr *)&_addr, sizeof(_addr));
     if (sent < 0) {
-        std::cerr << "Error sending UDP packet: " << strerror(errno) << std::endl;
+        LogLine(LogLevel::Err) << "Error sending UDP packet: " << strerror(errno);
         return false;
     }
     // std::cerr << "Sent " << sent << std::endl;
     return true;
 }
 
-std::vector<std::uint8_t> Messager::receive() const
+PooledBuffer Messager::receive_buffer(std::chrono::milliseconds timeout) const
 {
-    std::vector<std::uint8_t> result;
+    if (_replay) {
+        return replay_receive(timeout);
+    }
 
     struct timeval tv{};
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
+    tv.tv_sec = timeout.count() / 1000;
+    tv.tv_usec = (timeout.count() % 1000) * 1000;
 
     fd_set read_fds;
     FD_ZERO(&read_fds);
@@ -42,25 +57,114 @@ std::vector<std::uint8_t> Messager::receive() const
 
     const int select_ret = select(_sockfd+1, &read_fds, nullptr, nullptr, &tv);
     if (select_ret > 0) {
-        result.resize(2048);
-        const ssize_t recv_ret = recv(_sockfd, result.data(), result.size(), 0);
-        if (recv_ret == -1) {
-            std::cerr << "Error receiving packet: " << strerror(errno) << std::endl;
-            result.resize(0);
+        auto result = _receive_pool.take();
+        if (!result.valid()) {
+            static LogRateLimit exhausted_log_limit;
+            LogLine(LogLevel::Err, exhausted_log_limit) << "All receive buffers in use";
             return result;
         }
 
+        struct iovec iov{};
+        iov.iov_base = result.data();
+        iov.iov_len = result.capacity();
+
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(struct timespec))];
+        struct msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        const ssize_t recv_ret = recvmsg(_sockfd, &msg, 0);
+        if (recv_ret == -1) {
+            LogLine(LogLevel::Err) << "Error receiving packet: " << strerror(errno);
+            return PooledBuffer{};
+        }
+
         result.resize(recv_ret);
 
+        _last_receive_time = std::chrono::system_clock::now();
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts{};
+                std::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                _last_receive_time = std::chrono::system_clock::time_point(
+                    std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                        std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+            }
+        }
+
+        if (_capture != nullptr) {
+            _capture->record(CaptureDirection::Received, result);
+        }
+
         // std::cout << "Received: " << result << std::endl;
+        return result;
 
     } else if (select_ret == 0) {
-        std::cout << "Timed out." << std::endl;
+        LogLine(LogLevel::Debug) << "Timed out.";
 
     } else {
-        std::cerr << "Error with select: " << strerror(errno) << std::endl;
+        LogLine(LogLevel::Err) << "Error with select: " << strerror(errno);
+    }
+
+    return PooledBuffer{};
+}
+
+std::vector<std::uint8_t> Messager::receive(std::chrono::milliseconds timeout) const
+{
+    return receive_buffer(timeout).to_vector();
+}
+
+std::size_t Messager::discard_pending() const
+{
+    if (_replay || _sockfd == -1) {
+        return 0;
+    }
+
+    std::uint8_t scratch[receive_buffer_size];
+    std::size_t discarded = 0;
+    while (recv(_sockfd, scratch, sizeof(scratch), MSG_DONTWAIT) >= 0) {
+        ++discarded;
+    }
+    return discarded;
+}
+
+PooledBuffer Messager::replay_receive(std::chrono::milliseconds timeout) const
+{
+    // Only what the camera sent is played back.
+    while (!_replay_next || _replay_next.value().direction != CaptureDirection::Received) {
+        _replay_next = _replay.value().next();
+        if (!_replay_next) {
+            return PooledBuffer{};
+        }
+        if (_replay_start == std::chrono::steady_clock::time_point{}) {
+            _replay_start = std::chrono::steady_clock::now();
+            _replay_first_ns = _replay_next.value().timestamp_ns;
+        }
+    }
+
+    if (_replay_realtime) {
+        const auto due = _replay_start + std::chrono::nanoseconds(_replay_next.value().timestamp_ns - _replay_first_ns);
+        if (due > std::chrono::steady_clock::now() + timeout) {
+            std::this_thread::sleep_for(timeout);
+            LogLine(LogLevel::Debug) << "Timed out.";
+            return PooledBuffer{};
+        }
+        std::this_thread::sleep_until(due);
+    }
+
+    auto result = _receive_pool.take();
+    const auto& bytes = _replay_next.value().bytes;
+    if (!result.valid() || bytes.size() > result.capacity()) {
+        _replay_next.reset();
+        return PooledBuffer{};
     }
+    std::memcpy(result.data(), bytes.data(), bytes.size());
+    result.resize(bytes.size());
 
+    _last_receive_time = std::chrono::system_clock::now();
+    _replay_next.reset();
     return result;
 }
 
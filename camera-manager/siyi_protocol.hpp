@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
@@ -11,23 +13,43 @@
 
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <cerrno>
 
 
+#include "siyi_buffer_pool.hpp"
+#include "siyi_capture.hpp"
+#include "siyi_codec.hpp"
 #include "siyi_crc.hpp"
+#include "logger.hpp"
 
 namespace siyi {
 
 std::ostream& operator<<(std::ostream& str, const std::vector<std::uint8_t>& bytes);
 
+// Bits of the ctrl byte.
+static constexpr std::uint8_t ctrl_need_ack = 0x01;
+static constexpr std::uint8_t ctrl_ack_pack = 0x02;
+
 template<typename PayloadType>
 class Payload {
 public:
+    // Whether the camera is asked to answer. Payloads sent at a high rate,
+    // where the next one supersedes the last anyway, override this with false.
+    static constexpr bool needs_ack = true;
+
     [[nodiscard]] std::vector<std::uint8_t> bytes() const {
-        return derived().bytes_impl();
+        std::vector<std::uint8_t> result(PayloadType::layout::size);
+        encode(result.data());
+        return result;
+    }
+
+    // Writes the layout's size in bytes.
+    void encode(std::uint8_t* out) const {
+        PayloadType::layout::encode(derived(), out);
     }
 
     [[nodiscard]] std::uint8_t cmd_id() const {
@@ -43,32 +65,30 @@ private:
     [[nodiscard]] PayloadType const& derived() const { return static_cast<PayloadType const&>(*this); }
 };
 
+// The layouts are declared after the fields, which are private in some
+// payloads, so they get their own public section at the end.
+
 class FirmwareVersion : public Payload<FirmwareVersion> {
 public:
-    static std::vector<std::uint8_t> bytes_impl() {
-        std::vector<std::uint8_t> result;
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x01;
     }
+
+    using layout = Layout<0>;
 };
 
 class GimbalCenter : public Payload<GimbalCenter> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(_center_pos);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x08;
     }
 
 private:
     const std::uint8_t _center_pos{1};
+
+public:
+    using layout = Layout<1,
+        Field<&GimbalCenter::_center_pos, 0>>;
 };
 
 class GimbalRotate : public Payload<GimbalRotate> {
@@ -78,81 +98,68 @@ public:
     , _turn_pitch(turn_pitch)
     {}
 
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(_turn_yaw);
-        result.push_back(_turn_pitch);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x07;
     }
 
+    static constexpr bool needs_ack = false;
+
 private:
     const int8_t _turn_yaw;
     const int8_t _turn_pitch;
+
+public:
+    using layout = Layout<2,
+        Field<&GimbalRotate::_turn_yaw, 0>,
+        Field<&GimbalRotate::_turn_pitch, 1>>;
 };
 
 class SetGimbalAttitude : public Payload<SetGimbalAttitude> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(yaw_t10 & 0xff);
-        result.push_back((yaw_t10 >> 8) & 0xff);
-        result.push_back(pitch_t10 & 0xff);
-        result.push_back((pitch_t10 >> 8) & 0xff);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x0E;
     }
 
+    static constexpr bool needs_ack = false;
+
     std::int16_t yaw_t10;
     std::int16_t pitch_t10;
+
+    using layout = Layout<4,
+        Field<&SetGimbalAttitude::yaw_t10, 0>,
+        Field<&SetGimbalAttitude::pitch_t10, 2>>;
 };
 
 class TakePicture : public Payload<TakePicture> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(_func_type);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x0C;
     }
 
 private:
     const std::uint8_t _func_type{0};
+
+public:
+    using layout = Layout<1,
+        Field<&TakePicture::_func_type, 0>>;
 };
 
 class ToggleRecording : public Payload<ToggleRecording> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(_func_type);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x0C;
     }
 
 private:
     const std::uint8_t _func_type{2};
+
+public:
+    using layout = Layout<1,
+        Field<&ToggleRecording::_func_type, 0>>;
 };
 
 class SetGimbalMode : public Payload<SetGimbalMode> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(static_cast<std::uint8_t>(mode));
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x0C;
     }
@@ -162,39 +169,25 @@ public:
         Follow = 4,
         Fpv = 5,
     } mode{Mode::Follow};
+
+    using layout = Layout<1,
+        Field<&SetGimbalMode::mode, 0>>;
 };
 
 class GetStreamSettings : public Payload<GetStreamSettings> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(stream_type);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x20;
     }
 
     std::uint8_t stream_type{0};
+
+    using layout = Layout<1,
+        Field<&GetStreamSettings::stream_type, 0>>;
 };
 
 class StreamSettings : public Payload<StreamSettings> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(stream_type);
-        result.push_back(video_enc_type);
-        result.push_back(resolution_l & 0xff);
-        result.push_back((resolution_l >> 8) & 0xff);
-        result.push_back(resolution_h & 0xff);
-        result.push_back((resolution_h >> 8) & 0xff);
-        result.push_back(video_bitrate_kbps & 0xff);
-        result.push_back((video_bitrate_kbps >> 8) & 0xff);
-        result.push_back(_reserved);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x21;
     }
@@ -207,40 +200,52 @@ public:
     // Value from 1570 to 4000 seem to be accepted for 720
     std::uint16_t video_bitrate_kbps{4000};
 
-private:
-    const std::uint8_t _reserved{0};
+    // The last byte is reserved.
+    using layout = Layout<9,
+        Field<&StreamSettings::stream_type, 0>,
+        Field<&StreamSettings::video_enc_type, 1>,
+        Field<&StreamSettings::resolution_l, 2>,
+        Field<&StreamSettings::resolution_h, 4>,
+        Field<&StreamSettings::video_bitrate_kbps, 6>>;
 };
 
 class ManualZoom : public Payload<ManualZoom> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(zoom);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x05;
     }
 
+    static constexpr bool needs_ack = false;
+
     std::int8_t zoom{};
+
+    using layout = Layout<1,
+        Field<&ManualZoom::zoom, 0>>;
 };
 
 class AbsoluteZoom : public Payload<AbsoluteZoom> {
 public:
-    [[nodiscard]] std::vector<std::uint8_t> bytes_impl() const {
-        std::vector<std::uint8_t> result;
-        result.push_back(absolute_movement_integer);
-        result.push_back(absolute_movement_fractional);
-        return result;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x0F;
     }
 
+    static constexpr bool needs_ack = false;
+
     std::uint8_t absolute_movement_integer{};
     std::uint8_t absolute_movement_fractional{};
+
+    using layout = Layout<2,
+        Field<&AbsoluteZoom::absolute_movement_integer, 0>,
+        Field<&AbsoluteZoom::absolute_movement_fractional, 1>>;
+};
+
+class GetZoom : public Payload<GetZoom> {
+public:
+    static std::uint8_t cmd_id_impl() {
+        return 0x18;
+    }
+
+    using layout = Layout<0>;
 };
 
 class Messager
@@ -257,7 +262,7 @@ public:
     {
         _sockfd = socket(AF_INET, SOCK_DGRAM, 0);
         if (_sockfd < 0) {
-            std::cerr << "Error creating socket: " << strerror(errno) << std::endl;
+            LogLine(LogLevel::Err) << "Error creating socket: " << strerror(errno);
             return false;
         }
 
@@ -266,29 +271,128 @@ public:
 
         unsigned char buf[4];
         if (inet_pton(AF_INET, ip.c_str(), buf) != 1) {
-            std::cerr << "Error converting IP address string to binary buffer: " << strerror(errno) << std::endl;
+            LogLine(LogLevel::Err) << "Error converting IP address string to binary buffer: " << strerror(errno);
             return false;
         }
 
         _addr.sin_addr.s_addr = *reinterpret_cast<uint32_t *>(buf);
 
+        // Let the kernel timestamp what we receive, so round trip times don't
+        // include how long it took us to get to it.
+        const int enable = 1;
+        if (setsockopt(_sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) != 0) {
+            LogLine(LogLevel::Warn) << "Could not enable receive timestamps: " << strerror(errno);
+        }
+
+        return true;
+    }
+
+    // Share the camera with other tools through siyi_mux, instead of talking to
+    // it directly.
+    bool setup_mux(const std::string& path)
+    {
+        _sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (_sockfd < 0) {
+            LogLine(LogLevel::Err) << "Error creating socket: " << strerror(errno);
+            return false;
+        }
+
+        struct sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            LogLine(LogLevel::Err) << "Socket path too long: " << path;
+            close(_sockfd);
+            _sockfd = -1;
+            return false;
+        }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        if (connect(_sockfd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+            LogLine(LogLevel::Err) << "Error connecting to " << path << ": " << strerror(errno);
+            close(_sockfd);
+            _sockfd = -1;
+            return false;
+        }
+        _connected = true;
         return true;
     }
 
+    // Play back what was received in a capture instead, either with the timing
+    // it was recorded with, or as fast as possible. What is sent is dropped.
+    bool setup_replay(const std::string& path, bool realtime)
+    {
+        _replay.emplace();
+        _replay_realtime = realtime;
+        return _replay.value().open(path);
+    }
+
+    // Record everything sent and received, the capture needs to outlive us.
+    void set_capture(CaptureWriter* capture)
+    {
+        _capture = capture;
+    }
+
+    static constexpr unsigned receive_buffers = 8;
+    static constexpr std::size_t receive_buffer_size = 2048;
+
+    // Sending is fine from any thread. Receiving is for one thread at a time,
+    // and so is replaying.
     bool send(const std::vector<std::uint8_t>& message);
 
-    [[nodiscard]] std::vector<std::uint8_t> receive() const;
+    // Receives into one of the preallocated buffers, which goes back when the
+    // handle is gone. Empty if nothing was received (or all buffers are still
+    // in use). Apart from replaying, this doesn't allocate.
+    [[nodiscard]] PooledBuffer receive_buffer(
+        std::chrono::milliseconds timeout = std::chrono::seconds(1)) const;
+
+    // The same, copied into a vector.
+    [[nodiscard]] std::vector<std::uint8_t> receive(
+        std::chrono::milliseconds timeout = std::chrono::seconds(1)) const;
+
+    // Throws away what was received but not read yet, without waiting and
+    // without recording it, so a late answer isn't taken for the next one.
+    // A replay has nothing late, so it is left alone. Returns how many
+    // messages were thrown away.
+    std::size_t discard_pending() const;
+
+    // When the last message was sent, and when the last one was received
+    // (according to the kernel if available).
+    [[nodiscard]] std::chrono::system_clock::time_point last_send_time() const { return _last_send_time; }
+    [[nodiscard]] std::chrono::system_clock::time_point last_receive_time() const { return _last_receive_time; }
 
 private:
     int _sockfd{-1};
     struct sockaddr_in _addr{};
+    bool _connected{false};
+
+    CaptureWriter* _capture{nullptr};
+
+    [[nodiscard]] PooledBuffer replay_receive(std::chrono::milliseconds timeout) const;
+
+    mutable BufferPool _receive_pool{receive_buffers, receive_buffer_size};
+
+    mutable std::optional<CaptureReader> _replay;
+    bool _replay_realtime{false};
+    mutable std::optional<CaptureRecord> _replay_next;
+    mutable std::chrono::steady_clock::time_point _replay_start{};
+    mutable std::uint64_t _replay_first_ns{0};
+    std::atomic<std::chrono::system_clock::time_point> _last_send_time{};
+    mutable std::atomic<std::chrono::system_clock::time_point> _last_receive_time{};
 };
 
 template<typename AckPayloadType>
 class AckPayload {
 public:
-    [[nodiscard]] bool fill(const std::vector<std::uint8_t>& bytes) {
-        return derived().fill_impl(bytes);
+    [[nodiscard]] bool fill(ByteView bytes) {
+        constexpr auto len = AckPayloadType::layout::size;
+        if (bytes.size() != len) {
+            static LogRateLimit length_log_limit;
+            LogLine(LogLevel::Warn, length_log_limit) << "Length wrong: " << bytes.size() << " instead of " << len;
+            return false;
+        }
+
+        AckPayloadType::layout::decode(derived(), bytes.data());
+        return true;
     }
 
     [[nodiscard]] std::uint8_t cmd_id() {
@@ -307,24 +411,6 @@ private:
 class AckFirmwareVersion : public AckPayload<AckFirmwareVersion> {
     // Note: zoom functionality is listed in the manual but not populated on the A8 mini
     public:
-        bool fill_impl(const std::vector<std::uint8_t>& bytes) {
-
-            if (bytes.size() != len) {
-                std::cerr << "Length wrong: " << bytes.size() << " instead of " << len << std::endl;
-                return false;
-            }
-
-            code_board_ver_major = bytes[2];
-            code_board_ver_minor = bytes[1];
-            code_board_ver_patch = bytes[0];
-            gimbal_firmware_ver_major = bytes[6];
-            gimbal_firmware_ver_minor = bytes[5];
-            gimbal_firmware_ver_patch = bytes[4];
-
-            static_assert(8 == len, "length is wrong");
-            return true;
-        }
-
         static std::uint8_t cmd_id_impl() {
             return 0x01;
         }
@@ -347,32 +433,19 @@ class AckFirmwareVersion : public AckPayload<AckFirmwareVersion> {
         std::uint8_t gimbal_firmware_ver_major{0};
         std::uint8_t gimbal_firmware_ver_minor{0};
         std::uint8_t gimbal_firmware_ver_patch{0};
-    private:
 
-        static constexpr std::size_t len =
-                sizeof(uint32_t) + sizeof(uint32_t);
+        // Two uint32, each with patch, minor and major, and a reserved byte.
+        using layout = Layout<8,
+            Field<&AckFirmwareVersion::code_board_ver_patch, 0>,
+            Field<&AckFirmwareVersion::code_board_ver_minor, 1>,
+            Field<&AckFirmwareVersion::code_board_ver_major, 2>,
+            Field<&AckFirmwareVersion::gimbal_firmware_ver_patch, 4>,
+            Field<&AckFirmwareVersion::gimbal_firmware_ver_minor, 5>,
+            Field<&AckFirmwareVersion::gimbal_firmware_ver_major, 6>>;
     };
 
 class AckGetStreamResolution : public AckPayload<AckGetStreamResolution> {
 public:
-    bool fill_impl(const std::vector<std::uint8_t>& bytes) {
-
-        if (bytes.size() != len) {
-            std::cerr << "Length wrong: " << bytes.size() << " instead of " << len << std::endl;
-            return false;
-        }
-
-        _stream_type = bytes[0];
-        video_enc_type = bytes[1];
-        resolution_l = bytes[2] | (bytes[3] << 8);
-        resolution_h = bytes[4] | (bytes[5] << 8);
-        video_bitrate_kbps = bytes[6] | (bytes[7] << 8);
-        _reserved = bytes[8];
-
-        static_assert(9 == len, "length is wrong");
-        return true;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x20;
     }
@@ -384,6 +457,8 @@ public:
         return str;
     }
 
+    [[nodiscard]] std::uint8_t stream_type() const { return _stream_type; }
+
     std::uint8_t video_enc_type{0};
     std::uint16_t resolution_l{0};
     std::uint16_t resolution_h{0};
@@ -391,33 +466,19 @@ public:
 
 private:
     std::uint8_t _stream_type{0};
-    std::uint8_t _reserved{0};
-
-    static constexpr std::size_t len =
-        sizeof(_stream_type) +
-        sizeof(video_enc_type) +
-        sizeof(resolution_l) +
-        sizeof(resolution_h) +
-        sizeof(video_bitrate_kbps) +
-        sizeof(_reserved);
+
+public:
+    // The last byte is reserved.
+    using layout = Layout<9,
+        Field<&AckGetStreamResolution::_stream_type, 0>,
+        Field<&AckGetStreamResolution::video_enc_type, 1>,
+        Field<&AckGetStreamResolution::resolution_l, 2>,
+        Field<&AckGetStreamResolution::resolution_h, 4>,
+        Field<&AckGetStreamResolution::video_bitrate_kbps, 6>>;
 };
 
 class AckSetStreamSettings : public AckPayload<AckSetStreamSettings> {
 public:
-    bool fill_impl(const std::vector<std::uint8_t>& bytes) {
-
-        if (bytes.size() != len) {
-            std::cerr << "Length wrong: " << bytes.size() << " instead of " << len << std::endl;
-            return false;
-        }
-
-        _stream_type = bytes[0];
-        result = bytes[1];
-
-        static_assert(2 == len, "length is wrong");
-        return true;
-    }
-
     static std::uint8_t cmd_id_impl() {
         return 0x21;
     }
@@ -432,39 +493,95 @@ public:
 private:
     std::uint8_t _stream_type{0};
 
-    static constexpr std::size_t len =
-            sizeof(_stream_type) +
-            sizeof(result);
+public:
+    using layout = Layout<2,
+        Field<&AckSetStreamSettings::_stream_type, 0>,
+        Field<&AckSetStreamSettings::result, 1>>;
 };
 
 class AckManualZoom : public AckPayload<AckManualZoom> {
 public:
-    bool fill_impl(const std::vector<std::uint8_t>& bytes) {
+    static std::uint8_t cmd_id_impl() {
+        return 0x05;
+    }
 
-        if (bytes.size() != len) {
-            std::cerr << "Length wrong: " << bytes.size() << " instead of " << len << '\n';
-            return false;
-        }
+    friend std::ostream& operator<<(std::ostream& str, const AckManualZoom& self) {
+        str << "Zoom: " << int(self.zoom_multiple) << "x\n";
+        return str;
+    }
 
-        zoom_multiple = bytes[0] | (bytes[1] << 8);
+    // In tenths.
+    std::uint16_t zoom_multiple{0};
 
-        static_assert(2 == len, "length is wrong");
-        return true;
+    using layout = Layout<2,
+        Field<&AckManualZoom::zoom_multiple, 0>>;
+};
+
+class AckAbsoluteZoom : public AckPayload<AckAbsoluteZoom> {
+public:
+    static std::uint8_t cmd_id_impl() {
+        return 0x0F;
+    }
+
+    friend std::ostream& operator<<(std::ostream& str, const AckAbsoluteZoom& self) {
+        str << "Result: " << int(self.result) << '\n';
+        return str;
+    }
+
+    std::uint8_t result{0};
+
+    using layout = Layout<1,
+        Field<&AckAbsoluteZoom::result, 0>>;
+};
+
+// Sent by the camera on its own, e.g. once a picture was taken.
+class AckFunctionFeedback : public AckPayload<AckFunctionFeedback> {
+public:
+    static std::uint8_t cmd_id_impl() {
+        return 0x0B;
+    }
+
+    enum class Info : std::uint8_t {
+        PictureTaken = 0,
+        PictureFailed = 1,
+        HdrOn = 2,
+        HdrOff = 3,
+        RecordingFailed = 4,
+    };
+
+    friend std::ostream& operator<<(std::ostream& str, const AckFunctionFeedback& self) {
+        str << "Function feedback: " << int(self.info_type) << '\n';
+        return str;
     }
 
+    Info info_type{Info::PictureTaken};
+
+    using layout = Layout<1,
+        Field<&AckFunctionFeedback::info_type, 0>>;
+};
+
+class AckGetZoom : public AckPayload<AckGetZoom> {
+public:
     static std::uint8_t cmd_id_impl() {
-        return 0x05;
+        return 0x18;
     }
 
-    friend std::ostream& operator<<(std::ostream& str, const AckManualZoom& self) {
-        str << "Zoom: " << int(self.zoom_multiple) << "x\n";
+    friend std::ostream& operator<<(std::ostream& str, const AckGetZoom& self) {
+        str << "Zoom: " << self.factor() << "x\n";
         return str;
     }
 
-    std::uint16_t zoom_multiple{0};
+    [[nodiscard]] float factor() const {
+        return static_cast<float>(zoom_integer) + static_cast<float>(zoom_fractional) / 10.f;
+    }
 
-private:
-    static constexpr std::size_t len = sizeof(zoom_multiple);
+    std::uint8_t zoom_integer{1};
+    // In tenths.
+    std::uint8_t zoom_fractional{0};
+
+    using layout = Layout<2,
+        Field<&AckGetZoom::zoom_integer, 0>,
+        Field<&AckGetZoom::zoom_fractional, 1>>;
 };
 
 class Serializer {
@@ -472,25 +589,33 @@ public:
     template<typename PayloadType>
     std::vector<std::uint8_t> assemble_message(const Payload<PayloadType>& payload)
     {
-        const auto bytes = payload.bytes();
-        std::vector<std::uint8_t> message;
-
-        message.push_back(magic1);
-        message.push_back(magic2);
-        message.push_back(1); // need ack.
-
-        message.push_back(bytes.size() & 0xff);
-        message.push_back((bytes.size() >> 8) & 0xff);
-        message.push_back(_next_seq & 0xff);
-        message.push_back((_next_seq >> 8) & 0xff);
-        ++_next_seq;
-        message.push_back(payload.cmd_id());
-
-        message.insert(std::end(message), std::begin(bytes), std::end(bytes));
+        return assemble_message(payload, PayloadType::needs_ack);
+    }
 
-        const auto crc16 = crc16_cal(message.data(), message.size());
-        message.push_back(crc16 & 0xff);
-        message.push_back((crc16 >> 8) & 0xff);
+    // To ask for an ack, or not, other than the payload usually does.
+    template<typename PayloadType>
+    std::vector<std::uint8_t> assemble_message(const Payload<PayloadType>& payload, bool need_ack)
+    {
+        // One allocation for the whole message, the payload is encoded in place.
+        constexpr std::size_t data_len = PayloadType::layout::size;
+        std::vector<std::uint8_t> message(header_len + data_len + crc_len);
+
+        message[0] = magic1;
+        message[1] = magic2;
+        message[2] = need_ack ? ctrl_need_ack : 0;
+        message[3] = data_len & 0xff;
+        message[4] = (data_len >> 8) & 0xff;
+        // Messages can be assembled from several threads, each gets its own.
+        const std::uint16_t seq = _next_seq.fetch_add(1, std::memory_order_relaxed);
+        message[5] = seq & 0xff;
+        message[6] = (seq >> 8) & 0xff;
+        message[7] = payload.cmd_id();
+
+        payload.encode(message.data() + header_len);
+
+        const auto crc16 = crc16_cal(message.data(), header_len + data_len);
+        message[header_len + data_len] = crc16 & 0xff;
+        message[header_len + data_len + 1] = (crc16 >> 8) & 0xff;
 
         return message;
     }
@@ -498,40 +623,85 @@ public:
 private:
     static constexpr std::uint8_t magic1 = 0x55;
     static constexpr std::uint8_t magic2 = 0x66;
-    std::uint16_t _next_seq{0};
+    static constexpr std::size_t header_len = 8;
+    static constexpr std::size_t crc_len = 2;
+    std::atomic<std::uint16_t> _next_seq{0};
 };
 
 class Deserializer {
 public:
+    struct Header {
+        std::uint8_t ctrl{0};
+        std::uint16_t data_len{0};
+        std::uint16_t seq{0};
+        std::uint8_t cmd_id{0};
+        // Some acks share the cmd_id and are told apart by the first byte of
+        // the payload, e.g. the stream type.
+        std::optional<std::uint8_t> first_payload_byte;
+
+        [[nodiscard]] bool need_ack() const { return (ctrl & ctrl_need_ack) != 0; }
+        [[nodiscard]] bool is_ack() const { return (ctrl & ctrl_ack_pack) != 0; }
+    };
+
+    // Check the framing and get the header, to know which ack it is before
+    // disassembling it.
+    [[nodiscard]] static std::optional<Header> header(ByteView message)
+    {
+        if (message.size() < header_len + crc_len || message[0] != magic1 || message[1] != magic2) {
+            return {};
+        }
+
+        Header result{};
+        result.ctrl = message[2];
+        result.data_len = message[3] | (message[4] << 8);
+        result.seq = message[5] | (message[6] << 8);
+        result.cmd_id = message[7];
+
+        if (message.size() != static_cast<std::size_t>(result.data_len + header_len + crc_len)) {
+            return {};
+        }
+
+        const auto crc16 = crc16_cal(message.data(), message.size() - crc_len);
+        if ((crc16 & 0xff) != message[message.size()-2] || ((crc16 & 0xff00) >> 8) != message[message.size()-1]) {
+            return {};
+        }
+
+        if (result.data_len > 0) {
+            result.first_payload_byte = message[header_len];
+        }
+        return result;
+    }
+
     template<typename AckPayloadType>
-    std::optional<AckPayloadType> disassemble_message(const std::vector<std::uint8_t>& message)
+    std::optional<AckPayloadType> disassemble_message(ByteView message)
     {
         auto ack_payload = AckPayloadType{};
+        static LogRateLimit invalid_log_limit;
 
         if (message.size() < header_len + crc_len) {
-            std::cerr << "message too short" << std::endl;
+            LogLine(LogLevel::Warn, invalid_log_limit) << "message too short";
             return {};
         }
 
         if (message[0] != magic1) {
-            std::cerr << "magic1 wrong" << std::endl;
+            LogLine(LogLevel::Warn, invalid_log_limit) << "magic1 wrong";
             return {};
         }
 
         if (message[1] != magic2) {
-            std::cerr << "magic2 wrong" << std::endl;
+            LogLine(LogLevel::Warn, invalid_log_limit) << "magic2 wrong";
             return {};
         }
 
-        if ((message[2] & 0x2) == 0) {
-            std::cerr << "is not an ack package: " << std::endl;
+        if ((message[2] & ctrl_ack_pack) == 0) {
+            LogLine(LogLevel::Warn, invalid_log_limit) << "not an ack package";
             return {};
         }
 
-        const std::uint8_t data_len = message[3] | (message[4] << 8);
+        const std::uint16_t data_len = message[3] | (message[4] << 8);
 
         if (message.size() != static_cast<std::size_t>(data_len + header_len + crc_len)) {
-            std::cerr << "wrong data len";
+            LogLine(LogLevel::Warn, invalid_log_limit) << "wrong data len";
             return {};
         }
 
@@ -540,18 +710,19 @@ public:
         const std::uint8_t cmd_id = message[7];
 
         if (ack_payload.cmd_id() != cmd_id) {
-            std::cerr << "wrong cmd id: " << std::to_string(cmd_id) << " instead of " << std::to_string(ack_payload.cmd_id()) << std::endl;
+            LogLine(LogLevel::Warn, invalid_log_limit) << "wrong cmd id: " << std::to_string(cmd_id) << " instead of " << std::to_string(ack_payload.cmd_id());
             return {};
         }
 
         const auto crc16 = crc16_cal(message.data(), message.size() - crc_len);
         if ((crc16 & 0xff) != message[message.size()-2] || ((crc16 & 0xff00) >> 8) != message[message.size()-1]) {
-            std::cerr << "crc failed";
+            LogLine(LogLevel::Warn, invalid_log_limit) << "crc failed";
             return {};
         }
 
 
-        std::vector<std::uint8_t> payload_bytes{message.begin() + header_len, message.end() - crc_len};
+        // Decoded in place, without copying.
+        const ByteView payload_bytes{message.data() + header_len, message.size() - header_len - crc_len};
 
         if (!ack_payload.fill(payload_bytes)) {
             return {};
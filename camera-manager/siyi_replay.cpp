@@ -0,0 +1,138 @@
+#include "siyi_protocol.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+static void print_usage(const std::string& bin_name)
+{
+    std::cout << "Usage: " << bin_name << " <capture> [options]\n"
+              << "Options:\n"
+              << "  --realtime    Play back with the recorded timing, printing every message\n"
+              << "  --help        Show this help message\n"
+              << "\n"
+              << "Without --realtime, all received messages are decoded as fast as possible\n"
+              << "and the time it takes is shown.\n";
+}
+
+// Decode one message from the camera, returns whether it could be.
+static bool decode(siyi::Deserializer& deserializer, const std::vector<std::uint8_t>& message)
+{
+    const auto maybe_header = siyi::Deserializer::header(message);
+    if (!maybe_header) {
+        return false;
+    }
+
+    const auto cmd_id = maybe_header.value().cmd_id;
+    if (cmd_id == siyi::AckFirmwareVersion::cmd_id_impl()) {
+        return deserializer.disassemble_message<siyi::AckFirmwareVersion>(message).has_value();
+    } else if (cmd_id == siyi::AckGetStreamResolution::cmd_id_impl()) {
+        return deserializer.disassemble_message<siyi::AckGetStreamResolution>(message).has_value();
+    } else if (cmd_id == siyi::AckSetStreamSettings::cmd_id_impl()) {
+        return deserializer.disassemble_message<siyi::AckSetStreamSettings>(message).has_value();
+    } else if (cmd_id == siyi::AckManualZoom::cmd_id_impl()) {
+        return deserializer.disassemble_message<siyi::AckManualZoom>(message).has_value();
+    } else if (cmd_id == siyi::AckAbsoluteZoom::cmd_id_impl()) {
+        return deserializer.disassemble_message<siyi::AckAbsoluteZoom>(message).has_value();
+    } else if (cmd_id == siyi::AckGetZoom::cmd_id_impl()) {
+        return deserializer.disassemble_message<siyi::AckGetZoom>(message).has_value();
+    } else if (cmd_id == siyi::AckFunctionFeedback::cmd_id_impl()) {
+        return deserializer.disassemble_message<siyi::AckFunctionFeedback>(message).has_value();
+    }
+    // Framing and CRC are fine, we just don't know it.
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string path;
+    bool realtime = false;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string current_arg = argv[i];
+        if (current_arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (current_arg == "--realtime") {
+            realtime = true;
+        } else if (path.empty()) {
+            path = current_arg;
+        } else {
+            std::cerr << "Invalid argument: " << current_arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    siyi::CaptureReader reader;
+    if (!reader.open(path)) {
+        return 2;
+    }
+
+    siyi::Deserializer deserializer;
+
+    if (realtime) {
+        using siyi::operator<<;
+
+        const auto start = std::chrono::steady_clock::now();
+        std::uint64_t first_ns = 0;
+        bool first = true;
+
+        while (const auto record = reader.next()) {
+            if (first) {
+                first_ns = record.value().timestamp_ns;
+                first = false;
+            }
+            const auto offset = std::chrono::nanoseconds(record.value().timestamp_ns - first_ns);
+            std::this_thread::sleep_until(start + offset);
+
+            const auto maybe_header = siyi::Deserializer::header(record.value().bytes);
+            std::cout << std::fixed << std::setprecision(3)
+                      << std::chrono::duration<double, std::milli>(offset).count() << " ms "
+                      << (record.value().direction == siyi::CaptureDirection::Sent ? "sent    " : "received")
+                      << " cmd 0x" << std::hex << std::setw(2) << std::setfill('0')
+                      << (maybe_header ? static_cast<int>(maybe_header.value().cmd_id) : 0)
+                      << std::dec << std::setfill(' ') << ": " << record.value().bytes
+                      << (maybe_header ? "" : "(invalid)") << std::endl;
+        }
+        return 0;
+    }
+
+    // Load everything first, so only decoding is timed.
+    std::vector<std::vector<std::uint8_t>> messages;
+    std::size_t bytes = 0;
+    while (auto record = reader.next()) {
+        if (record.value().direction == siyi::CaptureDirection::Received) {
+            bytes += record.value().bytes.size();
+            messages.push_back(std::move(record.value().bytes));
+        }
+    }
+
+    unsigned invalid = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& message : messages) {
+        if (!decode(deserializer, message)) {
+            ++invalid;
+        }
+    }
+    const auto duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << messages.size() << " messages received (" << bytes << " bytes), "
+              << invalid << " invalid" << std::endl;
+    if (!messages.empty() && duration > 0.0) {
+        std::cout << "Decoded in " << duration * 1e3 << " ms, "
+                  << duration * 1e9 / static_cast<double>(messages.size()) << " ns per message" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "siyi_crc.hpp"
+#include "siyi_protocol.hpp"
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace siyi {
+
+// Stands in for the camera on localhost, for tests and tools which can't have
+// the real one.
+//
+// It answers the firmware version, gets and sets the stream settings, reports
+// and sets the zoom, and acks gimbal rotation and zoom commands as the protocol
+// describes it (the A8 mini doesn't seem to for zoom) if asked to. Pictures
+// are "taken" after the shutter delay, and then reported with function
+// feedback. Other commands are counted but not answered.
+
+class StandIn {
+public:
+    StandIn()
+    {
+        _settings[0] = Settings{2, 1920, 1080, 4000};
+        _settings[1] = Settings{2, 1280, 720, 2000};
+    }
+
+    ~StandIn()
+    {
+        stop();
+    }
+
+    StandIn(const StandIn&) = delete;
+    StandIn& operator=(const StandIn&) = delete;
+
+    // Binds to a free port on 127.0.0.1.
+    [[nodiscard]] bool start()
+    {
+        _sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (_sockfd < 0) {
+            std::cerr << "Error creating socket: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t addr_len = sizeof(addr);
+        if (bind(_sockfd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            getsockname(_sockfd, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0) {
+            std::cerr << "Error binding stand-in: " << strerror(errno) << std::endl;
+            close(_sockfd);
+            _sockfd = -1;
+            return false;
+        }
+        _port = ntohs(addr.sin_port);
+
+        _stop = false;
+        _thread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    void stop()
+    {
+        _stop = true;
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        if (_sockfd >= 0) {
+            close(_sockfd);
+            _sockfd = -1;
+        }
+    }
+
+    [[nodiscard]] unsigned port() const { return _port; }
+
+    // Valid messages received so far.
+    [[nodiscard]] std::uint64_t received() const { return _received; }
+
+    [[nodiscard]] std::uint64_t received(std::uint8_t cmd_id) const { return _received_per_cmd[cmd_id]; }
+
+    // In tenths.
+    [[nodiscard]] unsigned zoom() const { return _zoom; }
+
+    // Until the feedback of a picture is sent, nothing else is answered.
+    void set_shutter_delay(std::chrono::milliseconds delay) { _shutter_delay = delay; }
+
+    [[nodiscard]] std::uint16_t bitrate(std::uint8_t stream_type) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _settings[stream_type & 1].bitrate_kbps;
+    }
+
+private:
+    struct Settings {
+        std::uint8_t enc_type{0};
+        std::uint16_t width{0};
+        std::uint16_t height{0};
+        std::uint16_t bitrate_kbps{0};
+    };
+
+    void run()
+    {
+        std::vector<std::uint8_t> buffer(2048);
+
+        while (!_stop) {
+            struct pollfd fd{_sockfd, POLLIN, 0};
+            if (poll(&fd, 1, 100) <= 0) {
+                continue;
+            }
+
+            struct sockaddr_in from{};
+            socklen_t from_len = sizeof(from);
+            const auto received = recvfrom(_sockfd, buffer.data(), buffer.size(), 0,
+                reinterpret_cast<sockaddr*>(&from), &from_len);
+            if (received <= 0) {
+                continue;
+            }
+
+            const std::vector<std::uint8_t> message(buffer.begin(), buffer.begin() + received);
+            const auto maybe_header = Deserializer::header(message);
+            if (!maybe_header) {
+                continue;
+            }
+            ++_received;
+            ++_received_per_cmd[maybe_header.value().cmd_id];
+
+            const auto payload = answer(maybe_header.value(),
+                std::vector<std::uint8_t>(message.begin() + 8, message.end() - 2));
+            if (payload.empty()) {
+                continue;
+            }
+
+            // Pictures are answered with function feedback, not an ack.
+            auto cmd_id = maybe_header.value().cmd_id;
+            if (cmd_id == TakePicture::cmd_id_impl()) {
+                std::this_thread::sleep_for(_shutter_delay.load());
+                cmd_id = AckFunctionFeedback::cmd_id_impl();
+            }
+
+            const auto reply = assemble(cmd_id, maybe_header.value().seq, payload);
+            (void)sendto(_sockfd, reply.data(), reply.size(), 0,
+                reinterpret_cast<const sockaddr*>(&from), from_len);
+        }
+    }
+
+    // Returns the payload of the answer, or nothing if there is none.
+    [[nodiscard]] std::vector<std::uint8_t> answer(
+        const Deserializer::Header& header, const std::vector<std::uint8_t>& payload)
+    {
+        switch (header.cmd_id) {
+            case 0x01: // firmware version, 0.2.1 and gimbal 0.3.1
+                return {0x01, 0x02, 0x00, 0x00, 0x01, 0x03, 0x00, 0x00};
+
+            case 0x20: { // get stream settings
+                if (payload.size() != 1) {
+                    return {};
+                }
+                std::lock_guard<std::mutex> lock(_mutex);
+                return settings_payload(payload[0] & 1);
+            }
+
+            case 0x21: { // set stream settings
+                if (payload.size() != 9) {
+                    return {};
+                }
+                const std::uint8_t stream_type = payload[0] & 1;
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto& settings = _settings[stream_type];
+                settings.enc_type = payload[1];
+                settings.width = payload[2] | (payload[3] << 8);
+                settings.height = payload[4] | (payload[5] << 8);
+                settings.bitrate_kbps = payload[6] | (payload[7] << 8);
+                return {stream_type, 1};
+            }
+
+            case 0x07: // gimbal rotation
+                if (payload.size() != 2 || !header.need_ack()) {
+                    return {};
+                }
+                return {1};
+
+            case 0x05: { // manual zoom, which gets there right away
+                if (payload.size() != 1) {
+                    return {};
+                }
+                const auto direction = static_cast<std::int8_t>(payload[0]);
+                if (direction > 0 && _zoom < 60) {
+                    _zoom += 10;
+                } else if (direction < 0 && _zoom > 10) {
+                    _zoom -= 10;
+                }
+                if (!header.need_ack()) {
+                    return {};
+                }
+                const unsigned zoom = _zoom;
+                return {static_cast<std::uint8_t>(zoom & 0xff), static_cast<std::uint8_t>(zoom >> 8)};
+            }
+
+            case 0x0F: // absolute zoom
+                if (payload.size() != 2) {
+                    return {};
+                }
+                _zoom = payload[0] * 10 + payload[1];
+                if (!header.need_ack()) {
+                    return {};
+                }
+                return {1};
+
+            case 0x0C: // picture taken, other functions aren't
+                if (payload.size() != 1 || payload[0] != 0) {
+                    return {};
+                }
+                return {0};
+
+            case 0x18: { // get zoom
+                const unsigned zoom = _zoom;
+                return {static_cast<std::uint8_t>(zoom / 10), static_cast<std::uint8_t>(zoom % 10)};
+            }
+
+            default:
+                return {};
+        }
+    }
+
+    [[nodiscard]] std::vector<std::uint8_t> settings_payload(std::uint8_t stream_type) const
+    {
+        const auto& settings = _settings[stream_type];
+        return {
+            stream_type,
+            settings.enc_type,
+            static_cast<std::uint8_t>(settings.width & 0xff),
+            static_cast<std::uint8_t>(settings.width >> 8),
+            static_cast<std::uint8_t>(settings.height & 0xff),
+            static_cast<std::uint8_t>(settings.height >> 8),
+            static_cast<std::uint8_t>(settings.bitrate_kbps & 0xff),
+            static_cast<std::uint8_t>(settings.bitrate_kbps >> 8),
+            0,
+        };
+    }
+
+    [[nodiscard]] static std::vector<std::uint8_t> assemble(
+        std::uint8_t cmd_id, std::uint16_t seq, const std::vector<std::uint8_t>& payload)
+    {
+        std::vector<std::uint8_t> message{
+            0x55, 0x66, 0x02,
+            static_cast<std::uint8_t>(payload.size() & 0xff),
+            static_cast<std::uint8_t>(payload.size() >> 8),
+            static_cast<std::uint8_t>(seq & 0xff),
+            static_cast<std::uint8_t>(seq >> 8),
+            cmd_id,
+        };
+        message.insert(message.end(), payload.begin(), payload.end());
+
+        const auto crc16 = crc16_cal(message.data(), static_cast<std::uint32_t>(message.size()));
+        message.push_back(crc16 & 0xff);
+        message.push_back((crc16 >> 8) & 0xff);
+        return message;
+    }
+
+    int _sockfd{-1};
+    unsigned _port{0};
+    std::thread _thread;
+    std::atomic<bool> _stop{false};
+    std::atomic<std::uint64_t> _received{0};
+    std::array<std::atomic<std::uint64_t>, 256> _received_per_cmd{};
+    std::atomic<unsigned> _zoom{10};
+    std::atomic<std::chrono::milliseconds> _shutter_delay{std::chrono::milliseconds(0)};
+
+    mutable std::mutex _mutex;
+    Settings _settings[2];
+};
+
+} // namespace siyi
@@ -1,7 +1,148 @@
 
+#include <algorithm>
 #include <assert.h>
+#include <cstdlib>
+#include <new>
 
 #include "siyi_protocol.hpp"
+#include "siyi_buffer_pool.hpp"
+#include "siyi_camera.hpp"
+#include "bitrate_controller.hpp"
+#include "camera_definition.hpp"
+#include "link_health.hpp"
+#include "shutter_timing.hpp"
+#include "siyi_mux.hpp"
+#include "siyi_stand_in.hpp"
+#include "siyi_analysis.hpp"
+#include "logger.hpp"
+
+// All checks are asserts, and many of them do what they check.
+#ifdef NDEBUG
+#error "siyi_test needs to be built without NDEBUG"
+#endif
+
+// Allocations of the current thread, to check what must not allocate. All
+// forms of new and delete are replaced, so that they stay a matching pair.
+// The deletes are not inlined, or GCC takes the free() of what new returned
+// for a mismatch.
+static thread_local std::size_t allocations = 0;
+
+static void* allocate(std::size_t size, std::align_val_t alignment = std::align_val_t{__STDCPP_DEFAULT_NEW_ALIGNMENT__})
+{
+    ++allocations;
+    const auto align = std::max(static_cast<std::size_t>(alignment), sizeof(void*));
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, align, size == 0 ? 1 : size) != 0) {
+        return nullptr;
+    }
+    return ptr;
+}
+
+void* operator new(std::size_t size)
+{
+    if (void* ptr = allocate(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    if (void* ptr = allocate(size, alignment)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate(size, alignment);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
 
 static void assemble_example_message()
 {
@@ -19,24 +160,949 @@ static void check_sequence()
 {
     siyi::Serializer siyi_serializer{};
 
+    // The samples ask for an ack, which gimbal rotation doesn't by default.
     siyi::GimbalRotate gimbal_rotate{100, 100};
-    const auto message1 = siyi_serializer.assemble_message(gimbal_rotate);
+    const auto message1 = siyi_serializer.assemble_message(gimbal_rotate, true);
 
     // Sample from A8 mini User Manual v1.5 page 45 "Rotate 100, 100"
     const std::vector<uint8_t> sample1 {0x55, 0x66, 0x01, 0x02, 0x00, 0x00, 0x00, 0x07, 0x64, 0x64, 0x3d, 0xcf};
     assert(message1 == sample1);
 
-    const auto message2 = siyi_serializer.assemble_message(gimbal_rotate);
+    const auto message2 = siyi_serializer.assemble_message(gimbal_rotate, true);
 
     // Tried and it worked
     const std::vector<uint8_t> sample2 {0x55, 0x66, 0x01, 0x02, 0x00, 0x01, 0x00, 0x07, 0x64, 0x64, 0x6c, 0x65};
     assert(message2 == sample2);
 }
 
+static void parse_rebroadcast_stats()
+{
+    const std::string report =
+        "clients=2\n"
+        "gop_cache_bytes=1000 gop_cache_frames=3 gop_cache_limit=2097152 gop_cache_overflows=0\n"
+        "client=10.0.0.2 transport=udp uptime_s=12 bytes=100 packets=10 fraction_lost=0.020 packets_lost=3 "
+        "jitter_ms=4.5 send_queue=0 keyframe_age_ms=100\n"
+        "client=10.0.0.3 transport=tcp uptime_s=3 bytes=100 packets=10 fraction_lost=0.000 packets_lost=0 "
+        "jitter_ms=12.0 send_queue=4096 keyframe_age_ms=100\n";
+
+    const auto stats = parse_link_stats(report);
+    assert(stats);
+    assert(stats.value().clients == 2);
+    assert(stats.value().fraction_lost == 0.02);
+    assert(stats.value().jitter_ms == 12.0);
+    assert(stats.value().send_queue_bytes == 4096);
+
+    assert(!parse_link_stats("garbage"));
+}
+
+static void adapt_bitrate()
+{
+    using namespace std::chrono_literals;
+
+    auto now = BitrateController::Clock::time_point{} + 1h;
+
+    BitrateController controller;
+    controller.set_allowed({4000, 1600, 3000, 2000});
+    controller.set_ceiling(3000, now);
+
+    LinkStats congested{};
+    congested.clients = 1;
+    congested.fraction_lost = 0.1;
+
+    LinkStats clean{};
+    clean.clients = 1;
+
+    // A single bad sample is not enough, and neither is staying within the dwell time.
+    now += 1s;
+    assert(!controller.update(congested, now));
+    now += 1s;
+    assert(!controller.update(congested, now));
+
+    now += 5s;
+    assert(controller.update(congested, now) == 2000u);
+    now += 1s;
+    assert(!controller.update(congested, now));
+
+    now += 5s;
+    assert(controller.update(congested, now) == 1600u);
+    now += 5s;
+    assert(!controller.update(congested, now));
+
+    // The camera reconnecting while stepped down keeps the ceiling.
+    controller.set_allowed({4000, 1600, 3000, 2000});
+    assert(controller.ceiling() == 3000);
+    assert(controller.current() == 1600);
+
+    // Loss between both thresholds keeps the bitrate.
+    LinkStats in_between{};
+    in_between.clients = 1;
+    in_between.fraction_lost = 0.03;
+    for (unsigned i = 0; i < 60; ++i) {
+        now += 1s;
+        assert(!controller.update(in_between, now));
+    }
+
+    // Going back up takes a while, and stops at what the user set.
+    for (unsigned i = 0; i < 9; ++i) {
+        now += 1s;
+        assert(!controller.update(clean, now));
+    }
+    now += 1s;
+    assert(controller.update(clean, now) == 2000u);
+    for (unsigned i = 0; i < 60; ++i) {
+        now += 1s;
+        (void)controller.update(clean, now);
+    }
+    assert(controller.current() == 3000);
+
+    // Nobody watching, nothing changes.
+    LinkStats nobody{};
+    nobody.fraction_lost = 1.0;
+    for (unsigned i = 0; i < 10; ++i) {
+        now += 10s;
+        assert(!controller.update(nobody, now));
+    }
+
+    // After a restart while stepped down, the saved ceiling is used.
+    const std::string ceiling_path =
+        std::filesystem::temp_directory_path() / ("siyi_test_ceiling_" + std::to_string(getpid()));
+    const bool written = write_bitrate_ceiling(ceiling_path, 3000);
+    assert(written);
+    const auto saved_ceiling = read_bitrate_ceiling(ceiling_path);
+    assert(saved_ceiling == 3000u);
+    std::filesystem::remove(ceiling_path);
+    assert(!read_bitrate_ceiling(ceiling_path));
+
+    BitrateController restarted;
+    restarted.set_allowed({4000, 1600, 3000, 2000});
+    restarted.set_ceiling(saved_ceiling.value(), now);
+    restarted.revert(1600);
+    for (unsigned i = 0; i < 100; ++i) {
+        now += 1s;
+        (void)restarted.update(clean, now);
+    }
+    assert(restarted.current() == 3000);
+}
+
+static void compress_camera_definition()
+{
+    assert(definition_version("<mavlinkcamera>\n    <definition version=\"30\">\n") == 30u);
+    assert(!definition_version("<mavlinkcamera>\n    <definition>\n    <model version=\"30\">"));
+
+    const std::string xml = "<definition version=\"7\"><model>SIYI</model></definition>";
+    const auto compressed = xz_compress(xml);
+    assert(compressed);
+
+    std::vector<std::uint8_t> decompressed(xml.size());
+    std::uint64_t memlimit = UINT64_MAX;
+    std::size_t in_pos = 0;
+    std::size_t out_pos = 0;
+    assert(lzma_stream_buffer_decode(
+        &memlimit, 0, nullptr, compressed.value().data(), &in_pos, compressed.value().size(),
+        decompressed.data(), &out_pos, decompressed.size()) == LZMA_OK);
+    assert(std::string(decompressed.begin(), decompressed.end()) == xml);
+}
+
+static void generate_camera_definition()
+{
+    namespace fs = std::filesystem;
+
+    const fs::path template_path = fs::path(SOURCE_DIR) / "mavlink_ftp_root" / "siyi_a8_mini.xml";
+    const auto template_xml = read_file(template_path);
+    assert(template_xml);
+
+    // What we know about the current firmware is exactly what is in the installed definition.
+    auto capabilities = capabilities_for_firmware("0.2.1");
+    assert(parameters_of(template_xml.value()) == generate_parameters(capabilities));
+
+    const fs::path cache_dir = fs::temp_directory_path() / ("siyi_test_cache_" + std::to_string(getpid()));
+    fs::remove_all(cache_dir);
+
+    // Same capabilities, same version.
+    const auto first = cached_definition(template_path, cache_dir, "0.2.1", capabilities);
+    assert(first);
+    assert(read_file(first.value()) == template_xml);
+
+    // New capabilities, new version.
+    capabilities.add_bitrate(1920, 1080, 1500);
+    const auto second = cached_definition(template_path, cache_dir, "0.3.0", capabilities);
+    assert(second);
+    const auto second_xml = read_file(second.value());
+    assert(definition_version(second_xml.value()) == 31u);
+    assert(second_xml.value().find("<option name=\"1.5 Mbps\" value=\"1500\" />") != std::string::npos);
+
+    // Another firmware with the same capabilities keeps the version.
+    const auto third = cached_definition(template_path, cache_dir, "0.3.1", capabilities);
+    assert(third);
+    assert(definition_version(read_file(third.value()).value()) == 31u);
+
+    // Once cached, it is used as long as the capabilities are the same.
+    const auto written = fs::last_write_time(second.value());
+    const auto again = cached_definition(template_path, cache_dir, "0.3.0", capabilities);
+    assert(again == second);
+    assert(fs::last_write_time(again.value()) == written);
+
+    // When the camera reports more, it is generated again.
+    auto more_capabilities = capabilities;
+    more_capabilities.add_bitrate(1920, 1080, 1200);
+    const auto more = cached_definition(template_path, cache_dir, "0.3.0", more_capabilities);
+    assert(more == second);
+    const auto more_xml = read_file(more.value());
+    assert(definition_version(more_xml.value()) == 32u);
+    assert(more_xml.value().find("<option name=\"1.2 Mbps\" value=\"1200\" />") != std::string::npos);
+
+    // And going back, the earlier version is found again.
+    const auto back = cached_definition(template_path, cache_dir, "0.3.0", capabilities);
+    assert(definition_version(read_file(back.value()).value()) == 31u);
+
+    fs::remove_all(cache_dir);
+}
+
+static std::vector<std::uint8_t> ack_message(std::uint8_t cmd_id, const std::vector<std::uint8_t>& payload)
+{
+    std::vector<std::uint8_t> message {0x55, 0x66, 0x02,
+        static_cast<std::uint8_t>(payload.size() & 0xff), static_cast<std::uint8_t>(payload.size() >> 8),
+        0x00, 0x00, cmd_id};
+    message.reserve(message.size() + payload.size() + 2);
+    message.insert(message.end(), payload.begin(), payload.end());
+    const auto crc16 = siyi::crc16_cal(message.data(), message.size());
+    message.push_back(crc16 & 0xff);
+    message.push_back((crc16 >> 8) & 0xff);
+    return message;
+}
+
+// The stand-in camera, already answering, and everything needed to talk to it.
+struct StandInLink {
+    siyi::StandIn stand_in;
+    siyi::Serializer serializer;
+    siyi::Deserializer deserializer;
+    siyi::Messager messager;
+    siyi::Camera camera{serializer, deserializer, messager};
+
+    StandInLink()
+    {
+        const bool started = stand_in.start();
+        assert(started);
+        const bool set_up = messager.setup("127.0.0.1", stand_in.port());
+        assert(set_up);
+    }
+
+    // Starts the camera and waits for it to be connected.
+    [[nodiscard]] bool start_camera(std::function<void(float)> on_zoom = {})
+    {
+        std::atomic<bool> connected{false};
+        camera.start([&connected]() { connected = true; }, std::move(on_zoom));
+        for (unsigned i = 0; i < 100 && !connected; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return connected;
+    }
+};
+
+static void correlate_acks()
+{
+    // Stream settings: H265, 1280x720, 2000 kbps
+    const auto stream = ack_message(0x20, {0x01, 0x02, 0x00, 0x05, 0xd0, 0x02, 0xd0, 0x07, 0x00});
+    const auto header = siyi::Deserializer::header(stream);
+    assert(header);
+    assert(header.value().cmd_id == 0x20);
+    assert(header.value().data_len == 9);
+    assert(header.value().first_payload_byte == 1);
+
+    siyi::Deserializer deserializer;
+    const auto settings = deserializer.disassemble_message<siyi::AckGetStreamResolution>(stream);
+    assert(settings);
+    assert(settings.value().stream_type() == 1);
+    assert(settings.value().video_bitrate_kbps == 2000);
+
+    auto corrupted = stream;
+    corrupted[9] ^= 0xff;
+    assert(!siyi::Deserializer::header(corrupted));
+}
+
+static void warm_start_settings()
+{
+    const std::string path = std::filesystem::temp_directory_path() / ("siyi_test_settings_" + std::to_string(getpid()));
+
+    siyi::Serializer serializer;
+    siyi::Deserializer deserializer;
+    siyi::Messager messager;
+    siyi::Camera camera{serializer, deserializer, messager};
+    camera.set_settings_file(path);
+
+    std::filesystem::remove(path);
+    const bool loaded_missing = camera.load_settings();
+    assert(!loaded_missing);
+
+    {
+        std::ofstream file(path);
+        file << "camera_ver_major=0\ncamera_ver_minor=2\ncamera_ver_patch=1\n"
+             << "gimbal_ver_major=0\ngimbal_ver_minor=1\ngimbal_ver_patch=7\n"
+             << "stream_enc_type=1\nstream_width=1920\nstream_height=1080\nstream_bitrate_kbps=3000\n"
+             << "recording_enc_type=2\nrecording_width=3840\nrecording_height=2160\nrecording_bitrate_kbps=4000\n";
+    }
+    const bool loaded = camera.load_settings();
+    assert(loaded);
+    assert(camera.firmware_version() == "0.2.1");
+    assert(camera.resolution() == siyi::Camera::Resolution::Res1920x1080);
+    assert(camera.bitrate() == 3000);
+    assert(camera.codec(siyi::Camera::Type::Stream) == siyi::Camera::Codec::H264);
+    assert(camera.codec(siyi::Camera::Type::Recording) == siyi::Camera::Codec::H265);
+
+    // Settings the camera can't have are rejected.
+    {
+        std::ofstream file(path, std::ios::app);
+        file << "stream_width=1000\n";
+    }
+    const bool loaded_invalid = camera.load_settings();
+    assert(!loaded_invalid);
+
+    std::filesystem::remove(path);
+}
+
+static void connection_state()
+{
+    // Nobody is answering on the discard port.
+    siyi::Serializer serializer;
+    siyi::Deserializer deserializer;
+    siyi::Messager messager;
+    const bool set_up = messager.setup("127.0.0.1", 9);
+    assert(set_up);
+    siyi::Camera camera{serializer, deserializer, messager};
+
+    // Until the camera has answered, the defaults are used.
+    assert(camera.state() == siyi::Camera::State::Disconnected);
+    assert(camera.resolution() == siyi::Camera::Resolution::Res1280x720);
+    assert(camera.codec(siyi::Camera::Type::Stream) == siyi::Camera::Codec::H265);
+
+    bool connected = false;
+    camera.start([&]() { connected = true; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    assert(camera.state() == siyi::Camera::State::Probing);
+
+    camera.stop();
+    assert(camera.state() == siyi::Camera::State::Disconnected);
+    assert(!connected);
+}
+
+static void track_link_health()
+{
+    using std::chrono::microseconds;
+
+    siyi::LinkHealth health;
+    assert(health.stats().samples == 0);
+    assert(!health.degraded());
+
+    for (unsigned i = 1; i <= 20; ++i) {
+        health.add_reply(microseconds(i * 1000));
+    }
+    auto stats = health.stats();
+    assert(stats.samples == 20);
+    assert(stats.loss_rate == 0.0);
+    assert(stats.rtt_p50 == microseconds(10000));
+    assert(stats.rtt_p95 == microseconds(19000));
+    assert(stats.rtt_max == microseconds(20000));
+    // Steps of 1 ms, the jitter converges towards that.
+    assert(stats.jitter > microseconds(500) && stats.jitter < microseconds(1000));
+    assert(!health.degraded());
+
+    // Losing a quarter of the heartbeats is too much.
+    for (unsigned i = 0; i < 7; ++i) {
+        health.add_loss();
+    }
+    assert(health.stats().loss_rate > siyi::LinkHealth::degraded_loss_rate);
+    assert(health.degraded());
+
+    // Only the last heartbeats count.
+    for (unsigned i = 0; i < siyi::LinkHealth::window; ++i) {
+        health.add_reply(microseconds(5000));
+    }
+    stats = health.stats();
+    assert(stats.samples == siyi::LinkHealth::window);
+    assert(stats.loss_rate == 0.0);
+    assert(stats.rtt_max == microseconds(5000));
+    assert(!health.degraded());
+}
+
+static void route_mux_messages()
+{
+    siyi::MuxRouter router;
+    const auto now = siyi::MuxRouter::Clock::now();
+
+    // Both clients start counting at 0.
+    siyi::Serializer serializer1;
+    siyi::Serializer serializer2;
+    auto get_stream = siyi::GetStreamSettings{};
+    get_stream.stream_type = 1;
+    auto get_recording = siyi::GetStreamSettings{};
+    get_recording.stream_type = 0;
+
+    const auto request1 = router.request(1, serializer1.assemble_message(get_stream), now);
+    const auto request2 = router.request(2, serializer2.assemble_message(get_recording), now);
+    const auto request3 = router.request(2, serializer2.assemble_message(siyi::FirmwareVersion{}), now);
+    assert(request1 && request2 && request3);
+    assert(router.pending() == 3);
+
+    const auto header1 = siyi::Deserializer::header(request1.value());
+    const auto header2 = siyi::Deserializer::header(request2.value());
+    assert(header1 && header2);
+    assert(header1.value().seq != header2.value().seq);
+
+    assert(!router.request(1, {0x55, 0x66, 0x01}, now));
+
+    // Replies in a different order still go to who asked.
+    const auto recording = ack_message(0x20, {0x00, 0x02, 0x00, 0x0f, 0x70, 0x08, 0xa0, 0x0f, 0x00});
+    const auto stream = ack_message(0x20, {0x01, 0x02, 0x00, 0x05, 0xd0, 0x02, 0xd0, 0x07, 0x00});
+    assert(router.reply(recording, now) == 2);
+    assert(router.reply(stream, now) == 1);
+    assert(!router.reply(stream, now));
+    assert(router.pending() == 1);
+
+    // The feedback after taking a picture isn't asked for, everybody gets it.
+    const auto feedback = ack_message(siyi::AckFunctionFeedback::cmd_id_impl(), {0x00});
+    assert(router.reply(feedback, now) == siyi::MuxRouter::all_clients);
+    assert(router.pending() == 1);
+
+    // Who's gone doesn't get anything.
+    router.remove_client(2);
+    assert(router.pending() == 0);
+
+    // And who doesn't get an answer for a while neither.
+    assert(router.request(1, serializer1.assemble_message(siyi::FirmwareVersion{}), now));
+    (void)router.reply(stream, now + siyi::MuxRouter::request_timeout + std::chrono::seconds(1));
+    assert(router.pending() == 0);
+}
+
+static void replay_capture()
+{
+    const std::string path = std::filesystem::temp_directory_path() / ("siyi_test_capture_" + std::to_string(getpid()));
+    std::filesystem::remove(path);
+
+    siyi::Serializer serializer;
+    auto get_stream = siyi::GetStreamSettings{};
+    get_stream.stream_type = 1;
+
+    // What init() gets from a camera with firmware 0.2.1, answering in a different order.
+    {
+        siyi::CaptureWriter capture;
+        const bool capturing = capture.open(path);
+        assert(capturing);
+        const std::uint64_t ms = 1000000;
+        capture.record(siyi::CaptureDirection::Sent, serializer.assemble_message(siyi::FirmwareVersion{}), 0);
+        capture.record(siyi::CaptureDirection::Sent, serializer.assemble_message(get_stream), 1 * ms);
+        capture.record(siyi::CaptureDirection::Received,
+            ack_message(0x20, {0x00, 0x02, 0x00, 0x0f, 0x70, 0x08, 0xa0, 0x0f, 0x00}), 20 * ms);
+        capture.record(siyi::CaptureDirection::Received,
+            ack_message(0x01, {0x01, 0x02, 0x00, 0x00, 0x07, 0x01, 0x00, 0x00}), 40 * ms);
+        capture.record(siyi::CaptureDirection::Received,
+            ack_message(0x20, {0x01, 0x01, 0x80, 0x07, 0x38, 0x04, 0xb8, 0x0b, 0x00}), 60 * ms);
+    }
+
+    siyi::CaptureReader reader;
+    const bool reading = reader.open(path);
+    assert(reading);
+    unsigned count = 0;
+    while (const auto record = reader.next()) {
+        assert(siyi::Deserializer::header(record.value().bytes));
+        ++count;
+    }
+    assert(count == 5);
+
+    for (const bool realtime : {false, true}) {
+        siyi::Deserializer deserializer;
+        siyi::Messager messager;
+        const bool replaying = messager.setup_replay(path, realtime);
+        assert(replaying);
+        siyi::Camera camera{serializer, deserializer, messager};
+
+        const auto start = std::chrono::steady_clock::now();
+        const bool initialized = camera.init();
+        const auto duration = std::chrono::steady_clock::now() - start;
+        assert(initialized);
+        assert(!realtime || duration >= std::chrono::milliseconds(40));
+
+        assert(camera.firmware_version() == "0.2.1");
+        assert(camera.resolution() == siyi::Camera::Resolution::Res1920x1080);
+        assert(camera.codec(siyi::Camera::Type::Stream) == siyi::Camera::Codec::H264);
+        assert(camera.bitrate() == 3000);
+        assert(camera.codec(siyi::Camera::Type::Recording) == siyi::Camera::Codec::H265);
+    }
+
+    std::filesystem::remove(path);
+}
+
+static void queue_log_lines()
+{
+    LogQueue queue;
+    LogQueue::Entry entry;
+    assert(!queue.pop(entry));
+
+    // Several threads logging at once, nothing gets lost or mixed up.
+    constexpr unsigned threads = 4;
+    constexpr unsigned lines = 200;
+    std::vector<std::thread> producers;
+    for (unsigned i = 0; i < threads; ++i) {
+        producers.emplace_back([&queue, i]() {
+            for (unsigned j = 0; j < lines; ++j) {
+                assert(queue.push(LogQueue::Entry{LogLevel::Info, std::to_string(i) + " " + std::to_string(j)}));
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+
+    std::vector<unsigned> next(threads, 0);
+    unsigned count = 0;
+    while (queue.pop(entry)) {
+        std::istringstream fields(entry.text);
+        unsigned thread = 0;
+        unsigned line = 0;
+        fields >> thread >> line;
+        // In order per thread.
+        assert(line == next[thread]);
+        ++next[thread];
+        ++count;
+    }
+    assert(count == threads * lines);
+
+    // When it's full, it's full.
+    for (std::size_t i = 0; i < LogQueue::capacity; ++i) {
+        assert(queue.push(LogQueue::Entry{LogLevel::Info, "x"}));
+    }
+    assert(!queue.push(LogQueue::Entry{LogLevel::Info, "too much"}));
+    assert(queue.pop(entry));
+    assert(queue.push(LogQueue::Entry{LogLevel::Info, "fits again"}));
+
+    LogRateLimit limit{std::chrono::milliseconds(50), 3};
+    assert(limit.allow() && limit.allow() && limit.allow());
+    assert(!limit.allow());
+    assert(!limit.allow());
+    assert(limit.take_suppressed() == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    assert(limit.allow());
+}
+
+static void concurrent_commands()
+{
+    StandInLink link;
+    auto& camera = link.camera;
+    const bool connected = link.start_camera();
+    assert(connected);
+    assert(camera.bitrate() == 2000);
+
+    // Zooming doesn't wait for anything, and its answers (if there were any)
+    // must not get in the way of the settings being changed at the same time.
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < 4; ++i) {
+        threads.emplace_back([&]() {
+            while (!done) {
+                const bool zoomed_in = camera.zoom(siyi::Camera::Zoom::In);
+                const bool stopped = camera.zoom(siyi::Camera::Zoom::Stop);
+                assert(zoomed_in && stopped);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    threads.emplace_back([&]() {
+        while (!done) {
+            // Whatever was set, it's never half of it.
+            const auto settings = camera.settings();
+            assert(settings.stream.resolution_l == 1280 && settings.stream.resolution_h == 720);
+            assert(settings.stream.video_bitrate_kbps >= 2000 && settings.stream.video_bitrate_kbps < 2010);
+        }
+    });
+
+    std::vector<std::thread> setters;
+    for (unsigned i = 0; i < 2; ++i) {
+        setters.emplace_back([&, i]() {
+            for (unsigned j = 0; j < 5; ++j) {
+                const bool set = camera.set_bitrate(siyi::Camera::Type::Stream, 2000 + i * 5 + j);
+                assert(set);
+            }
+        });
+    }
+    for (auto& setter : setters) {
+        setter.join();
+    }
+    done = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    assert(camera.bitrate() == link.stand_in.bitrate(1));
+    assert(camera.state() == siyi::Camera::State::Ready);
+    camera.stop();
+}
+
+static void receive_without_allocating()
+{
+    siyi::BufferPool pool{2, 16};
+    {
+        auto first = pool.take();
+        auto second = pool.take();
+        assert(first.valid() && second.valid());
+        assert(first.data() != second.data());
+        assert(!pool.take().valid());
+
+        // Moving the handle keeps the buffer.
+        auto moved = std::move(first);
+        assert(!first.valid());
+        assert(moved.valid() && moved.capacity() == 16);
+        assert(pool.available() == 0);
+    }
+    assert(pool.available() == 2);
+
+    StandInLink link;
+    auto& messager = link.messager;
+
+    const auto request = link.serializer.assemble_message(siyi::FirmwareVersion{});
+
+    const auto exchange = [&]() {
+        const bool sent = messager.send(request);
+        assert(sent);
+        const auto message = messager.receive_buffer();
+        const auto header = siyi::Deserializer::header(message);
+        assert(header && header.value().cmd_id == siyi::AckFirmwareVersion::cmd_id_impl());
+        const auto version = link.deserializer.disassemble_message<siyi::AckFirmwareVersion>(message);
+        assert(version && version.value().code_board_ver_minor == 2);
+    };
+
+    // Whatever happens once, e.g. for the first log line, is done by now.
+    for (unsigned i = 0; i < 10; ++i) {
+        exchange();
+    }
+
+    const auto before = allocations;
+    for (unsigned i = 0; i < 1000; ++i) {
+        exchange();
+    }
+    assert(allocations == before);
+}
+
+static void skip_acks()
+{
+    siyi::Serializer serializer;
+
+    // Settings and queries ask for an ack, gimbal and zoom commands don't.
+    const auto version = serializer.assemble_message(siyi::FirmwareVersion{});
+    const auto zoom = serializer.assemble_message(siyi::ManualZoom{});
+    const auto rotate = serializer.assemble_message(siyi::GimbalRotate{10, 0});
+    assert(siyi::Deserializer::header(version).value().need_ack());
+    assert(!siyi::Deserializer::header(zoom).value().need_ack());
+    assert(!siyi::Deserializer::header(rotate).value().need_ack());
+    assert(!siyi::Deserializer::header(zoom).value().is_ack());
+
+    // Unless asked otherwise.
+    const auto zoom_with_ack = serializer.assemble_message(siyi::ManualZoom{}, true);
+    assert(siyi::Deserializer::header(zoom_with_ack).value().need_ack());
+
+    // The mux doesn't wait for what isn't coming.
+    siyi::MuxRouter router;
+    const auto now = siyi::MuxRouter::Clock::now();
+    assert(router.request(1, zoom, now));
+    assert(router.request(1, rotate, now));
+    assert(router.pending() == 0);
+    assert(router.request(2, zoom_with_ack, now));
+    assert(router.pending() == 1);
+    assert(router.reply(ack_message(siyi::AckManualZoom::cmd_id_impl(), {10, 0}), now) == 2);
+    assert(router.pending() == 0);
+
+    // Neither does the stand-in answer.
+    StandInLink link;
+    auto& messager = link.messager;
+    const bool zoom_sent = messager.send(zoom);
+    assert(zoom_sent);
+    const auto no_reply = messager.receive_buffer(std::chrono::milliseconds(100));
+    assert(no_reply.empty());
+    const bool zoom_with_ack_sent = messager.send(zoom_with_ack);
+    assert(zoom_with_ack_sent);
+    const auto reply = messager.receive_buffer(std::chrono::milliseconds(1000));
+    assert(!reply.empty());
+
+    // An answer nobody waited for is thrown away before the next request.
+    const bool late_sent = messager.send(zoom_with_ack);
+    assert(late_sent);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const auto discarded = messager.discard_pending();
+    assert(discarded == 1);
+    const auto nothing_left = messager.receive_buffer(std::chrono::milliseconds(100));
+    assert(nothing_left.empty());
+}
+
+// Longer than any ack we have, with a big endian field like some of the
+// gimbal commands.
+struct AckLongTest : public siyi::AckPayload<AckLongTest> {
+    static std::uint8_t cmd_id_impl() { return 0x40; }
+
+    std::uint16_t first{0};
+    std::int32_t last{0};
+
+    using layout = siyi::Layout<300,
+        siyi::Field<&AckLongTest::first, 0>,
+        siyi::Field<&AckLongTest::last, 296, siyi::Endian::Big>>;
+};
+
+static void encode_with_layouts()
+{
+    static_assert(siyi::StreamSettings::layout::size == 9);
+    static_assert(siyi::AckFirmwareVersion::layout::size == 8);
+    static_assert(siyi::FirmwareVersion::layout::size == 0);
+
+    siyi::StreamSettings stream_settings{};
+    stream_settings.stream_type = 1;
+    stream_settings.video_enc_type = 2;
+    stream_settings.resolution_l = 1920;
+    stream_settings.resolution_h = 1080;
+    stream_settings.video_bitrate_kbps = 4000;
+    const std::vector<std::uint8_t> expected_settings{0x01, 0x02, 0x80, 0x07, 0x38, 0x04, 0xa0, 0x0f, 0x00};
+    assert(stream_settings.bytes() == expected_settings);
+
+    siyi::SetGimbalAttitude attitude{};
+    attitude.yaw_t10 = -900;
+    attitude.pitch_t10 = 250;
+    const std::vector<std::uint8_t> expected_attitude{0x7c, 0xfc, 0xfa, 0x00};
+    assert(attitude.bytes() == expected_attitude);
+
+    siyi::SetGimbalMode gimbal_mode{};
+    gimbal_mode.mode = siyi::SetGimbalMode::Mode::Fpv;
+    assert(gimbal_mode.bytes() == std::vector<std::uint8_t>{5});
+
+    // Payloads with more than 255 bytes used to be cut off by the length.
+    std::vector<std::uint8_t> payload(300);
+    payload[0] = 0x01;
+    payload[1] = 0x02;
+    payload[296] = 0xff;
+    payload[297] = 0xff;
+    payload[298] = 0xff;
+    payload[299] = 0xfe;
+    siyi::Deserializer deserializer;
+    const auto ack = deserializer.disassemble_message<AckLongTest>(ack_message(0x40, payload));
+    assert(ack);
+    assert(ack.value().first == 0x0201);
+    assert(ack.value().last == -2);
+}
+
+static void follow_zoom()
+{
+    StandInLink link;
+    auto& stand_in = link.stand_in;
+    auto& camera = link.camera;
+
+    std::atomic<long> reported{10};
+    const bool connected = link.start_camera([&](float zoom) { reported = std::lround(zoom * 10.f); });
+    assert(connected);
+    assert(camera.zoom_level() == 1.f);
+
+    // A zoom slider dragged from 1x to 4x: only some of the targets are sent,
+    // and the last one is never dropped.
+    for (unsigned i = 0; i <= 30; ++i) {
+        const bool zoomed = camera.absolute_zoom(1.f + static_cast<float>(i) * 0.1f);
+        assert(zoomed);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (unsigned i = 0; i < 100 && stand_in.zoom() != 40; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(stand_in.zoom() == 40);
+    assert(stand_in.received(siyi::AbsoluteZoom::cmd_id_impl()) <= 4);
+
+    // Where it ended up is polled.
+    for (unsigned i = 0; i < 100 && reported != 40; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    assert(reported == 40);
+    assert(camera.zoom_level() == 4.f);
+
+    camera.stop();
+}
+
+static void time_pictures()
+{
+    StandInLink link;
+    auto& stand_in = link.stand_in;
+    auto& camera = link.camera;
+    stand_in.set_shutter_delay(std::chrono::milliseconds(30));
+
+    // Calibrated against the stand-in, which exposes 10 ms before it says so.
+    siyi::ShutterTiming shutter_timing{std::chrono::milliseconds(-10)};
+    for (unsigned i = 0; i < 3; ++i) {
+        const auto shot = camera.take_picture();
+        assert(shot);
+        assert(shot.value().success);
+        assert(shot.value().feedback);
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            shot.value().feedback.value() - shot.value().sent);
+        assert(latency >= std::chrono::milliseconds(29));
+        assert(latency < std::chrono::milliseconds(500));
+        shutter_timing.add(latency);
+
+        const auto estimate = shutter_timing.estimate(shot.value().sent, shot.value().feedback);
+        assert(estimate.confirmed);
+        assert(estimate.exposure == shot.value().feedback.value() - std::chrono::milliseconds(10));
+        assert(estimate.uncertainty);
+    }
+    assert(stand_in.received(siyi::TakePicture::cmd_id_impl()) == 3);
+    assert(shutter_timing.send_to_feedback().samples == 3);
+    assert(shutter_timing.send_to_exposure().p50 == shutter_timing.send_to_feedback().p50 - std::chrono::milliseconds(10));
+
+    // Without feedback, the usual latency is assumed, and is less certain.
+    siyi::ShutterTiming timing{std::chrono::milliseconds(-10)};
+    const auto sent = std::chrono::system_clock::now();
+    assert(!timing.estimate(sent, std::nullopt).uncertainty);
+    assert(timing.estimate(sent, std::nullopt).exposure == sent);
+    for (const auto latency_ms : {100, 100, 100, 140}) {
+        timing.add(std::chrono::milliseconds(latency_ms));
+    }
+    const auto estimate = timing.estimate(sent, std::nullopt);
+    assert(!estimate.confirmed);
+    assert(estimate.exposure == sent + std::chrono::milliseconds(90));
+    assert(estimate.uncertainty.value() > timing.estimate(sent, sent + std::chrono::milliseconds(100)).uncertainty.value());
+
+    // The exposure is never outside of sending and feedback.
+    siyi::ShutterTiming early{std::chrono::milliseconds(-500)};
+    assert(early.estimate(sent, sent + std::chrono::milliseconds(100)).exposure == sent);
+}
+
+static void analyze_capture()
+{
+    siyi::Serializer serializer;
+    const std::uint64_t ms = 1000000;
+
+    // Built in memory, as CaptureWriter drops records written this quickly.
+    std::vector<std::uint8_t> capture(std::begin(siyi::capture_magic), std::end(siyi::capture_magic));
+    const auto record = [&](siyi::CaptureDirection direction, const std::vector<std::uint8_t>& bytes, std::uint64_t timestamp_ns) {
+        for (unsigned i = 0; i < 8; ++i) {
+            capture.push_back(static_cast<std::uint8_t>(timestamp_ns >> (8 * i)));
+        }
+        capture.push_back(bytes.size() & 0xff);
+        capture.push_back((bytes.size() >> 8) & 0xff);
+        capture.push_back(static_cast<std::uint8_t>(direction));
+        capture.insert(capture.end(), 5, 0);
+        capture.insert(capture.end(), bytes.begin(), bytes.end());
+    };
+
+    // A heartbeat every second, answered after 5 ms, and a settings query
+    // every 10 s, answered after 20 ms. The camera goes quiet for a while in
+    // the middle, and a reply gets corrupted.
+    for (std::uint64_t second = 0; second < 2000; ++second) {
+        const auto now = second * 1000 * ms;
+        const auto heartbeat = serializer.assemble_message(siyi::FirmwareVersion{});
+        record(siyi::CaptureDirection::Sent, heartbeat, now);
+        if (second < 1000 || second >= 1005) {
+            auto reply = ack_message(0x01, {0x01, 0x02, 0x00, 0x00, 0x01, 0x03, 0x00, 0x00});
+            if (second == 1500) {
+                reply[9] ^= 0xff;
+            }
+            record(siyi::CaptureDirection::Received, reply, now + 5 * ms);
+        }
+
+        if (second % 10 == 0) {
+            auto get_stream = siyi::GetStreamSettings{};
+            get_stream.stream_type = 1;
+            const auto request = serializer.assemble_message(get_stream);
+            record(siyi::CaptureDirection::Sent, request, now + 100 * ms);
+            record(siyi::CaptureDirection::Received,
+                ack_message(0x20, {0x01, 0x02, 0x00, 0x05, 0xd0, 0x02, 0xd0, 0x07, 0x00}), now + 120 * ms);
+        }
+        // Not answered, and not expected to be.
+        record(siyi::CaptureDirection::Sent, serializer.assemble_message(siyi::GimbalRotate{0, 0}), now + 500 * ms);
+        if (second % 100 == 50) {
+            record(siyi::CaptureDirection::Received,
+                ack_message(siyi::AckFunctionFeedback::cmd_id_impl(), {0x00}), now + 700 * ms);
+        }
+    }
+    // Cut off in the middle of a record.
+    record(siyi::CaptureDirection::Sent, serializer.assemble_message(siyi::FirmwareVersion{}), 2000 * 1000 * ms);
+    capture.resize(capture.size() - 3);
+
+    std::optional<siyi::CaptureAnalyzer::Analysis> single;
+    for (const unsigned threads : {1u, 3u, 8u}) {
+        siyi::CaptureAnalyzer::Options options{};
+        options.threads = threads;
+        const auto analysis = siyi::CaptureAnalyzer{options}.analyze(capture);
+        assert(analysis);
+
+        const auto& heartbeat = analysis.value().commands.at(0x01);
+        assert(heartbeat.sent == 2000);
+        assert(heartbeat.received == 1994);
+        assert(heartbeat.answered == 1994);
+        assert(heartbeat.lost == 6);
+        assert(heartbeat.latencies.percentile(500) == std::chrono::milliseconds(5));
+
+        const auto& settings = analysis.value().commands.at(0x20);
+        assert(settings.sent == 200 && settings.answered == 200 && settings.lost == 0);
+        assert(settings.latencies.percentile(999) == std::chrono::milliseconds(20));
+
+        const auto& gimbal = analysis.value().commands.at(0x07);
+        assert(gimbal.sent == 2000 && gimbal.lost == 0);
+
+        const auto& errors = analysis.value().errors;
+        assert(errors.bad_crc == 1);
+        assert(errors.invalid_frames() == 1);
+        assert(errors.unmatched == 0);
+        assert(errors.truncated);
+        assert(errors.misaligned_chunks == 0);
+
+        assert(analysis.value().sessions == 1);
+        assert(analysis.value().gaps.size() == 1);
+        assert(analysis.value().gaps[0].at == std::chrono::milliseconds(1000 * 1000 + 120));
+        assert(analysis.value().gaps[0].length == std::chrono::milliseconds(4885));
+        assert(analysis.value().timeline.size() == 200);
+        assert(analysis.value().timeline[100].lost == 5);
+        assert(analysis.value().timeline[150].lost == 1);
+        assert(analysis.value().timeline[150].invalid == 1);
+
+        if (!single) {
+            single = analysis;
+        } else {
+            assert(analysis.value().records == single.value().records);
+            assert(analysis.value().bytes == single.value().bytes);
+        }
+    }
+
+    // Appended to after a restart, where the timestamps start over.
+    capture.assign(std::begin(siyi::capture_magic), std::end(siyi::capture_magic));
+    for (const std::uint64_t start : {10000 * ms, 1000 * ms}) {
+        record(siyi::CaptureDirection::Sent, serializer.assemble_message(siyi::FirmwareVersion{}), start);
+        record(siyi::CaptureDirection::Received,
+            ack_message(0x01, {0x01, 0x02, 0x00, 0x00, 0x01, 0x03, 0x00, 0x00}), start + 5 * ms);
+    }
+
+    const auto restarted = siyi::CaptureAnalyzer{siyi::CaptureAnalyzer::Options{}}.analyze(capture);
+    assert(restarted);
+    assert(restarted.value().sessions == 2);
+    assert(restarted.value().duration == std::chrono::milliseconds(10));
+    assert(restarted.value().commands.at(0x01).answered == 2);
+    assert(!restarted.value().errors.truncated);
+
+    std::vector<std::uint8_t> not_a_capture(100, 0);
+    assert(!siyi::CaptureAnalyzer{siyi::CaptureAnalyzer::Options{}}.analyze(not_a_capture));
+}
+
 int main(int, char**)
 {
     assemble_example_message();
     check_sequence();
+    parse_rebroadcast_stats();
+    adapt_bitrate();
+    compress_camera_definition();
+    generate_camera_definition();
+    correlate_acks();
+    warm_start_settings();
+    connection_state();
+    track_link_health();
+    route_mux_messages();
+    replay_capture();
+    queue_log_lines();
+    concurrent_commands();
+    receive_without_allocating();
+    skip_acks();
+    encode_with_layouts();
+    follow_zoom();
+    time_pictures();
+    analyze_capture();
 
     return 0;
 }
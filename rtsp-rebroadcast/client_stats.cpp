@@ -0,0 +1,489 @@
+#include "client_stats.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+
+namespace {
+
+constexpr const char* media_counters_key = "client-stats-counters";
+
+// RTP video clock, used if the session does not tell us.
+constexpr double default_clock_rate = 90000.0;
+
+// Counters attached to each media, updated from the streaming thread.
+struct MediaCounters {
+    std::atomic<guint64> bytes{0};
+    std::atomic<guint64> packets{0};
+    std::atomic<gint64> last_keyframe_us{-1};
+};
+
+void delete_media_counters(gpointer data)
+{
+    delete static_cast<MediaCounters*>(data);
+}
+
+MediaCounters* media_counters(GstRTSPMedia* media)
+{
+    return static_cast<MediaCounters*>(g_object_get_data(G_OBJECT(media), media_counters_key));
+}
+
+GstPadProbeReturn on_pay_sink(GstPad*, GstPadProbeInfo* info, gpointer user_data)
+{
+    auto* counters = static_cast<MediaCounters*>(user_data);
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (buffer != nullptr && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        counters->last_keyframe_us = g_get_monotonic_time();
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn on_pay_src(GstPad*, GstPadProbeInfo* info, gpointer user_data)
+{
+    auto* counters = static_cast<MediaCounters*>(user_data);
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList* list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        const guint len = gst_buffer_list_length(list);
+        guint64 bytes = 0;
+        for (guint i = 0; i < len; ++i) {
+            bytes += gst_buffer_get_size(gst_buffer_list_get(list, i));
+        }
+        counters->packets += len;
+        counters->bytes += bytes;
+    } else if (GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info)) {
+        counters->packets += 1;
+        counters->bytes += gst_buffer_get_size(buffer);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// The RTCP stats fields differ in integer type between GStreamer versions.
+std::optional<double> get_number(const GstStructure* structure, const char* field)
+{
+    const GValue* value = gst_structure_get_value(structure, field);
+    if (value == nullptr) {
+        return {};
+    }
+    if (G_VALUE_HOLDS_UINT(value)) {
+        return g_value_get_uint(value);
+    }
+    if (G_VALUE_HOLDS_INT(value)) {
+        return g_value_get_int(value);
+    }
+    if (G_VALUE_HOLDS_UCHAR(value)) {
+        return g_value_get_uchar(value);
+    }
+    if (G_VALUE_HOLDS_UINT64(value)) {
+        return static_cast<double>(g_value_get_uint64(value));
+    }
+    return {};
+}
+
+std::vector<const GstStructure*> source_structures(const GValue* source_stats)
+{
+    std::vector<const GstStructure*> result;
+
+    // "source-stats" is still a GValueArray.
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    auto* sources = static_cast<GValueArray*>(g_value_get_boxed(source_stats));
+    for (guint i = 0; sources != nullptr && i < sources->n_values; ++i) {
+        result.push_back(gst_value_get_structure(&sources->values[i]));
+    }
+    G_GNUC_END_IGNORE_DEPRECATIONS
+
+    return result;
+}
+
+std::string host_of(const std::string& address)
+{
+    const auto colon = address.rfind(':');
+    return colon == std::string::npos ? address : address.substr(0, colon);
+}
+
+} // namespace
+
+ClientStats::ClientStats(GstRTSPServer* server) :
+    _server(server)
+{
+    g_signal_connect(_server, "client-connected", G_CALLBACK(on_client_connected), this);
+    _poll_source = g_timeout_add_seconds(1, on_poll, this);
+}
+
+ClientStats::~ClientStats()
+{
+    if (_poll_source != 0) {
+        g_source_remove(_poll_source);
+    }
+
+    if (_service != nullptr) {
+        g_socket_service_stop(_service);
+        g_object_unref(_service);
+    }
+
+    g_signal_handlers_disconnect_by_data(_server, this);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto& [key, client] : _clients) {
+        g_signal_handlers_disconnect_by_data(client.client, this);
+        if (client.media != nullptr) {
+            g_object_unref(client.media);
+        }
+        g_object_unref(client.client);
+    }
+}
+
+void ClientStats::watch_factory(GstRTSPMediaFactory* factory)
+{
+    g_signal_connect(factory, "media-configure", G_CALLBACK(on_media_configure), this);
+}
+
+bool ClientStats::serve(unsigned port)
+{
+    _service = g_threaded_socket_service_new(2);
+
+    GInetAddress* loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GSocketAddress* address = g_inet_socket_address_new(loopback, static_cast<guint16>(port));
+    g_object_unref(loopback);
+
+    GError* error = nullptr;
+    const bool added = g_socket_listener_add_address(
+        G_SOCKET_LISTENER(_service), address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP,
+        nullptr, nullptr, &error);
+    g_object_unref(address);
+
+    if (!added) {
+        std::cerr << "Could not open stats endpoint on port " << port << ": " << error->message << std::endl;
+        g_error_free(error);
+        g_object_unref(_service);
+        _service = nullptr;
+        return false;
+    }
+
+    g_signal_connect(_service, "run", G_CALLBACK(on_stats_request), this);
+    g_socket_service_start(_service);
+    return true;
+}
+
+std::string ClientStats::report() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _report;
+}
+
+void ClientStats::on_client_connected(GstRTSPServer*, GstRTSPClient* client, gpointer user_data)
+{
+    auto* self = static_cast<ClientStats*>(user_data);
+
+    Client entry;
+    entry.client = GST_RTSP_CLIENT(g_object_ref(client));
+    entry.connected_us = g_get_monotonic_time();
+    if (GstRTSPConnection* connection = gst_rtsp_client_get_connection(client)) {
+        entry.address = gst_rtsp_connection_get_ip(connection);
+    }
+
+    g_signal_connect(client, "closed", G_CALLBACK(on_client_closed), self);
+    g_signal_connect(client, "play-request", G_CALLBACK(on_play_request), self);
+
+    std::lock_guard<std::mutex> lock(self->_mutex);
+    self->_clients[client] = std::move(entry);
+}
+
+void ClientStats::on_client_closed(GstRTSPClient* client, gpointer user_data)
+{
+    auto* self = static_cast<ClientStats*>(user_data);
+
+    std::lock_guard<std::mutex> lock(self->_mutex);
+    auto it = self->_clients.find(client);
+    if (it == self->_clients.end()) {
+        return;
+    }
+    g_signal_handlers_disconnect_by_data(client, self);
+    if (it->second.media != nullptr) {
+        g_object_unref(it->second.media);
+    }
+    g_object_unref(it->second.client);
+    self->_clients.erase(it);
+}
+
+void ClientStats::on_play_request(GstRTSPClient* client, GstRTSPContext* ctx, gpointer user_data)
+{
+    auto* self = static_cast<ClientStats*>(user_data);
+
+    if (ctx->sessmedia == nullptr) {
+        return;
+    }
+
+    GstRTSPMedia* media = gst_rtsp_session_media_get_media(ctx->sessmedia);
+    MediaCounters* counters = media_counters(media);
+
+    std::lock_guard<std::mutex> lock(self->_mutex);
+    auto it = self->_clients.find(client);
+    if (it == self->_clients.end() || it->second.media == media) {
+        // Unknown, or just resuming after a pause.
+        return;
+    }
+
+    Client& entry = it->second;
+    if (entry.media != nullptr) {
+        g_object_unref(entry.media);
+    }
+    entry.media = GST_RTSP_MEDIA(g_object_ref(media));
+    entry.bytes_offset = counters ? counters->bytes.load() : 0;
+    entry.packets_offset = counters ? counters->packets.load() : 0;
+
+    GstRTSPStreamTransport* stream_transport = gst_rtsp_session_media_get_transport(ctx->sessmedia, 0);
+    const GstRTSPTransport* transport =
+        stream_transport ? gst_rtsp_stream_transport_get_transport(stream_transport) : nullptr;
+    if (transport == nullptr) {
+        return;
+    }
+
+    switch (transport->lower_transport) {
+        case GST_RTSP_LOWER_TRANS_UDP:
+            entry.transport = "udp";
+            entry.rtcp_from = entry.address + ":" + std::to_string(transport->client_port.max);
+            break;
+        case GST_RTSP_LOWER_TRANS_UDP_MCAST:
+            entry.transport = "multicast";
+            break;
+        case GST_RTSP_LOWER_TRANS_TCP:
+            entry.transport = "tcp";
+            break;
+        default:
+            entry.transport = "unknown";
+            break;
+    }
+}
+
+void ClientStats::on_media_configure(GstRTSPMediaFactory*, GstRTSPMedia* media, gpointer)
+{
+    GstElement* element = gst_rtsp_media_get_element(media);
+    GstElement* pay = gst_bin_get_by_name(GST_BIN(element), "pay0");
+    gst_object_unref(element);
+
+    if (pay == nullptr) {
+        return;
+    }
+
+    auto* counters = new MediaCounters{};
+    g_object_set_data_full(G_OBJECT(media), media_counters_key, counters, delete_media_counters);
+
+    GstPad* sink = gst_element_get_static_pad(pay, "sink");
+    gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, on_pay_sink, counters, nullptr);
+    gst_object_unref(sink);
+
+    GstPad* src = gst_element_get_static_pad(pay, "src");
+    gst_pad_add_probe(
+        src, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        on_pay_src, counters, nullptr);
+    gst_object_unref(src);
+
+    gst_object_unref(pay);
+}
+
+gboolean ClientStats::on_poll(gpointer user_data)
+{
+    static_cast<ClientStats*>(user_data)->poll();
+    return G_SOURCE_CONTINUE;
+}
+
+void ClientStats::poll()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const gint64 now_us = g_get_monotonic_time();
+
+    for (auto& [key, client] : _clients) {
+        update_send_queue(client);
+
+        if (client.media == nullptr) {
+            continue;
+        }
+
+        if (MediaCounters* counters = media_counters(client.media)) {
+            client.bytes_sent = counters->bytes - client.bytes_offset;
+            client.packets_sent = counters->packets - client.packets_offset;
+            const gint64 last_keyframe_us = counters->last_keyframe_us;
+            client.keyframe_age_ms = last_keyframe_us < 0 ? -1 : (now_us - last_keyframe_us) / 1000;
+        }
+
+        update_rtcp(client);
+    }
+
+    _report = format_locked();
+
+    if (_log_interval_s == 0 || ++_polls_since_log < _log_interval_s) {
+        return;
+    }
+    _polls_since_log = 0;
+
+    if (!_clients.empty()) {
+        std::cout << "Stats: " << _report << std::flush;
+    }
+}
+
+void ClientStats::update_rtcp(Client& client)
+{
+    GstRTSPStream* stream = gst_rtsp_media_get_stream(client.media, 0);
+    if (stream == nullptr) {
+        return;
+    }
+
+    GObject* session = gst_rtsp_stream_get_rtpsession(stream);
+    if (session == nullptr) {
+        return;
+    }
+
+    GstStructure* stats = nullptr;
+    g_object_get(session, "stats", &stats, nullptr);
+    g_object_unref(session);
+
+    if (stats == nullptr) {
+        return;
+    }
+
+    const GValue* source_stats = gst_structure_get_value(stats, "source-stats");
+    if (source_stats == nullptr) {
+        gst_structure_free(stats);
+        return;
+    }
+
+    double clock_rate = default_clock_rate;
+    const GstStructure* by_port = nullptr;
+    const GstStructure* by_host = nullptr;
+    unsigned by_host_count = 0;
+    const GstStructure* only_remote = nullptr;
+    unsigned remote_count = 0;
+
+    for (const GstStructure* source : source_structures(source_stats)) {
+        gboolean internal = FALSE;
+        gst_structure_get_boolean(source, "internal", &internal);
+        if (internal) {
+            const auto rate = get_number(source, "clock-rate");
+            if (rate && *rate > 0) {
+                clock_rate = *rate;
+            }
+            continue;
+        }
+
+        ++remote_count;
+        only_remote = source;
+
+        const gchar* rtcp_from = gst_structure_get_string(source, "rtcp-from");
+        if (rtcp_from == nullptr) {
+            continue;
+        }
+        if (!client.rtcp_from.empty() && client.rtcp_from == rtcp_from) {
+            by_port = source;
+        }
+        if (host_of(rtcp_from) == client.address) {
+            ++by_host_count;
+            by_host = source;
+        }
+    }
+
+    // With a shared media all clients are in the same RTP session, so we need to find the
+    // one which is ours. RTCP over TCP does not carry an address, so if we're alone, that's us.
+    const GstStructure* source = by_port;
+    if (source == nullptr && by_host_count == 1) {
+        source = by_host;
+    }
+    if (source == nullptr && remote_count == 1) {
+        source = only_remote;
+    }
+
+    gboolean have_rb = FALSE;
+    if (source != nullptr && gst_structure_get_boolean(source, "have-rb", &have_rb) && have_rb) {
+        client.fraction_lost = get_number(source, "rb-fractionlost").value_or(0.0) / 256.0;
+        client.packets_lost = static_cast<gint64>(get_number(source, "rb-packetslost").value_or(0.0));
+        client.jitter_ms = get_number(source, "rb-jitter").value_or(0.0) / clock_rate * 1000.0;
+    }
+
+    gst_structure_free(stats);
+}
+
+void ClientStats::update_send_queue(Client& client)
+{
+    GstRTSPConnection* connection = gst_rtsp_client_get_connection(client.client);
+    if (connection == nullptr) {
+        return;
+    }
+
+    GSocket* socket = gst_rtsp_connection_get_write_socket(connection);
+    if (socket == nullptr) {
+        return;
+    }
+
+    int queued = 0;
+    if (ioctl(g_socket_get_fd(socket), SIOCOUTQ, &queued) == 0 && queued >= 0) {
+        client.send_queue_bytes = static_cast<guint64>(queued);
+    }
+}
+
+std::string ClientStats::format_locked() const
+{
+    const gint64 now_us = g_get_monotonic_time();
+
+    std::ostringstream str;
+    str << "clients=" << _clients.size() << '\n';
+
+    if (_report_extra) {
+        str << _report_extra() << '\n';
+    }
+
+    for (const auto& [key, client] : _clients) {
+        char fraction_lost[16];
+        char jitter_ms[16];
+        std::snprintf(fraction_lost, sizeof(fraction_lost), "%.3f", client.fraction_lost);
+        std::snprintf(jitter_ms, sizeof(jitter_ms), "%.1f", client.jitter_ms);
+
+        str << "client=" << client.address
+            << " transport=" << (client.transport.empty() ? "none" : client.transport)
+            << " uptime_s=" << (now_us - client.connected_us) / G_USEC_PER_SEC
+            << " bytes=" << client.bytes_sent
+            << " packets=" << client.packets_sent
+            << " fraction_lost=" << fraction_lost
+            << " packets_lost=" << client.packets_lost
+            << " jitter_ms=" << jitter_ms
+            << " send_queue=" << client.send_queue_bytes
+            << " keyframe_age_ms=" << client.keyframe_age_ms
+            << '\n';
+    }
+
+    return str.str();
+}
+
+gboolean ClientStats::on_stats_request(
+    GThreadedSocketService*, GSocketConnection* connection, GObject*, gpointer user_data)
+{
+    auto* self = static_cast<ClientStats*>(user_data);
+
+    // We answer every request the same way, but read what was sent so closing the
+    // socket does not reset the connection. Don't wait forever for clients like
+    // netcat which don't send anything.
+    g_socket_set_timeout(g_socket_connection_get_socket(connection), 1);
+    char request[1024];
+    (void)g_input_stream_read(
+        g_io_stream_get_input_stream(G_IO_STREAM(connection)), request, sizeof(request), nullptr, nullptr);
+
+    const std::string body = self->report();
+    const std::string response =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "\r\n" + body;
+
+    (void)g_output_stream_write_all(
+        g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+        response.data(), response.size(), nullptr, nullptr, nullptr);
+    (void)g_io_stream_close(G_IO_STREAM(connection), nullptr, nullptr);
+
+    return TRUE;
+}
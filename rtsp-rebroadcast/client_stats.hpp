@@ -0,0 +1,90 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Per-client streaming statistics.
+//
+// Clients are tracked using the RTSP server's client signals. Sent bytes and
+// packets are counted at the payloader of the media a client is playing, loss
+// and jitter are taken from the RTCP receiver reports the client sends back,
+// and the send queue is the kernel backlog of the client's RTSP socket (which
+// is what matters for RTSP over TCP).
+//
+// The numbers are refreshed once per second. They can be fetched from a local
+// TCP endpoint (plain text, HTTP/1.0 framing so curl works too) and a compact
+// summary can be logged periodically.
+
+class ClientStats {
+public:
+    explicit ClientStats(GstRTSPServer* server);
+    ~ClientStats();
+
+    ClientStats(const ClientStats&) = delete;
+    ClientStats& operator=(const ClientStats&) = delete;
+
+    // Needs to be called for every factory whose clients we want to track.
+    void watch_factory(GstRTSPMediaFactory* factory);
+
+    // Serve the report on 127.0.0.1:port.
+    [[nodiscard]] bool serve(unsigned port);
+
+    // Log a summary every interval_s seconds, 0 to disable.
+    void set_log_interval(unsigned interval_s) { _log_interval_s = interval_s; }
+
+    // Additional line for the report, called with every refresh.
+    void set_report_extra(std::function<std::string()> extra) { _report_extra = std::move(extra); }
+
+    [[nodiscard]] std::string report() const;
+
+private:
+    struct Client {
+        GstRTSPClient* client{nullptr};
+        GstRTSPMedia* media{nullptr};
+        std::string address;
+        std::string transport;
+        // Where we expect the RTCP receiver reports from, "ip:port".
+        std::string rtcp_from;
+        gint64 connected_us{0};
+        guint64 bytes_offset{0};
+        guint64 packets_offset{0};
+
+        guint64 bytes_sent{0};
+        guint64 packets_sent{0};
+        double fraction_lost{0.0};
+        gint64 packets_lost{0};
+        double jitter_ms{0.0};
+        guint64 send_queue_bytes{0};
+        gint64 keyframe_age_ms{-1};
+    };
+
+    static void on_client_connected(GstRTSPServer* server, GstRTSPClient* client, gpointer user_data);
+    static void on_client_closed(GstRTSPClient* client, gpointer user_data);
+    static void on_play_request(GstRTSPClient* client, GstRTSPContext* ctx, gpointer user_data);
+    static void on_media_configure(GstRTSPMediaFactory* factory, GstRTSPMedia* media, gpointer user_data);
+    static gboolean on_poll(gpointer user_data);
+    static gboolean on_stats_request(
+        GThreadedSocketService* service, GSocketConnection* connection, GObject* source, gpointer user_data);
+
+    void poll();
+    static void update_rtcp(Client& client);
+    static void update_send_queue(Client& client);
+    [[nodiscard]] std::string format_locked() const;
+
+    GstRTSPServer* _server{nullptr};
+    GSocketService* _service{nullptr};
+    guint _poll_source{0};
+    unsigned _log_interval_s{0};
+    unsigned _polls_since_log{0};
+    std::function<std::string()> _report_extra;
+
+    mutable std::mutex _mutex;
+    std::map<GstRTSPClient*, Client> _clients;
+    std::string _report;
+};
@@ -0,0 +1,132 @@
+#include "recorder.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <system_error>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr const char* segment_prefix = "rec-";
+
+} // namespace
+
+Recorder::Recorder(fs::path directory, Format format, unsigned segment_s, std::uint64_t quota_bytes) :
+    _directory(std::move(directory)),
+    _format(format),
+    _segment_s(segment_s),
+    _quota_bytes(quota_bytes)
+{
+}
+
+Recorder::~Recorder()
+{
+    if (_quota_source != 0) {
+        g_source_remove(_quota_source);
+    }
+}
+
+bool Recorder::start()
+{
+    std::error_code ec;
+    fs::create_directories(_directory, ec);
+    if (ec) {
+        std::cerr << "Could not create recording directory " << _directory << ": " << ec.message() << std::endl;
+        return false;
+    }
+
+    enforce_quota();
+    _quota_source = g_timeout_add_seconds(quota_check_interval_s, on_check_quota, this);
+
+    std::cout << "Recording to " << _directory << " in segments of " << _segment_s
+              << " s, keeping at most " << _quota_bytes / (1024 * 1024) << " MiB" << std::endl;
+    return true;
+}
+
+std::string Recorder::branch(const std::string& codec) const
+{
+    // Name segments by the start time, with milliseconds as reconnects can be quick.
+    const gint64 now_us = g_get_real_time();
+    const std::time_t now_s = static_cast<std::time_t>(now_us / G_USEC_PER_SEC);
+    std::tm tm{};
+    localtime_r(&now_s, &tm);
+    char start_time[32];
+    const auto len = std::strftime(start_time, sizeof(start_time), "%Y%m%d-%H%M%S", &tm);
+    std::snprintf(start_time + len, sizeof(start_time) - len, ".%03d",
+                  static_cast<int>((now_us / 1000) % 1000));
+
+    const char* extension = (_format == Format::Mkv ? ".mkv" : ".mp4");
+    const char* muxer = (_format == Format::Mkv ? "matroskamux" : "mp4mux");
+    const char* parser = (codec == "h264" ? "h264parse" : "h265parse");
+
+    const fs::path location = _directory / (std::string(segment_prefix) + start_time + "-%05d" + extension);
+
+    return "queue max-size-buffers=0 max-size-bytes=0 max-size-time=" + std::to_string(queue_max_time_ns) +
+        " leaky=downstream ! " + parser + " ! splitmuxsink muxer-factory=" + muxer +
+        " max-size-time=" + std::to_string(_segment_s * GST_SECOND) +
+        " location=\"" + location.string() + "\"";
+}
+
+gboolean Recorder::on_check_quota(gpointer user_data)
+{
+    static_cast<const Recorder*>(user_data)->enforce_quota();
+    return G_SOURCE_CONTINUE;
+}
+
+bool Recorder::is_segment(const fs::path& path) const
+{
+    const auto name = path.filename().string();
+    return name.rfind(segment_prefix, 0) == 0 &&
+        (path.extension() == ".mkv" || path.extension() == ".mp4");
+}
+
+void Recorder::enforce_quota() const
+{
+    struct Segment {
+        fs::path path;
+        fs::file_time_type modified;
+        std::uintmax_t size;
+    };
+
+    std::vector<Segment> segments;
+    std::uint64_t total_bytes = 0;
+
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(_directory, ec)) {
+        if (!entry.is_regular_file(ec) || !is_segment(entry.path())) {
+            continue;
+        }
+        const auto size = entry.file_size(ec);
+        if (ec) {
+            continue;
+        }
+        const auto modified = entry.last_write_time(ec);
+        if (ec) {
+            continue;
+        }
+        segments.push_back({entry.path(), modified, size});
+        total_bytes += size;
+    }
+
+    if (total_bytes <= _quota_bytes) {
+        return;
+    }
+
+    std::sort(segments.begin(), segments.end(), [](const Segment& lhs, const Segment& rhs) {
+        return lhs.modified < rhs.modified;
+    });
+
+    // The newest one is the one currently being written, so that one stays.
+    for (std::size_t i = 0; i + 1 < segments.size() && total_bytes > _quota_bytes; ++i) {
+        if (fs::remove(segments[i].path, ec)) {
+            std::cout << "Recording quota reached, deleted " << segments[i].path << std::endl;
+            total_bytes -= segments[i].size;
+        } else if (ec) {
+            std::cerr << "Could not delete " << segments[i].path << ": " << ec.message() << std::endl;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+// Local recording of the camera stream.
+//
+// The parsed stream is written as is, without re-encoding, into segments
+// using splitmuxsink. A leaky queue in front of it drops data if the disk
+// can't keep up, rather than holding up the live stream.
+//
+// Once the recordings use more than the quota, the oldest segments are
+// deleted.
+
+class Recorder {
+public:
+    enum class Format {
+        Mkv,
+        Mp4,
+    };
+
+    Recorder(std::filesystem::path directory, Format format, unsigned segment_s, std::uint64_t quota_bytes);
+    ~Recorder();
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    [[nodiscard]] bool start();
+
+    // Branch for the Upstream pipeline. Every time it is built, a new set of
+    // segments is started, so nothing gets overwritten after a reconnect.
+    [[nodiscard]] std::string branch(const std::string& codec) const;
+
+private:
+    static constexpr guint quota_check_interval_s = 2;
+    // How much the queue holds before dropping when the disk is too slow.
+    static constexpr guint64 queue_max_time_ns = 2 * GST_SECOND;
+
+    static gboolean on_check_quota(gpointer user_data);
+    void enforce_quota() const;
+    [[nodiscard]] bool is_segment(const std::filesystem::path& path) const;
+
+    const std::filesystem::path _directory;
+    const Format _format;
+    const unsigned _segment_s;
+    const std::uint64_t _quota_bytes;
+    guint _quota_source{0};
+};
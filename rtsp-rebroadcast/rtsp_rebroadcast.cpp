@@ -1,27 +1,87 @@
+#include <glib-unix.h>
 #include <gst/gst.h>
 #include <gst/rtsp-server/rtsp-server.h>
 #include <string>
 #include <iostream>
+#include <memory>
+#include <vector>
+#include <cstdlib>
 #include <cstring>
+#include <csignal>
+
+#include "client_stats.hpp"
+#include "recorder.hpp"
+#include "upstream.hpp"
 
 // RTSP re-broadcast using gstreamer.
 //
 // This application subscribes to the RTSP stream of the SIYI A8 mini
-// and directly rebroadcasts the H265 stream as an RTSP server.
+// and directly rebroadcasts the H264 or H265 stream as an RTSP server.
+//
+// The camera stream is received once (see Upstream) and then payloaded
+// for the RTSP server's clients, so the connection to the camera can be
+// re-established without the clients noticing more than a frozen image.
 //
 // Source mostly taken from:
 // https://github.com/JonasVautherin/px4-gazebo-headless/tree/master/sitl_rtsp_proxy
 
 void print_usage(const char* program_name) {
-    std::cout << "Usage: " << program_name << " --codec <h264|h265> [options]\n";
+    std::cout << "Usage: " << program_name << " [options]\n";
     std::cout << "Options:\n";
-    std::cout << "  --codec <h264|h265>  Video codec to use (required)\n";
-    std::cout << "  --help               Show this help message\n";
+    std::cout << "  --codec <h264|h265>         Codec to expect until it is detected (default h265)\n";
+    std::cout << "  --multicast <group>         Also serve /live-multicast using RTSP negotiated multicast to this group\n";
+    std::cout << "  --multicast-ttl <ttl>       TTL of multicast packets (default 1)\n";
+    std::cout << "  --mpegts-udp <host:port>    Also send MPEG-TS over UDP, e.g. to a multicast group\n";
+    std::cout << "  --srt-listen <port>         Also serve MPEG-TS over SRT, waiting for a caller on this port\n";
+    std::cout << "  --srt-call <host:port>      Also send MPEG-TS over SRT, calling a listener there\n";
+    std::cout << "  --srt-latency <ms>          SRT latency window for retransmissions (default 500)\n";
+    std::cout << "  --record <directory>        Record the stream to segments in this directory\n";
+    std::cout << "  --record-format <mkv|mp4>   Container of the recording segments (default mkv)\n";
+    std::cout << "  --record-segment <seconds>  Length of recording segments (default 60)\n";
+    std::cout << "  --record-quota-mb <size>    Delete the oldest segments beyond this size (default 4096)\n";
+    std::cout << "  --gop-cache-kb <size>       Memory limit of the keyframe cache for new clients (default 2048)\n";
+    std::cout << "  --stats-port <port>         Local port serving per-client stats, 0 to disable (default 8555)\n";
+    std::cout << "  --stats-interval <seconds>  Log per-client stats periodically, 0 to disable (default 10)\n";
+    std::cout << "  --help                      Show this help message\n";
+}
+
+static bool parse_unsigned(const char* str, unsigned& value) {
+    char* end = nullptr;
+    const unsigned long result = std::strtoul(str, &end, 10);
+    if (end == str || *end != '\0' || result > 65535) {
+        return false;
+    }
+    value = static_cast<unsigned>(result);
+    return true;
+}
+
+static bool parse_host_port(const char* str, std::string& host, unsigned& port) {
+    const std::string host_port{str};
+    const auto colon = host_port.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    host = host_port.substr(0, colon);
+    return parse_unsigned(host_port.c_str() + colon + 1, port) && port != 0;
 }
 
 int main(int argc, char* argv[]) {
-    std::string codec;
-    bool codec_specified = false;
+    std::string codec = "h265";
+    std::string multicast_group;
+    unsigned multicast_ttl = 1;
+    std::string mpegts_host;
+    unsigned mpegts_port = 0;
+    unsigned srt_listen_port = 0;
+    std::string srt_call_host;
+    unsigned srt_call_port = 0;
+    unsigned srt_latency_ms = 500;
+    std::string record_directory;
+    Recorder::Format record_format = Recorder::Format::Mkv;
+    unsigned record_segment_s = 60;
+    unsigned record_quota_mb = 4096;
+    unsigned gop_cache_kb = 2048;
+    unsigned stats_port = 8555;
+    unsigned stats_interval_s = 10;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--help") == 0) {
@@ -34,12 +94,108 @@ int main(int argc, char* argv[]) {
                     std::cerr << "Error: Invalid codec '" << codec << "'. Use 'h264' or 'h265'.\n";
                     return 1;
                 }
-                codec_specified = true;
                 i++;
             } else {
                 std::cerr << "Error: --codec requires an argument\n";
                 return 1;
             }
+        } else if (strcmp(argv[i], "--multicast") == 0) {
+            if (i + 1 < argc) {
+                multicast_group = argv[i + 1];
+                i++;
+            } else {
+                std::cerr << "Error: --multicast requires a group address\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--multicast-ttl") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], multicast_ttl) && multicast_ttl <= 255) {
+                i++;
+            } else {
+                std::cerr << "Error: --multicast-ttl requires a value from 0 to 255\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--mpegts-udp") == 0) {
+            if (i + 1 < argc && parse_host_port(argv[i + 1], mpegts_host, mpegts_port)) {
+                i++;
+            } else {
+                std::cerr << "Error: --mpegts-udp requires <host:port>\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--srt-listen") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], srt_listen_port) && srt_listen_port != 0) {
+                i++;
+            } else {
+                std::cerr << "Error: --srt-listen requires a port number\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--srt-call") == 0) {
+            if (i + 1 < argc && parse_host_port(argv[i + 1], srt_call_host, srt_call_port)) {
+                i++;
+            } else {
+                std::cerr << "Error: --srt-call requires <host:port>\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--srt-latency") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], srt_latency_ms)) {
+                i++;
+            } else {
+                std::cerr << "Error: --srt-latency requires a number of milliseconds\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--record") == 0) {
+            if (i + 1 < argc) {
+                record_directory = argv[i + 1];
+                i++;
+            } else {
+                std::cerr << "Error: --record requires a directory\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--record-format") == 0) {
+            if (i + 1 < argc && strcmp(argv[i + 1], "mkv") == 0) {
+                record_format = Recorder::Format::Mkv;
+                i++;
+            } else if (i + 1 < argc && strcmp(argv[i + 1], "mp4") == 0) {
+                record_format = Recorder::Format::Mp4;
+                i++;
+            } else {
+                std::cerr << "Error: --record-format requires 'mkv' or 'mp4'\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--record-segment") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], record_segment_s) && record_segment_s > 0) {
+                i++;
+            } else {
+                std::cerr << "Error: --record-segment requires a number of seconds\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--record-quota-mb") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], record_quota_mb) && record_quota_mb > 0) {
+                i++;
+            } else {
+                std::cerr << "Error: --record-quota-mb requires a size in MiB\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--gop-cache-kb") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], gop_cache_kb)) {
+                i++;
+            } else {
+                std::cerr << "Error: --gop-cache-kb requires a size in KiB\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats-port") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], stats_port)) {
+                i++;
+            } else {
+                std::cerr << "Error: --stats-port requires a port number\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats-interval") == 0) {
+            if (i + 1 < argc && parse_unsigned(argv[i + 1], stats_interval_s)) {
+                i++;
+            } else {
+                std::cerr << "Error: --stats-interval requires a number of seconds\n";
+                return 1;
+            }
         } else {
             std::cerr << "Error: Unknown option '" << argv[i] << "'\n";
             print_usage(argv[0]);
@@ -47,12 +203,6 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (!codec_specified) {
-        std::cerr << "Error: --codec argument is required\n";
-        print_usage(argv[0]);
-        return 1;
-    }
-
     gst_init(&argc, &argv);
 
     GMainLoop* main_loop = g_main_loop_new(NULL, false);
@@ -65,26 +215,118 @@ int main(int argc, char* argv[]) {
     GstRTSPServer* server = gst_rtsp_server_new();
     g_object_set(server, "service", "8554", NULL);
 
-    std::string source = "rtspsrc location=rtsp://192.168.144.25:8554/main.264 latency=0 ! ";
-    std::string repaying;
+    Upstream upstream{"rtsp://192.168.144.25:8554/main.264", codec, gop_cache_kb * std::size_t{1024}};
 
-    if (codec == "h264") {
-        repaying = "rtph264depay ! rtph264pay name=pay0 pt=96";
-    } else {
-        repaying = "rtph265depay ! rtph265pay name=pay0 pt=97";
+    // For viewers which don't speak RTSP, we can push MPEG-TS to a (multicast) address,
+    // and over SRT which retransmits what gets lost within the latency window.
+    // All of them share one muxer.
+    std::vector<std::string> mpegts_outputs;
+    if (!mpegts_host.empty()) {
+        mpegts_outputs.push_back(
+            "udpsink host=" + mpegts_host + " port=" + std::to_string(mpegts_port) +
+            " ttl-mc=" + std::to_string(multicast_ttl) + " auto-multicast=true sync=false");
+    }
+    // Without a connection, srtsink drops rather than blocking the other outputs.
+    if (srt_listen_port != 0) {
+        mpegts_outputs.push_back(
+            "srtsink uri=\"srt://:" + std::to_string(srt_listen_port) + "?mode=listener\"" +
+            " latency=" + std::to_string(srt_latency_ms) + " wait-for-connection=false sync=false");
+    }
+    if (!srt_call_host.empty()) {
+        mpegts_outputs.push_back(
+            "srtsink uri=\"srt://" + srt_call_host + ":" + std::to_string(srt_call_port) + "?mode=caller\"" +
+            " latency=" + std::to_string(srt_latency_ms) + " wait-for-connection=false sync=false");
     }
 
-    std::string launch_string = source + repaying;
+    if (!mpegts_outputs.empty()) {
+        std::string branch = "queue max-size-time=500000000 leaky=downstream ! mpegtsmux alignment=7";
+        if (mpegts_outputs.size() == 1) {
+            branch += " ! " + mpegts_outputs.front();
+        } else {
+            branch += " ! tee name=ts";
+            for (const auto& output : mpegts_outputs) {
+                branch += " ts. ! queue max-size-time=500000000 leaky=downstream ! " + output;
+            }
+        }
+        upstream.add_branch(branch);
+    }
 
+    // Recording is just another branch, without re-encoding.
+    std::unique_ptr<Recorder> recorder;
+    if (!record_directory.empty()) {
+        recorder = std::make_unique<Recorder>(
+            record_directory, record_format, record_segment_s,
+            record_quota_mb * std::uint64_t{1024 * 1024});
+        if (!recorder->start()) {
+            return 1;
+        }
+        upstream.add_branch([&recorder](const std::string& stream_codec) { return recorder->branch(stream_codec); });
+    }
+
+    const std::string launch_string = upstream.media_launch();
+
+    // Every client gets its own media, so it can be started with the cached keyframe
+    // and following frames. It's only payloading, the camera stream is still received once.
     GstRTSPMediaFactory* factory = gst_rtsp_media_factory_new();
     gst_rtsp_media_factory_set_launch(factory, launch_string.c_str());
-    gst_rtsp_media_factory_set_shared(factory, true);
+    upstream.serve(factory);
+
+    ClientStats client_stats{server};
+    client_stats.watch_factory(factory);
+    client_stats.set_log_interval(stats_interval_s);
+    client_stats.set_report_extra([&]() { return upstream.gop_cache_status(); });
+    if (stats_port != 0 && !client_stats.serve(stats_port)) {
+        return 1;
+    }
 
     GstRTSPMountPoints* mount_points = gst_rtsp_server_get_mount_points(server);
     gst_rtsp_mount_points_add_factory(mount_points, "/live", factory);
+
+    // With multicast, the stream is sent once no matter how many clients join.
+    if (!multicast_group.empty()) {
+        GstRTSPAddressPool* pool = gst_rtsp_address_pool_new();
+        if (!gst_rtsp_address_pool_add_range(
+                pool, multicast_group.c_str(), multicast_group.c_str(), 5000, 5010, multicast_ttl)) {
+            std::cerr << "Error: Invalid multicast group '" << multicast_group << "'\n";
+            return 1;
+        }
+
+        GstRTSPMediaFactory* multicast_factory = gst_rtsp_media_factory_new();
+        gst_rtsp_media_factory_set_launch(multicast_factory, launch_string.c_str());
+        gst_rtsp_media_factory_set_shared(multicast_factory, true);
+        gst_rtsp_media_factory_set_address_pool(multicast_factory, pool);
+        gst_rtsp_media_factory_set_protocols(multicast_factory, GST_RTSP_LOWER_TRANS_UDP_MCAST);
+        g_object_unref(pool);
+
+        upstream.serve(multicast_factory);
+        client_stats.watch_factory(multicast_factory);
+        gst_rtsp_mount_points_add_factory(mount_points, "/live-multicast", multicast_factory);
+    }
     g_object_unref(mount_points);
 
+    // The clients' sessions were set up for the previous codec, so they are closed
+    // and have to reconnect, which gets them the new one.
+    upstream.set_codec_changed_callback([server](const std::string&) {
+        g_list_free(gst_rtsp_server_client_filter(
+            server,
+            [](GstRTSPServer*, GstRTSPClient*, gpointer) { return GST_RTSP_FILTER_REMOVE; },
+            nullptr));
+    });
+
+    upstream.start();
+
     gst_rtsp_server_attach(server, NULL);
 
+    // On shutdown, leaving main lets Upstream finish the recording segment.
+    const auto quit = [](gpointer user_data) -> gboolean {
+        g_main_loop_quit(static_cast<GMainLoop*>(user_data));
+        return G_SOURCE_REMOVE;
+    };
+    g_unix_signal_add(SIGINT, quit, main_loop);
+    g_unix_signal_add(SIGTERM, quit, main_loop);
+
     g_main_loop_run(main_loop);
+
+    g_main_loop_unref(main_loop);
+    return 0;
 }
@@ -0,0 +1,566 @@
+#include "upstream.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+// A media which isn't consuming, e.g. paused, does not get more than this queued.
+constexpr guint64 appsrc_max_bytes = 2 * 1024 * 1024;
+
+// The media pipelines run on their own clock and base time, so we let
+// the appsrc timestamp the buffers on arrival. The copy is shallow, the
+// memory is shared.
+GstBuffer* retimestamped(GstBuffer* buffer, bool discont)
+{
+    GstBuffer* copy = gst_buffer_copy(buffer);
+    GST_BUFFER_PTS(copy) = GST_CLOCK_TIME_NONE;
+    GST_BUFFER_DTS(copy) = GST_CLOCK_TIME_NONE;
+    if (discont) {
+        GST_BUFFER_FLAG_SET(copy, GST_BUFFER_FLAG_DISCONT);
+    }
+    return copy;
+}
+
+void push_to(GstAppSrc* appsrc, GstBuffer* buffer, bool discont)
+{
+    if (gst_app_src_get_current_level_bytes(appsrc) > appsrc_max_bytes) {
+        return;
+    }
+    gst_app_src_push_buffer(appsrc, retimestamped(buffer, discont));
+}
+
+} // namespace
+
+Upstream::Upstream(std::string location, std::string codec, std::size_t gop_cache_limit_bytes) :
+    _location(std::move(location)),
+    _codec(std::move(codec)),
+    _gop_cache_limit_bytes(gop_cache_limit_bytes)
+{
+}
+
+Upstream::~Upstream()
+{
+    if (_reconnect_source != 0) {
+        g_source_remove(_reconnect_source);
+    }
+    if (_watchdog_source != 0) {
+        g_source_remove(_watchdog_source);
+    }
+
+    disconnect();
+
+    for (auto* factory : _factories) {
+        g_signal_handlers_disconnect_by_data(factory, this);
+        g_object_unref(factory);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto& [media, appsrc] : _appsrcs) {
+        g_signal_handlers_disconnect_by_data(media, this);
+        gst_object_unref(appsrc);
+        g_object_unref(media);
+    }
+    gst_caps_replace(&_caps, nullptr);
+    gst_buffer_replace(&_last_keyframe, nullptr);
+    clear_gop_cache();
+}
+
+void Upstream::add_branch(const std::string& branch)
+{
+    _branches.emplace_back([branch](const std::string&) { return branch; });
+}
+
+void Upstream::add_branch(std::function<std::string(const std::string& codec)> branch)
+{
+    _branches.push_back(std::move(branch));
+}
+
+std::string Upstream::media_launch() const
+{
+    const std::string source = "appsrc name=src is-live=true format=time do-timestamp=true ! ";
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_codec == "h264") {
+        return source + "rtph264pay name=pay0 pt=96 config-interval=-1";
+    } else {
+        return source + "rtph265pay name=pay0 pt=97 config-interval=-1";
+    }
+}
+
+void Upstream::serve(GstRTSPMediaFactory* factory)
+{
+    g_signal_connect(factory, "media-configure", G_CALLBACK(on_media_configure), this);
+    _factories.push_back(GST_RTSP_MEDIA_FACTORY(g_object_ref(factory)));
+}
+
+void Upstream::start()
+{
+    _watchdog_source = g_timeout_add(hold_interval_ms, on_watchdog, this);
+
+    if (!connect()) {
+        schedule_reconnect("could not connect");
+    }
+}
+
+bool Upstream::connect()
+{
+    std::string codec;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        codec = _codec;
+    }
+
+    std::string parsing;
+    if (codec == "h264") {
+        parsing = "rtph264depay ! h264parse config-interval=-1 ! "
+                  "video/x-h264,stream-format=byte-stream,alignment=au";
+    } else {
+        parsing = "rtph265depay ! h265parse config-interval=-1 ! "
+                  "video/x-h265,stream-format=byte-stream,alignment=au";
+    }
+
+    std::string launch =
+        "rtspsrc name=camera location=" + _location + " latency=0 tcp-timeout=2000000 ! " + parsing +
+        " ! tee name=t allow-not-linked=true"
+        " t. ! queue max-size-buffers=8 leaky=downstream ! appsink name=clients sync=false max-buffers=8 drop=true";
+
+    for (const auto& branch : _branches) {
+        launch += " t. ! " + branch(codec);
+    }
+
+    GError* error = nullptr;
+    GstElement* pipeline = gst_parse_launch(launch.c_str(), &error);
+    if (pipeline == nullptr) {
+        std::cerr << "Could not create camera pipeline: " << error->message << std::endl;
+        g_error_free(error);
+        return false;
+    }
+    if (error != nullptr) {
+        std::cerr << "Camera pipeline: " << error->message << std::endl;
+        g_clear_error(&error);
+    }
+
+    GstElement* rtspsrc = gst_bin_get_by_name(GST_BIN(pipeline), "camera");
+    g_signal_connect(rtspsrc, "select-stream", G_CALLBACK(on_select_stream), this);
+    gst_object_unref(rtspsrc);
+
+    GstElement* appsink = gst_bin_get_by_name(GST_BIN(pipeline), "clients");
+    GstAppSinkCallbacks callbacks{};
+    callbacks.new_sample = on_new_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, this, nullptr);
+    gst_object_unref(appsink);
+
+    GstBus* bus = gst_element_get_bus(pipeline);
+    gst_bus_add_watch(bus, on_bus_message, this);
+    gst_object_unref(bus);
+
+    _pipeline = pipeline;
+    _connected_us = g_get_monotonic_time();
+
+    if (gst_element_set_state(_pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        disconnect();
+        return false;
+    }
+
+    return true;
+}
+
+void Upstream::disconnect()
+{
+    if (_pipeline == nullptr) {
+        return;
+    }
+
+    GstBus* bus = gst_element_get_bus(_pipeline);
+    gst_bus_remove_watch(bus);
+    // Without any data, nothing was written.
+    if (_last_sample_us > _connected_us) {
+        finish_recordings(bus);
+    }
+    gst_object_unref(bus);
+
+    gst_element_set_state(_pipeline, GST_STATE_NULL);
+    gst_object_unref(_pipeline);
+    _pipeline = nullptr;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _discont = true;
+    // What comes after the reconnect won't reference it. The last keyframe
+    // stays to hold the image in the meantime.
+    clear_gop_cache();
+    _gop_cache_complete = false;
+}
+
+void Upstream::finish_recordings(GstBus* bus)
+{
+    std::vector<GstElement*> splitmuxsinks;
+    GstIterator* it = gst_bin_iterate_recurse(GST_BIN(_pipeline));
+    GValue item = G_VALUE_INIT;
+    bool done = false;
+    while (!done) {
+        switch (gst_iterator_next(it, &item)) {
+            case GST_ITERATOR_OK: {
+                auto* element = GST_ELEMENT(g_value_get_object(&item));
+                GstElementFactory* factory = gst_element_get_factory(element);
+                if (factory != nullptr &&
+                    g_strcmp0(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), "splitmuxsink") == 0) {
+                    splitmuxsinks.push_back(GST_ELEMENT(gst_object_ref(element)));
+                }
+                g_value_reset(&item);
+                break;
+            }
+            case GST_ITERATOR_RESYNC:
+                for (auto* element : splitmuxsinks) {
+                    gst_object_unref(element);
+                }
+                splitmuxsinks.clear();
+                gst_iterator_resync(it);
+                break;
+            default:
+                done = true;
+                break;
+        }
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+
+    if (splitmuxsinks.empty()) {
+        return;
+    }
+
+    // The end of stream makes splitmuxsink finish the segment, which it
+    // tells us about once it is closed.
+    for (auto* element : splitmuxsinks) {
+        GstPad* pad = gst_element_get_static_pad(element, "video");
+        if (pad != nullptr) {
+            gst_pad_send_event(pad, gst_event_new_eos());
+            gst_object_unref(pad);
+        }
+        gst_object_unref(element);
+    }
+
+    const gint64 deadline_us = g_get_monotonic_time() + finish_timeout_us;
+    std::size_t closed = 0;
+    while (closed < splitmuxsinks.size()) {
+        const gint64 left_us = deadline_us - g_get_monotonic_time();
+        if (left_us <= 0) {
+            break;
+        }
+        GstMessage* message = gst_bus_timed_pop_filtered(bus, left_us * GST_USECOND, GST_MESSAGE_ELEMENT);
+        if (message == nullptr) {
+            break;
+        }
+        const GstStructure* structure = gst_message_get_structure(message);
+        if (structure != nullptr && gst_structure_has_name(structure, "splitmuxsink-fragment-closed")) {
+            ++closed;
+        }
+        gst_message_unref(message);
+    }
+
+    if (closed < splitmuxsinks.size()) {
+        std::cerr << "Recording: segment not finished within "
+                  << finish_timeout_us / G_USEC_PER_SEC << " s" << std::endl;
+    }
+}
+
+void Upstream::schedule_reconnect(const std::string& reason)
+{
+    if (_reconnect_source != 0) {
+        return;
+    }
+
+    const guint delay_ms = std::min(reconnect_delay_min_ms << std::min(_attempt, 4u), reconnect_delay_max_ms);
+    ++_attempt;
+
+    std::cout << "Camera stream: " << reason << ", reconnecting in " << delay_ms << " ms" << std::endl;
+    _reconnect_source = g_timeout_add(delay_ms, on_reconnect, this);
+}
+
+gboolean Upstream::on_reconnect(gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+    self->_reconnect_source = 0;
+
+    self->disconnect();
+    if (!self->connect()) {
+        self->schedule_reconnect("could not connect");
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+gboolean Upstream::on_watchdog(gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+
+    const gint64 now_us = g_get_monotonic_time();
+    const gint64 last_sample_us = self->_last_sample_us;
+
+    if (self->_pipeline != nullptr && self->_reconnect_source == 0) {
+        if (last_sample_us > self->_connected_us) {
+            if (self->_attempt != 0) {
+                std::cout << "Camera stream: receiving" << std::endl;
+                self->_attempt = 0;
+            }
+        }
+        if (now_us - std::max(last_sample_us, self->_connected_us) > stall_timeout_us) {
+            self->schedule_reconnect("no data");
+        }
+    }
+
+    // Hold the last image while there is nothing coming.
+    if (now_us - last_sample_us > static_cast<gint64>(hold_interval_ms) * 1000) {
+        std::lock_guard<std::mutex> lock(self->_mutex);
+        if (self->_last_keyframe != nullptr) {
+            for (auto& [media, appsrc] : self->_appsrcs) {
+                push_to(appsrc, self->_last_keyframe, false);
+            }
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean Upstream::on_select_stream(GstElement*, guint, GstCaps* caps, gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+
+    const GstStructure* structure = gst_caps_get_structure(caps, 0);
+    if (g_strcmp0(gst_structure_get_string(structure, "media"), "video") != 0) {
+        return FALSE;
+    }
+
+    const gchar* encoding_name = gst_structure_get_string(structure, "encoding-name");
+    std::string codec;
+    if (g_strcmp0(encoding_name, "H264") == 0) {
+        codec = "h264";
+    } else if (g_strcmp0(encoding_name, "H265") == 0) {
+        codec = "h265";
+    } else {
+        std::cerr << "Camera stream: unsupported encoding " << (encoding_name ? encoding_name : "(none)") << std::endl;
+        return FALSE;
+    }
+
+    std::lock_guard<std::mutex> lock(self->_mutex);
+    if (codec == self->_codec) {
+        return TRUE;
+    }
+
+    // Our depayloader wouldn't link, don't even set it up and rebuild instead.
+    self->_codec = codec;
+    g_idle_add(on_codec_changed, self);
+    return FALSE;
+}
+
+gboolean Upstream::on_codec_changed(gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+
+    std::string codec;
+    {
+        std::lock_guard<std::mutex> lock(self->_mutex);
+        codec = self->_codec;
+
+        // None of it can be sent with the new payloader, and the media which
+        // were set up for the old one are done.
+        gst_caps_replace(&self->_caps, nullptr);
+        gst_buffer_replace(&self->_last_keyframe, nullptr);
+        self->clear_gop_cache();
+        self->_gop_cache_complete = false;
+        for (auto& [media, appsrc] : self->_appsrcs) {
+            g_signal_handlers_disconnect_by_data(media, self);
+            gst_object_unref(appsrc);
+            g_object_unref(media);
+        }
+        self->_appsrcs.clear();
+    }
+
+    std::cout << "Camera stream: codec changed to " << codec << std::endl;
+
+    const std::string launch = self->media_launch();
+    for (auto* factory : self->_factories) {
+        gst_rtsp_media_factory_set_launch(factory, launch.c_str());
+    }
+
+    if (self->_codec_changed_callback) {
+        self->_codec_changed_callback(codec);
+    }
+
+    if (self->_reconnect_source != 0) {
+        g_source_remove(self->_reconnect_source);
+        self->_reconnect_source = 0;
+    }
+    self->_attempt = 0;
+    self->disconnect();
+    if (!self->connect()) {
+        self->schedule_reconnect("could not connect");
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+gboolean Upstream::on_bus_message(GstBus*, GstMessage* message, gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+
+    switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_ERROR: {
+            GError* error = nullptr;
+            gst_message_parse_error(message, &error, nullptr);
+            self->schedule_reconnect(std::string("error from ") + GST_OBJECT_NAME(message->src) + ": " + error->message);
+            g_error_free(error);
+            break;
+        }
+        case GST_MESSAGE_EOS:
+            self->schedule_reconnect("end of stream");
+            break;
+        default:
+            break;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+GstFlowReturn Upstream::on_new_sample(GstAppSink* appsink, gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+
+    GstSample* sample = gst_app_sink_pull_sample(appsink);
+    if (sample == nullptr) {
+        return GST_FLOW_EOS;
+    }
+
+    self->_last_sample_us = g_get_monotonic_time();
+    self->push(gst_sample_get_caps(sample), gst_sample_get_buffer(sample));
+    gst_sample_unref(sample);
+
+    return GST_FLOW_OK;
+}
+
+void Upstream::push(GstCaps* caps, GstBuffer* buffer)
+{
+    if (buffer == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (caps != nullptr && (_caps == nullptr || !gst_caps_is_equal(caps, _caps))) {
+        gst_caps_replace(&_caps, caps);
+        for (auto& [media, appsrc] : _appsrcs) {
+            gst_app_src_set_caps(appsrc, _caps);
+        }
+    }
+
+    cache(buffer);
+
+    for (auto& [media, appsrc] : _appsrcs) {
+        push_to(appsrc, buffer, _discont);
+    }
+    _discont = false;
+}
+
+void Upstream::cache(GstBuffer* buffer)
+{
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        gst_buffer_replace(&_last_keyframe, buffer);
+        clear_gop_cache();
+        _gop_cache_complete = true;
+    }
+
+    if (!_gop_cache_complete) {
+        return;
+    }
+
+    const std::size_t size = gst_buffer_get_size(buffer);
+    if (_gop_cache_bytes + size > _gop_cache_limit_bytes) {
+        // New clients will have to wait for the next keyframe.
+        clear_gop_cache();
+        _gop_cache_complete = false;
+        ++_gop_cache_overflows;
+        return;
+    }
+
+    _gop_cache.push_back(gst_buffer_ref(buffer));
+    _gop_cache_bytes += size;
+}
+
+void Upstream::clear_gop_cache()
+{
+    for (auto* buffer : _gop_cache) {
+        gst_buffer_unref(buffer);
+    }
+    _gop_cache.clear();
+    _gop_cache_bytes = 0;
+}
+
+std::string Upstream::gop_cache_status()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return "gop_cache_bytes=" + std::to_string(_gop_cache_bytes) +
+        " gop_cache_frames=" + std::to_string(_gop_cache.size()) +
+        " gop_cache_limit=" + std::to_string(_gop_cache_limit_bytes) +
+        " gop_cache_overflows=" + std::to_string(_gop_cache_overflows);
+}
+
+void Upstream::attach(GstRTSPMedia* media, GstAppSrc* appsrc)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_caps != nullptr) {
+        gst_app_src_set_caps(appsrc, _caps);
+    }
+
+    // Start with the current group of pictures, or at least the last keyframe.
+    if (!_gop_cache.empty()) {
+        bool first = true;
+        for (auto* buffer : _gop_cache) {
+            push_to(appsrc, buffer, first);
+            first = false;
+        }
+    } else if (_last_keyframe != nullptr) {
+        push_to(appsrc, _last_keyframe, true);
+    }
+    _appsrcs.emplace_back(GST_RTSP_MEDIA(g_object_ref(media)), appsrc);
+}
+
+void Upstream::detach(GstRTSPMedia* media)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = std::find_if(_appsrcs.begin(), _appsrcs.end(), [&](const auto& entry) {
+        return entry.first == media;
+    });
+    if (it != _appsrcs.end()) {
+        gst_object_unref(it->second);
+        g_object_unref(it->first);
+        _appsrcs.erase(it);
+    }
+}
+
+void Upstream::on_media_configure(GstRTSPMediaFactory*, GstRTSPMedia* media, gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+
+    GstElement* element = gst_rtsp_media_get_element(media);
+    GstElement* appsrc = gst_bin_get_by_name(GST_BIN(element), "src");
+    gst_object_unref(element);
+
+    if (appsrc == nullptr) {
+        return;
+    }
+
+    self->attach(media, GST_APP_SRC(appsrc));
+    g_signal_connect(media, "unprepared", G_CALLBACK(on_media_unprepared), self);
+}
+
+void Upstream::on_media_unprepared(GstRTSPMedia* media, gpointer user_data)
+{
+    auto* self = static_cast<Upstream*>(user_data);
+
+    g_signal_handlers_disconnect_by_data(media, self);
+    self->detach(media);
+}
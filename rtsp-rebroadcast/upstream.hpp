@@ -0,0 +1,134 @@
+#pragma once
+
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The connection to the camera.
+//
+// The camera's RTSP stream is received, depayloaded and parsed once, in a
+// pipeline of its own which is not part of any RTSP server media. The media
+// only contain an appsrc and the payloader, and get the parsed access units
+// pushed into them.
+//
+// This way the connection to the camera can fail and be re-established
+// without tearing down the clients' sessions: while the camera is gone, the
+// last keyframe is repeated so clients keep showing the last image and don't
+// time out, and once it is back the stream continues with a discontinuity.
+//
+// The connection is started right away and kept up, whether there are
+// clients or not. The access units since the last keyframe are cached, so a
+// new client's media is started with a complete group of pictures and can
+// start decoding immediately instead of waiting for the next keyframe.
+//
+// The codec is taken from the camera's SDP. If it is not the one the
+// pipeline was built for (e.g. after it was changed in the camera settings),
+// the pipeline is rebuilt right away and the media factories are switched
+// to the matching payloader.
+//
+// Before the pipeline is torn down, for a reconnect, a codec change or when
+// shutting down, the recording segments being written are finished, so an
+// MP4 segment gets its index.
+
+class Upstream {
+public:
+    // The codec is what we expect until the camera tells us otherwise.
+    Upstream(std::string location, std::string codec, std::size_t gop_cache_limit_bytes);
+    ~Upstream();
+
+    Upstream(const Upstream&) = delete;
+    Upstream& operator=(const Upstream&) = delete;
+
+    // Additional branch fed with the parsed stream, in gst-launch syntax,
+    // e.g. "queue ! mpegtsmux ! udpsink host=... port=...".
+    // Needs to be added before start().
+    void add_branch(const std::string& branch);
+
+    // Branch which is created anew every time we connect, for the given codec.
+    void add_branch(std::function<std::string(const std::string& codec)> branch);
+
+    // Launch string for RTSP server media fed by us.
+    [[nodiscard]] std::string media_launch() const;
+
+    // Feed all media created by this factory. Its launch string is updated
+    // when the codec changes.
+    void serve(GstRTSPMediaFactory* factory);
+
+    // Called in the main loop after the codec has changed.
+    void set_codec_changed_callback(std::function<void(const std::string& codec)> callback)
+    {
+        _codec_changed_callback = std::move(callback);
+    }
+
+    void start();
+
+    // Memory used by the keyframe cache, in the key=value format of the stats.
+    [[nodiscard]] std::string gop_cache_status();
+
+private:
+    // Delay of the first reconnect attempt, doubled with every failed attempt.
+    static constexpr guint reconnect_delay_min_ms = 100;
+    static constexpr guint reconnect_delay_max_ms = 1000;
+    // Without data for this long, we assume the connection is dead.
+    static constexpr gint64 stall_timeout_us = 3 * G_USEC_PER_SEC;
+    // How often the last keyframe is repeated while we have no data.
+    static constexpr guint hold_interval_ms = 500;
+    // How long we wait for the recording segments to be finished.
+    static constexpr gint64 finish_timeout_us = 2 * G_USEC_PER_SEC;
+
+    [[nodiscard]] bool connect();
+    void disconnect();
+    void finish_recordings(GstBus* bus);
+    void schedule_reconnect(const std::string& reason);
+
+    void push(GstCaps* caps, GstBuffer* buffer);
+    void cache(GstBuffer* buffer);
+    void clear_gop_cache();
+    void attach(GstRTSPMedia* media, GstAppSrc* appsrc);
+    void detach(GstRTSPMedia* media);
+
+    static gboolean on_select_stream(GstElement* rtspsrc, guint num, GstCaps* caps, gpointer user_data);
+    static gboolean on_codec_changed(gpointer user_data);
+    static GstFlowReturn on_new_sample(GstAppSink* appsink, gpointer user_data);
+    static gboolean on_bus_message(GstBus* bus, GstMessage* message, gpointer user_data);
+    static gboolean on_reconnect(gpointer user_data);
+    static gboolean on_watchdog(gpointer user_data);
+    static void on_media_configure(GstRTSPMediaFactory* factory, GstRTSPMedia* media, gpointer user_data);
+    static void on_media_unprepared(GstRTSPMedia* media, gpointer user_data);
+
+    const std::string _location;
+    std::vector<std::function<std::string(const std::string& codec)>> _branches;
+    std::vector<GstRTSPMediaFactory*> _factories;
+    std::function<void(const std::string& codec)> _codec_changed_callback;
+
+    GstElement* _pipeline{nullptr};
+    guint _reconnect_source{0};
+    guint _watchdog_source{0};
+    unsigned _attempt{0};
+    gint64 _connected_us{0};
+    std::atomic<gint64> _last_sample_us{0};
+
+    mutable std::mutex _mutex;
+    // Set from rtspsrc's thread once the SDP is in.
+    std::string _codec;
+    std::vector<std::pair<GstRTSPMedia*, GstAppSrc*>> _appsrcs;
+    GstCaps* _caps{nullptr};
+    GstBuffer* _last_keyframe{nullptr};
+    bool _discont{false};
+
+    const std::size_t _gop_cache_limit_bytes;
+    std::vector<GstBuffer*> _gop_cache;
+    std::size_t _gop_cache_bytes{0};
+    // False if the current group of pictures did not fit.
+    bool _gop_cache_complete{false};
+    unsigned _gop_cache_overflows{0};
+};